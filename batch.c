@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "ndsdisasm.h"
+
+// -b: disassembles every static module, overlay and autoload in the ROM. The
+// ROM is mapped and the static modules are decompressed once, in a context
+// the one of each module shares them with, and the modules are disassembled
+// on a pool of threads.
+
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+struct BatchPool
+{
+    struct NdsDisasm *parent;
+    const struct NdsDisasmOptions *options;
+    const struct Module *modules;
+    int count;
+    const char *configFileName;
+    const char *directory;
+    bool exportSymbols;
+    uint32_t *sizes;            // with exportSymbols, the size of each module
+    pthread_mutex_t lock;
+    int next;
+    int failed;
+};
+
+struct BatchModule
+{
+    struct BatchPool *pool;
+    const struct Module *module;
+    const char *path;
+    uint32_t size;
+};
+
+static void batch_module_step(struct NdsDisasm *disasm, void *arg)
+{
+    struct BatchModule *job = arg;
+    const struct Module *module = job->module;
+
+    load_share(disasm, job->pool->parent);
+    load_module(disasm, module);
+    // decompressing may have made a static module bigger than the header says
+    job->size = (module->overlay == -1 && module->autoload == -1) ? disasm->inputFileBufferSize : module->size;
+    if (job->pool->exportSymbols)
+        disasm->symbolExportFile = job->path;
+    read_config(disasm, job->pool->configFileName);
+    disasm_analyze_module(disasm);
+    disasm_emit(disasm, NULL, NULL);
+}
+
+// Disassembles one module into the directory in a context of its own, or
+// with exportSymbols, only writes out its symbols for the index.
+static bool batch_module(struct BatchPool *pool, int index)
+{
+    struct NdsDisasmOptions options = *pool->options;
+    struct BatchModule job = {pool, &pool->modules[index], NULL, 0};
+    struct NdsDisasm *disasm;
+    char path[1024];
+    bool ok;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", pool->directory, job.module->name, pool->exportSymbols ? "sym" : "s");
+    job.path = path;
+    options.printThreads = 1;
+    options.outputFileName = pool->exportSymbols ? NULL : path;
+    // each would be one path every module writes to at once
+    options.splitDirectory = options.elfFileName = options.uncompressedFileName = NULL;
+    disasm = ndsdisasm_create(&options);
+    if (disasm == NULL)
+    {
+        fprintf(stderr, "error: disassembling %s failed: out of memory\n", job.module->name);
+        return false;
+    }
+    ok = context_run(disasm, batch_module_step, &job);
+    if (!ok)
+        fprintf(stderr, "error: disassembling %s failed: %s\n", job.module->name, ndsdisasm_error(disasm));
+    else if (pool->sizes != NULL)
+        pool->sizes[index] = job.size;
+    ndsdisasm_destroy(disasm);
+    return ok;
+}
+
+static void *batch_main(void *arg)
+{
+    struct BatchPool *pool = arg;
+
+    while (1)
+    {
+        int index;
+
+        pthread_mutex_lock(&pool->lock);
+        index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->count)
+            return NULL;
+        if (!batch_module(pool, index))
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed++;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+// Runs batch_module on every module, jobs at a time, and returns how many
+// failed. If a thread can't be started, the ones that were take its share.
+static int batch_pool(struct BatchPool *pool, int jobs)
+{
+    pthread_t *threads = calloc(jobs, sizeof(*threads));
+    int started = 0;
+
+    pool->next = 0;
+    pool->failed = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    if (threads != NULL)
+    {
+        for (; started < jobs - 1 && started < pool->count - 1; started++)
+        {
+            if (pthread_create(&threads[started], NULL, batch_main, pool) != 0)
+                break;
+        }
+    }
+    batch_main(pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    free(threads);
+    return pool->failed;
+}
+
+struct BatchList
+{
+    const char *romFileName;
+    const char *directory;
+    struct Module *modules;
+    int count;
+};
+
+static void batch_list_step(struct NdsDisasm *disasm, void *arg)
+{
+    struct BatchList *list = arg;
+
+    list->count = load_modules(disasm, list->romFileName, &list->modules);
+#ifdef _WIN32
+    if (_mkdir(list->directory) != 0 && errno != EEXIST)
+#else
+    if (mkdir(list->directory, 0777) != 0 && errno != EEXIST)
+#endif
+        fatal_error("failed to create batch output directory %s: %s", list->directory, strerror(errno));
+}
+
+struct BatchIndex
+{
+    const char *indexFile;
+    const struct SymbolModule *modules;
+    int count;
+};
+
+static void batch_index_step(struct NdsDisasm *disasm, void *arg)
+{
+    struct BatchIndex *index = arg;
+
+    symbols_build(disasm, index->indexFile, index->modules, index->count);
+}
+
+// Analyzes every module for its symbols and builds the index from them.
+static bool batch_symbols(struct BatchPool *pool, int jobs)
+{
+    struct SymbolModule *symbolModules = calloc(max(pool->count, 1), sizeof(*symbolModules));
+    char (*symbolFiles)[1024] = calloc(max(pool->count, 1), sizeof(*symbolFiles));
+    struct BatchIndex index = {pool->options->symbolIndexFile, symbolModules, pool->count};
+    bool ok = false;
+    int failed;
+
+    pool->sizes = calloc(max(pool->count, 1), sizeof(*pool->sizes));
+    if (symbolModules == NULL || symbolFiles == NULL || pool->sizes == NULL)
+        fprintf(stderr, "error: failed to alloc module list\n");
+    else if ((failed = batch_pool(pool, jobs)) != 0)
+        fprintf(stderr, "error: %d of %d modules failed\n", failed, pool->count);
+    else
+    {
+        for (int i = 0; i < pool->count; i++)
+        {
+            const struct Module *module = &pool->modules[i];
+
+            snprintf(symbolFiles[i], sizeof(symbolFiles[i]), "%s/%s.sym", pool->directory, module->name);
+            symbolModules[i].name = module->name;
+            symbolModules[i].isArm7 = module->isArm7;
+            symbolModules[i].ramStart = module->ramStart;
+            symbolModules[i].size = pool->sizes[i];
+            symbolModules[i].symbolFile = symbolFiles[i];
+        }
+        ok = context_run(pool->parent, batch_index_step, &index);
+        if (!ok)
+            fprintf(stderr, "error: %s\n", ndsdisasm_error(pool->parent));
+        for (int i = 0; i < pool->count; i++)
+            remove(symbolFiles[i]);
+    }
+    free(pool->sizes);
+    pool->sizes = NULL;
+    free(symbolModules);
+    free(symbolFiles);
+    return ok;
+}
+
+bool ndsdisasm_batch(const struct NdsDisasmOptions *options, const char *romFileName,
+                     const char *configFileName, const char *directory, int jobs)
+{
+    struct BatchList list = {romFileName, directory, NULL, 0};
+    struct BatchPool pool = {0};
+    struct NdsDisasm *parent = ndsdisasm_create(options);
+    bool ok = false;
+    int failed;
+
+    if (parent == NULL)
+    {
+        fprintf(stderr, "error: failed to alloc a context\n");
+        return false;
+    }
+    if (jobs == 0)
+#ifdef _WIN32
+        jobs = max(pthread_num_processors_np(), 1);
+#else
+        jobs = max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+    if (!context_run(parent, batch_list_step, &list))
+        fprintf(stderr, "error: %s\n", ndsdisasm_error(parent));
+    else
+    {
+        pool.parent = parent;
+        pool.options = options;
+        pool.modules = list.modules;
+        pool.count = list.count;
+        pool.configFileName = configFileName;
+        pool.directory = directory;
+        pool.exportSymbols = options->symbolIndexFile != NULL;
+        if (!pool.exportSymbols || batch_symbols(&pool, jobs))
+        {
+            pool.exportSymbols = false;
+            failed = batch_pool(&pool, jobs);
+            if (failed != 0)
+                fprintf(stderr, "error: %d of %d modules failed\n", failed, pool.count);
+            ok = failed == 0;
+        }
+    }
+    free(list.modules);
+    ndsdisasm_destroy(parent);
+    return ok;
+}
@@ -0,0 +1,240 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ndsdisasm.h"
+
+// The library's entry points, see libndsdisasm.h. Each runs its step of the
+// disassembly on the context, and a fatal error on the way jumps back to it
+// instead of exiting. A step that can fail keeps what it
+// has allocated or opened in the context, to be released along with it, or
+// releases it itself before failing.
+
+static _Thread_local jmp_buf *sErrorJump;
+static _Thread_local char *sErrorMessage; // where the message goes on the way
+
+noreturn void fatal_error(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    if (sErrorJump != NULL)
+    {
+        vsnprintf(sErrorMessage, CONTEXT_ERROR_SIZE, fmt, args);
+        va_end(args);
+        longjmp(*sErrorJump, 1);
+    }
+    fputs("error: ", stderr);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputs("\n", stderr);
+    exit(1);
+}
+
+// Runs step on disasm. Returns false if it failed, which leaves disasm failed.
+bool context_run(struct NdsDisasm *disasm, void (*step)(struct NdsDisasm *disasm, void *arg), void *arg)
+{
+    jmp_buf *callerJump = sErrorJump;
+    char *callerMessage = sErrorMessage;
+    jmp_buf jump;
+
+    sErrorJump = &jump;
+    sErrorMessage = disasm->error;
+    disasm_thread_reset();
+    if (setjmp(jump) == 0)
+        step(disasm, arg);
+    else
+        disasm->failed = true;
+    disasm_thread_reset();
+    sErrorJump = callerJump;
+    sErrorMessage = callerMessage;
+    return !disasm->failed;
+}
+
+// Runs job on a thread a disassembly started, such as a worker, or inside a
+// library call that has something to release before it fails. Returns false
+// if it failed, with the message in error, which holds CONTEXT_ERROR_SIZE
+// chars, for the thread running the library call to raise.
+bool context_run_job(void (*job)(void *arg), void *arg, char *error)
+{
+    jmp_buf *callerJump = sErrorJump;
+    char *callerMessage = sErrorMessage;
+    jmp_buf jump;
+    bool ok = true;
+
+    sErrorJump = &jump;
+    sErrorMessage = error;
+    if (setjmp(jump) == 0)
+        job(arg);
+    else
+        ok = false;
+    sErrorJump = callerJump;
+    sErrorMessage = callerMessage;
+    return ok;
+}
+
+// Whether disasm got as far as stage and no further. If not, the call fails
+// without failing disasm.
+static bool context_ready(struct NdsDisasm *disasm, enum ContextStage stage)
+{
+    const char *message;
+
+    if (disasm->failed)
+        return false;
+    if (disasm->stage == stage)
+        return true;
+    if (disasm->stage == CONTEXT_CREATED)
+        message = "no module is loaded";
+    else if (disasm->stage == CONTEXT_SERVED)
+        message = "the module has been served";
+    else if (disasm->stage < stage)
+        message = "the module isn't analyzed";
+    else if (stage == CONTEXT_CREATED)
+        message = "a module is already loaded";
+    else
+        message = "the module is already analyzed";
+    snprintf(disasm->error, sizeof(disasm->error), "%s", message);
+    return false;
+}
+
+void ndsdisasm_options_init(struct NdsDisasmOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->overlay = -1;
+    options->autoload = -1;
+    options->printThreads = 1;
+}
+
+static void create_step(struct NdsDisasm *disasm, void *arg)
+{
+    bool *ok = arg;
+
+    *ok = load_init(disasm) && disasm_init(disasm) && symbols_init(disasm);
+}
+
+struct NdsDisasm *ndsdisasm_create(const struct NdsDisasmOptions *options)
+{
+    struct NdsDisasm *disasm = calloc(1, sizeof(*disasm));
+    bool ok = false;
+
+    if (disasm == NULL)
+        return NULL;
+    disasm->options = *options;
+    if (!context_run(disasm, create_step, &ok) || !ok)
+    {
+        ndsdisasm_destroy(disasm);
+        return NULL;
+    }
+    return disasm;
+}
+
+static void destroy_step(struct NdsDisasm *disasm, void *arg)
+{
+    (void)arg;
+    disasm_free(disasm);
+    symbols_free(disasm);
+    load_free(disasm);
+}
+
+void ndsdisasm_destroy(struct NdsDisasm *disasm)
+{
+    if (disasm == NULL)
+        return;
+    context_run(disasm, destroy_step, NULL);
+    free(disasm);
+}
+
+const char *ndsdisasm_error(const struct NdsDisasm *disasm)
+{
+    return disasm->error;
+}
+
+static void load_step(struct NdsDisasm *disasm, void *arg)
+{
+    read_input_file(disasm, arg);
+}
+
+bool ndsdisasm_load(struct NdsDisasm *disasm, const char *romFileName)
+{
+    if (!context_ready(disasm, CONTEXT_CREATED) || !context_run(disasm, load_step, (void *)romFileName))
+        return false;
+    disasm->stage = CONTEXT_LOADED;
+    return true;
+}
+
+static void config_step(struct NdsDisasm *disasm, void *arg)
+{
+    read_config(disasm, arg);
+}
+
+bool ndsdisasm_load_config(struct NdsDisasm *disasm, const char *configFileName)
+{
+    return context_ready(disasm, CONTEXT_LOADED) && context_run(disasm, config_step, (void *)configFileName);
+}
+
+static void analyze_step(struct NdsDisasm *disasm, void *arg)
+{
+    (void)arg;
+    disasm_analyze_module(disasm);
+}
+
+bool ndsdisasm_analyze(struct NdsDisasm *disasm)
+{
+    if (!context_ready(disasm, CONTEXT_LOADED) || !context_run(disasm, analyze_step, NULL))
+        return false;
+    disasm->stage = CONTEXT_ANALYZED;
+    return true;
+}
+
+struct EmitArgs
+{
+    char **text;
+    size_t *size;
+};
+
+static void emit_step(struct NdsDisasm *disasm, void *arg)
+{
+    struct EmitArgs *args = arg;
+
+    disasm_emit(disasm, args->text, args->size);
+}
+
+bool ndsdisasm_emit(struct NdsDisasm *disasm)
+{
+    struct EmitArgs args = {NULL, NULL};
+
+    return context_ready(disasm, CONTEXT_ANALYZED) && context_run(disasm, emit_step, &args);
+}
+
+bool ndsdisasm_emit_buffer(struct NdsDisasm *disasm, char **text, size_t *size)
+{
+    struct EmitArgs args = {text, size};
+
+    *text = NULL;
+    *size = 0;
+    return context_ready(disasm, CONTEXT_ANALYZED) && context_run(disasm, emit_step, &args);
+}
+
+static void serve_step(struct NdsDisasm *disasm, void *arg)
+{
+    disasm_resident_open(disasm);
+    server_run(disasm, arg);
+    disasm_resident_close(disasm);
+}
+
+bool ndsdisasm_serve(struct NdsDisasm *disasm, const char *socketPath)
+{
+    if (!context_ready(disasm, CONTEXT_LOADED))
+        return false;
+    disasm->stage = CONTEXT_SERVED;
+    return context_run(disasm, serve_step, (void *)socketPath);
+}
+
+int ndsdisasm_query(const char *socketPath, const char *request)
+{
+    return server_query(socketPath, request);
+}
@@ -1,17 +1,36 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <capstone.h>
 
 #include "ndsdisasm.h"
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
 
-uint32_t ROM_LOAD_ADDR;
 #define UNKNOWN_SIZE (uint32_t)-1
+#define NO_SPLICE (uint32_t)-1
 
 enum BranchType
 {
@@ -44,22 +63,429 @@ struct Label
     enum BranchType branchType;
     uint32_t size;
     bool processed;
+    bool queued; // currently in worklist
     bool isFunc; // 100% sure it's a function, which cannot be changed to BRANCH_TYPE_B.
     bool isFromConfig;
+    bool unnamed; // plainly branched to, so a name from the config doesn't stick
+    uint32_t splice; // where its trace joined one traced before, for -R
     char *name;
+    int analyzeCount;
+};
+
+#define LABEL_ORDER_BUFFER_SIZE 256
+
+// What each trace added or looked up, by label address, for -R and the
+// server's xrefs
+struct AnalysisEdge
+{
+    uint32_t from;
+    uint32_t to;
+    bool added;
+    bool restored; // saved with a label that wasn't traced again
+};
+
+// Capstone handles and the buffer they decode into.
+struct Decoder
+{
+    csh capstone;      // ARM mode
+    csh capstoneThumb; // Thumb mode, so decoding never switches modes
+    cs_insn *buffer;
+};
+
+// Text printed while a chunk of the disassembly is formatted ahead on a worker
+// thread, to be written out once everything before it has been.
+struct OutBuffer
+{
+    char *data;
+    size_t size;
+    size_t bufferSize;
+};
+
+// Instructions decoded so far for the label being analyzed. Decoding happens
+// on demand, one instruction at a time into preallocated slots, so that only
+// the bytes analysis actually looks at go through capstone. Slots never move,
+// which keeps earlier instructions valid for the jump table lookback.
+struct DecodeWindow
+{
+    struct DecodedInsn *insns;
+    int count;
+    enum LabelType type;
+    uint32_t next;     // address the next instruction is decoded at
+    uint32_t end;      // decoding never goes past this address
+};
+
+// How far the instructions traced so far match one of the jump table patterns.
+struct JumpTableState
+{
+    int state;
+    int insnIdx;          // window index of the instruction being matched
+    uint32_t tableBegin;
+    bool gracePeriod;     // sometimes another instruction (like a mov) can interrupt
+    bool isBx;
+    bool cutOff;          // the table ran into the end of the window
+};
+
+// Everything one disassembly keeps, see struct NdsDisasm
+struct DisasmState
+{
+    struct NdsDisasm *disasm;  // the context this is part of
+    bool opened;               // capstone and the store, see disasm_open
+
+    struct Label *labels;
+    int labelsCount;
+    int labelBufferCount;
+    int *labelHash;            // open-addressed index of labels keyed by address, -1 = empty slot
+    uint32_t labelHashMask;
+    int *labelOrder;           // indices into labels, sorted by address
+    int labelOrderCount;
+    int labelOrderPending[LABEL_ORDER_BUFFER_SIZE]; // recently added, not yet merged into labelOrder
+    int labelOrderPendingCount;
+    int *worklist;             // binary min-heap of labels waiting to be analyzed
+    int worklistCount;
+    int worklistBufferCount;
+    struct AnalysisEdge *edges;
+    int edgesCount;
+    int edgesBufferCount;
+    int tracing;               // label analyze_code is tracing, or -1
+    int *restored;             // indices into labels of those restored and not traced again
+    int restoredCount;
+    bool resident;             // kept loaded for the server, see disasm_resident_open
+    struct Decoder decoder;
+
+    // Every instruction decoded so far, keyed by address and mode, so that the
+    // printer reuses what analysis decoded instead of running capstone again.
+    struct DecodedInsn *insns;
+    int insnsCount;
+    int insnsBufferCount;
+    int *insnHash;
+    uint32_t insnHashMask;
+    char *insnText;
+    size_t insnTextSize;
+    size_t insnTextBufferSize;
+    uint64_t bytesDecoded;
+    // One bit per halfword of the module: nothing decodes in Thumb mode from that
+    // halfword alone. Set while resyncing, so each one only goes through capstone once.
+    uint32_t *thumbUndecodable;
+    uint64_t fastDecoded, capstoneDecoded;
+    bool fastDecode;           // whether the fast path is on, see fast_decoder_gate
+
+    struct OutBuffer sinkBuffers[2];
+    int sinkFill;              // buffer being formatted into
+    bool sinkBusy;             // the other one is being written
+    bool sinkExit;
+    bool sinkOpen;
+    int sinkFd;
+    bool sinkIsFile;
+    bool sinkPreallocated;     // to be truncated to what was written
+    int sinkError;             // errno of a write that failed, for the main thread to report
+    pthread_t sinkThread;
+    pthread_mutex_t sinkLock;
+    pthread_cond_t sinkCond;
+    uint64_t sinkBytes;
+    double sinkWriteTime, sinkWaitTime;
+
+    struct DecodeWindow window;
+    uint64_t bytesUsed, bytesWindowed;
+    struct JumpTableState jumpTable;
+
+    // One bit per halfword of the module for each decoding mode (ARM, Thumb):
+    // where traced instructions start with nothing in the window for the
+    // lookbacks of analyze_code to find, which halfwords they occupy, and the
+    // last halfword of those traces stopped after. A trace that reaches such
+    // a start in the same mode with an empty lookback of its own stops where
+    // that trace did, because everything up to there has been seen before.
+    uint32_t *codeStarts[2];
+    uint32_t *codeCovered[2];
+    uint32_t *codeStops[2];
+    int splicedTraces;
+    bool noSplice;             // for the check of -V
+
+    struct PrintWorker *workers;
+    int workersCount;
+    pthread_mutex_t workersLock;
+    pthread_cond_t batchStart;
+    pthread_cond_t batchDone;
+    int batchGeneration;
+    int batchBusy;             // workers still running the current batch
+    bool workersExit;
+    void (*batchJob)(struct DisasmState *st, struct PrintWorker *worker, int index);
+    int batchCount;            // jobs in the current batch
+    int batchNext;             // next job to hand out
+
+    struct AnalysisConfig *config; // the config labels of this run
+    int configCount;
+    int seededCount;           // how many of restored have their coverage in place
+    uint32_t *restoredCoverage; // as saved
+    uint64_t analysisKey;
+    char analysisPath[1024];
+    uint8_t *analysisFile;     // the database analysis_restore has mapped
+    size_t analysisFileSize;
+    uint8_t *restoreState;     // analysis_restore's SAVED_ flags per saved label
+    int *restoreStack;
+    uint8_t *restoreStale;     // halfwords stale traces went over
+
+    struct Blob *blobs;        // open addressing, size 0 if empty
+    uint32_t blobsMask;
+    int blobsCount;
+    uint64_t blobBytes;
+    char *blobPrefix;          // NULL unless -B is in effect
+    pthread_mutex_t blobsLock;
+
+    struct OutBuffer splitText; // the file being printed
+    char splitName[256];
+    uint32_t splitStart;
+    struct SplitFile *splitFiles; // written in this run
+    int splitFilesCount, splitFilesBufferCount;
+    struct SplitFile *splitOld; // from the previous index, by name
+    int splitOldCount;
+    int splitWritten, splitRemoved;
+
+    struct PrintChunk *printChunks;
+    int printChunksFormatted, printChunksReprinted;
+
+    struct ResidentLabel *residentConfig; // the config labels, and those added since
+    int residentConfigCount;
+    struct ResidentLabel *renames; // names given since, which outlast analysis
+    int renamesCount;
+    int *nameHash;             // open-addressed index of the named labels keyed by name, -1 = empty slot
+    uint32_t nameHashMask;
+    struct OutBuffer reply;
+    struct OutBuffer emitText; // see disasm_emit
 };
 
-struct Label *gLabels = NULL;
-int gLabelsCount = 0;
-static int sLabelBufferCount = 0;
-static csh sCapstone;
-static int sJumpTableInsnIdx = 0;
 
 const bool gOptionShowAddrComments = false;
 const int gOptionDataColumnWidth = 16;
 
-int disasm_add_label(uint32_t addr, enum LabelType type, char *name, bool is_config)
+static uint32_t label_hash(uint32_t addr)
+{
+    // labels are mostly word/halfword aligned, so mix the low bits in before masking
+    addr ^= addr >> 16;
+    addr *= 0x7FEB352D;
+    addr ^= addr >> 15;
+    addr *= 0x846CA68B;
+    addr ^= addr >> 16;
+    return addr;
+}
+
+static void label_hash_insert(struct DisasmState *st, int index)
+{
+    uint32_t slot = label_hash(st->labels[index].addr) & st->labelHashMask;
+
+    while (st->labelHash[slot] != -1)
+        slot = (slot + 1) & st->labelHashMask;
+    st->labelHash[slot] = index;
+}
+
+static int label_hash_find(struct DisasmState *st, uint32_t addr)
+{
+    uint32_t slot;
+
+    if (st->labelHash == NULL)
+        return -1;
+    slot = label_hash(addr) & st->labelHashMask;
+    while (st->labelHash[slot] != -1)
+    {
+        if (st->labels[st->labelHash[slot]].addr == addr)
+            return st->labelHash[slot];
+        slot = (slot + 1) & st->labelHashMask;
+    }
+    return -1;
+}
+
+// Sizes the table to keep the load factor at or below 1/2 for the current
+// label buffer and reinserts every label. Must be called whenever labels are
+// moved around in labels (e.g. after sorting).
+static void label_hash_rebuild(struct DisasmState *st)
+{
+    uint32_t size = 16;
+
+    while (size < 2u * st->labelBufferCount)
+        size *= 2;
+    if (size - 1 != st->labelHashMask || st->labelHash == NULL)
+    {
+        free(st->labelHash);
+        st->labelHash = malloc(size * sizeof(*st->labelHash));
+        if (st->labelHash == NULL)
+            fatal_error("failed to alloc space for label index. ");
+        st->labelHashMask = size - 1;
+    }
+    memset(st->labelHash, -1, size * sizeof(*st->labelHash));
+    for (int i = 0; i < st->labelsCount; i++)
+        label_hash_insert(st, i);
+}
+
+// Merges the insertion buffer into the sorted run. The run must have room for
+// labelsCount entries.
+static void label_order_flush(struct DisasmState *st)
+{
+    int i, j, k;
+
+    // the buffer is small, so insertion sort is fine here
+    for (i = 1; i < st->labelOrderPendingCount; i++)
+    {
+        int idx = st->labelOrderPending[i];
+
+        for (j = i; j > 0 && st->labels[st->labelOrderPending[j - 1]].addr > st->labels[idx].addr; j--)
+            st->labelOrderPending[j] = st->labelOrderPending[j - 1];
+        st->labelOrderPending[j] = idx;
+    }
+    // merge from the back so that it can be done in place
+    i = st->labelOrderCount - 1;
+    j = st->labelOrderPendingCount - 1;
+    k = st->labelOrderCount + st->labelOrderPendingCount - 1;
+    while (j >= 0)
+    {
+        if (i >= 0 && st->labels[st->labelOrder[i]].addr > st->labels[st->labelOrderPending[j]].addr)
+            st->labelOrder[k--] = st->labelOrder[i--];
+        else
+            st->labelOrder[k--] = st->labelOrderPending[j--];
+    }
+    st->labelOrderCount += st->labelOrderPendingCount;
+    st->labelOrderPendingCount = 0;
+}
+
+static void label_order_insert(struct DisasmState *st, int index)
+{
+    if (st->labelOrderPendingCount == LABEL_ORDER_BUFFER_SIZE)
+        label_order_flush(st);
+    st->labelOrderPending[st->labelOrderPendingCount++] = index;
+}
+
+// Returns the index of the label with the closest address strictly after
+// (dir > 0) or strictly before (dir < 0) addr, or -1 if there is none.
+static int label_order_neighbor(struct DisasmState *st, uint32_t addr, int dir)
+{
+    int lo = 0, hi = st->labelOrderCount;
+    int best = -1;
+
+    // first position in the sorted run whose address is > addr (or >= addr when looking backwards)
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        uint32_t midAddr = st->labels[st->labelOrder[mid]].addr;
+
+        if (midAddr > addr || (dir < 0 && midAddr == addr))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (dir > 0 && lo < st->labelOrderCount)
+        best = st->labelOrder[lo];
+    else if (dir < 0 && lo > 0)
+        best = st->labelOrder[lo - 1];
+    for (int i = 0; i < st->labelOrderPendingCount; i++)
+    {
+        uint32_t pendAddr = st->labels[st->labelOrderPending[i]].addr;
+
+        if (dir > 0 ? (pendAddr > addr && (best == -1 || pendAddr < st->labels[best].addr))
+                    : (pendAddr < addr && (best == -1 || pendAddr > st->labels[best].addr)))
+            best = st->labelOrderPending[i];
+    }
+    return best;
+}
+
+// Reorders labels by address using the ordered index, so that the printer
+// can walk it front to back.
+static void label_order_apply(struct DisasmState *st)
+{
+    struct Label *sorted;
+
+    label_order_flush(st);
+    sorted = malloc(st->labelBufferCount * sizeof(*sorted));
+    if (sorted == NULL)
+        fatal_error("failed to alloc space for labels. ");
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        sorted[i] = st->labels[st->labelOrder[i]];
+        st->labelOrder[i] = i;
+    }
+    free(st->labels);
+    st->labels = sorted;
+    label_hash_rebuild(st);
+}
+
+// By default pending labels are analyzed in the order they were added (i.e. by
+// index), optionally by address so that neighbouring code gets decoded together.
+static bool worklist_before(struct DisasmState *st, int a, int b)
+{
+    if (st->disasm->options.analyzeInAddressOrder)
+        return st->labels[a].addr < st->labels[b].addr;
+    return a < b;
+}
+
+static void worklist_push(struct DisasmState *st, int index)
+{
+    int i;
+
+    if (st->labels[index].queued)
+        return;
+    if (st->worklistCount == st->worklistBufferCount)
+    {
+        st->worklistBufferCount = st->worklistBufferCount ? 2 * st->worklistBufferCount : 256;
+        st->worklist = realloc(st->worklist, st->worklistBufferCount * sizeof(*st->worklist));
+        if (st->worklist == NULL)
+            fatal_error("failed to alloc space for worklist. ");
+    }
+    st->labels[index].queued = true;
+    for (i = st->worklistCount++; i > 0 && worklist_before(st, index, st->worklist[(i - 1) / 2]); i = (i - 1) / 2)
+        st->worklist[i] = st->worklist[(i - 1) / 2];
+    st->worklist[i] = index;
+}
+
+static int worklist_pop(struct DisasmState *st)
 {
+    int top, last, i, child;
+
+    if (st->worklistCount == 0)
+        return -1;
+    top = st->worklist[0];
+    last = st->worklist[--st->worklistCount];
+    for (i = 0; (child = 2 * i + 1) < st->worklistCount; i = child)
+    {
+        if (child + 1 < st->worklistCount && worklist_before(st, st->worklist[child + 1], st->worklist[child]))
+            child++;
+        if (!worklist_before(st, st->worklist[child], last))
+            break;
+        st->worklist[i] = st->worklist[child];
+    }
+    st->worklist[i] = last;
+    st->labels[top].queued = false;
+    return top;
+}
+
+static void edge_add(struct DisasmState *st, uint32_t from, uint32_t to, bool added, bool restored)
+{
+    if (st->edgesCount == st->edgesBufferCount)
+    {
+        st->edgesBufferCount = st->edgesBufferCount ? 2 * st->edgesBufferCount : 0x1000;
+        st->edges = realloc(st->edges, st->edgesBufferCount * sizeof(*st->edges));
+        if (st->edges == NULL)
+            fatal_error("failed to alloc space for the analysis database. ");
+    }
+    st->edges[st->edgesCount].from = from;
+    st->edges[st->edgesCount].to = to;
+    st->edges[st->edgesCount].added = added;
+    st->edges[st->edgesCount].restored = restored;
+    st->edgesCount++;
+}
+
+static void analysis_edge(struct DisasmState *st, int to, bool added)
+{
+    if (st->tracing != -1 && (st->disasm->options.analysisDirectory != NULL || st->resident) && to != st->tracing)
+        edge_add(st, st->labels[st->tracing].addr, st->labels[to].addr, added, false);
+}
+
+// Marks the label as needing (re-)analysis.
+static void label_set_pending(struct DisasmState *st, int index)
+{
+    st->labels[index].processed = false;
+    worklist_push(st, index);
+}
+
+int disasm_add_label(struct NdsDisasm *disasm, uint32_t addr, enum LabelType type, char *name, bool is_config)
+{
+    struct DisasmState *st = disasm->disasm;
     int i;
     // if(addr < gRamStart) return 0;
     //printf("adding label 0x%08X\n", addr);
@@ -67,119 +493,276 @@ int disasm_add_label(uint32_t addr, enum LabelType type, char *name, bool is_con
     //assert(addr >= ROM_LOAD_ADDR && addr < ROM_LOAD_ADDR + gInputFileBufferSize);
     if ((type == LABEL_ARM_CODE && (addr & 3)) || (type == LABEL_THUMB_CODE && (addr & 1)))
         fatal_error("Label at 0x%08x is misaligned.\n", addr);
-    if (ROM_LOAD_ADDR == 0 && addr == 0)
+    if (disasm->romLoadAddr == 0 && addr == 0)
         return -1;
-    for (i = 0; i < gLabelsCount; i++)
+    if ((i = label_hash_find(st, addr)) != -1)
     {
-        if (gLabels[i].addr == addr)
-        {
-            gLabels[i].type = type;
-            return i;
-        }
-    }
+        bool retyped = st->labels[i].type != type;
 
-    i = gLabelsCount++;
+        st->labels[i].type = type;
+        analysis_edge(st, i, true);
+        // a restored label is done with, but when the label being traced
+        // comes first it would still have been waiting to be traced
+        if (retyped && st->restoredCount != 0 && st->tracing != -1 && st->labels[i].processed
+         && st->labels[i].analyzeCount == 0 && worklist_before(st, st->tracing, i))
+            label_set_pending(st, i);
+        return i;
+    }
 
-    if (gLabelsCount > sLabelBufferCount) // need realloc
+    if (st->labelsCount + 1 > st->labelBufferCount) // need realloc
     {
-        sLabelBufferCount = 2 * gLabelsCount;
-        gLabels = realloc(gLabels, sLabelBufferCount * sizeof(*gLabels));
+        st->labelBufferCount = 2 * (st->labelsCount + 1);
+        st->labels = realloc(st->labels, st->labelBufferCount * sizeof(*st->labels));
 
-        if (gLabels == NULL)
+        if (st->labels == NULL)
             fatal_error("failed to alloc space for labels. ");
+        // indices are unaffected by realloc, but the indices need room to grow
+        label_hash_rebuild(st);
+        st->labelOrder = realloc(st->labelOrder, st->labelBufferCount * sizeof(*st->labelOrder));
+        if (st->labelOrder == NULL)
+            fatal_error("failed to alloc space for label order. ");
     }
-    gLabels[i].addr = addr;
-    gLabels[i].type = type;
+
+    i = st->labelsCount++;
+    st->labels[i].addr = addr;
+    st->labels[i].type = type;
     if (type == LABEL_ARM_CODE || type == LABEL_THUMB_CODE)
-        gLabels[i].branchType = BRANCH_TYPE_BL;  // assume it's the start of a function
+        st->labels[i].branchType = BRANCH_TYPE_BL;  // assume it's the start of a function
     else
-        gLabels[i].branchType = BRANCH_TYPE_UNKNOWN;
-    gLabels[i].size = UNKNOWN_SIZE;
-    gLabels[i].processed = false;
-    gLabels[i].name = name;
-    gLabels[i].isFunc = false;
-    gLabels[i].isFromConfig = is_config;
+        st->labels[i].branchType = BRANCH_TYPE_UNKNOWN;
+    st->labels[i].size = UNKNOWN_SIZE;
+    st->labels[i].processed = true;
+    st->labels[i].queued = false;
+    st->labels[i].name = name;
+    st->labels[i].isFunc = false;
+    st->labels[i].isFromConfig = is_config;
+    st->labels[i].unnamed = false;
+    st->labels[i].analyzeCount = 0;
+    st->labels[i].splice = NO_SPLICE;
+    label_hash_insert(st, i);
+    label_order_insert(st, i);
+    analysis_edge(st, i, true);
 
-    if((unsigned)(addr - ROM_LOAD_ADDR) > gInputFileBufferSize)
+    if((unsigned)(addr - disasm->romLoadAddr) <= disasm->inputFileBufferSize)
     {
-        gLabels[i].processed = true;
+        label_set_pending(st, i);
     }
 
     return i;
 }
 
-void FreeLabels(void)
+void FreeLabels(struct DisasmState *st)
 {
-    for (int i = 0; i < gLabelsCount; i++) {
-        if (gLabels[i].name != NULL)
-            free(gLabels[i].name);
+    for (int i = 0; i < st->labelsCount; i++) {
+        if (st->labels[i].name != NULL)
+            free(st->labels[i].name);
     }
-    free(gLabels);
+    free(st->labels);
+    st->labels = NULL;
+    st->labelsCount = st->labelBufferCount = 0;
+    free(st->labelHash);
+    st->labelHash = NULL;
+    free(st->labelOrder);
+    st->labelOrder = NULL;
+    st->labelOrderCount = 0;
+    st->labelOrderPendingCount = 0;
+    free(st->worklist);
+    st->worklist = NULL;
+    st->worklistCount = st->worklistBufferCount = 0;
+    free(st->edges);
+    st->edges = NULL;
+    st->edgesCount = st->edgesBufferCount = 0;
 }
 
 // Utility Functions
 
-static struct Label *lookup_label(uint32_t addr)
+static struct Label *lookup_label(struct DisasmState *st, uint32_t addr)
 {
-    int i;
+    int i = label_hash_find(st, addr);
 
-    for (i = 0; i < gLabelsCount; i++)
-    {
-        if (gLabels[i].addr == addr)
-            return &gLabels[i];
-    }
-    return NULL;
+    if (i == -1)
+        return NULL;
+    analysis_edge(st, i, false);
+    return &st->labels[i];
 }
 
-static uint8_t byte_at(uint32_t addr)
+static uint8_t byte_at(struct DisasmState *st, uint32_t addr)
 {
-    assert(addr < ROM_LOAD_ADDR + gInputFileBufferSize);
-    return gInputFileBuffer[addr - ROM_LOAD_ADDR];
+    assert(addr < st->disasm->romLoadAddr + st->disasm->inputFileBufferSize);
+    return st->disasm->inputFileBuffer[addr - st->disasm->romLoadAddr];
 }
 
-static uint16_t hword_at(uint32_t addr)
+static uint16_t hword_at(struct DisasmState *st, uint32_t addr)
 {
-    return (byte_at(addr + 0) << 0)
-         | (byte_at(addr + 1) << 8);
+    return (byte_at(st, addr + 0) << 0)
+         | (byte_at(st, addr + 1) << 8);
 }
 
-static uint32_t word_at(uint32_t addr)
+static uint32_t word_at(struct DisasmState *st, uint32_t addr)
 {
-    return (byte_at(addr + 0) << 0)
-         | (byte_at(addr + 1) << 8)
-         | (byte_at(addr + 2) << 16)
-         | (byte_at(addr + 3) << 24);
+    return (byte_at(st, addr + 0) << 0)
+         | (byte_at(st, addr + 1) << 8)
+         | (byte_at(st, addr + 2) << 16)
+         | (byte_at(st, addr + 3) << 24);
 }
 
-static int get_unprocessed_label_index(void)
+// Wall clock time, since clock() adds up the time of all threads.
+double wall_time(void)
 {
-    int i;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Decoded Instructions
 
-    for (i = 0; i < gLabelsCount; i++)
+// Copy of the capstone operand fields that analysis and printing look at. The
+// union mirrors the one in cs_arm_op, so reading reg from an immediate or
+// memory operand gives the same value it would on capstone's copy.
+struct InsnOperand
+{
+    uint8_t type;       // arm_op_type
+    uint8_t shiftType;  // arm_shifter
+    uint8_t shiftValue;
+    bool subtracted;
+    union
     {
-        if (!gLabels[i].processed)
-            return i;
-    }
-    return -1;
+        int32_t reg;
+        int32_t imm;
+        int32_t base;   // mem.base
+    };
+    int32_t index;      // mem.index
+    int32_t disp;       // mem.disp
+};
+
+enum
+{
+    INSN_VALID     = 1 << 0,
+    INSN_BRANCH    = 1 << 1,
+    INSN_RETURN    = 1 << 2,
+    INSN_POOL_LOAD = 1 << 3,
+    INSN_THUMB     = 1 << 4,
+};
+
+#define INSN_NO_TEXT 0xFFFFFFFF
+
+struct DecodedInsn
+{
+    uint32_t addr;
+    uint16_t id;        // arm_insn
+    uint8_t size;
+    uint8_t cc;         // arm_cc
+    uint8_t flags;      // INSN_*
+    uint8_t opCount;
+    struct InsnOperand ops[3];
+    uint32_t text;      // offset of "mnemonic\0op_str\0" in insnText
+};
+
+static _Thread_local int sResyncs, sResyncSkipped, sResyncKnown; // reported for the main thread
+// Worker threads only read the store. Set on a worker when it needed an
+// instruction the store doesn't have and the fast path doesn't take.
+static _Thread_local bool sIsWorker;
+static _Thread_local bool sWorkerMissed;
+
+static bool is_branch(const struct DecodedInsn *insn)
+{
+    return insn->flags & INSN_BRANCH;
+}
+
+static bool is_func_return(const struct DecodedInsn *insn)
+{
+    return insn->flags & INSN_RETURN;
+}
+
+static bool is_pool_load(const struct DecodedInsn *insn)
+{
+    return insn->flags & INSN_POOL_LOAD;
+}
+
+static bool is_valid_insn(const struct DecodedInsn *insn)
+{
+    return insn->flags & INSN_VALID;
+}
+
+static uint32_t get_pool_load(const struct DecodedInsn *insn, uint32_t currAddr, int mode)
+{
+    assert(is_pool_load(insn));
+
+    return (currAddr & ~3) + insn->ops[1].disp + ((mode == LABEL_ARM_CODE) ? 8 : 4);
+}
+
+static uint32_t get_branch_target(const struct DecodedInsn *insn)
+{
+    assert(is_branch(insn));
+    assert(insn->opCount > 0);
+
+    return insn->ops[0].imm;
+}
+
+static const char *insn_mnemonic(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    return st->insnText + insn->text;
+}
+
+static const char *insn_op_str(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    const char *mnemonic = insn_mnemonic(st, insn);
+
+    return mnemonic + strlen(mnemonic) + 1;
 }
 
-static bool is_branch(const struct cs_insn *insn)
+// What an instruction id alone says about capstone's instructions. Whether a
+// return or pool load candidate really is one depends on its operands.
+enum
+{
+    ID_BRANCH    = 1 << 0,
+    ID_RETURN    = 1 << 1,
+    ID_POOL_LOAD = 1 << 2,
+};
+
+static const uint8_t sInsnIdProps[ARM_INS_ENDING] =
+{
+    [ARM_INS_B]   = ID_BRANCH,
+    [ARM_INS_BL]  = ID_BRANCH,
+    [ARM_INS_BLX] = ID_BRANCH,
+    [ARM_INS_BX]  = ID_BRANCH | ID_RETURN,
+    [ARM_INS_MOV] = ID_RETURN,
+    [ARM_INS_POP] = ID_RETURN,
+    [ARM_INS_LDR] = ID_POOL_LOAD,
+};
+
+// Instruction groups that make an instruction valid, indexed by [isArm7][mode]:
+// the architecture the binary targets (v5T for the ARM9, v4T for the ARM7),
+// and the mode the label is decoded in.
+static const bool sValidGroups[2][2][ARM_GRP_ENDING] =
 {
-    switch (insn->id)
     {
-    case ARM_INS_B:
-    case ARM_INS_BX:
-    case ARM_INS_BL:
-    case ARM_INS_BLX:
-        return true;
-    }
-    return false;
+        { [ARM_GRP_V5T] = true, [ARM_GRP_ARM] = true },
+        { [ARM_GRP_V5T] = true, [ARM_GRP_THUMB] = true },
+    },
+    {
+        { [ARM_GRP_V4T] = true, [ARM_GRP_ARM] = true },
+        { [ARM_GRP_V4T] = true, [ARM_GRP_THUMB] = true },
+    },
+};
+
+static uint8_t insn_id_props(unsigned int id)
+{
+    return (id < ARM_INS_ENDING) ? sInsnIdProps[id] : 0;
+}
+
+static bool cs_is_branch(const cs_insn *insn)
+{
+    return insn_id_props(insn->id) & ID_BRANCH;
 }
 
-static bool is_func_return(const struct cs_insn *insn)
+static bool cs_is_func_return(const cs_insn *insn)
 {
     const struct cs_arm *arminsn = &insn->detail->arm;
 
+    if (!(insn_id_props(insn->id) & ID_RETURN))
+        return false;
     // 'bx' instruction
     if (insn->id == ARM_INS_BX)
         return arminsn->cc == ARM_CC_AL;
@@ -204,12 +787,13 @@ static bool is_func_return(const struct cs_insn *insn)
     return false;
 }
 
-static bool is_pool_load(const struct cs_insn *insn)
+static bool cs_is_pool_load(const cs_insn *insn)
 {
     const struct cs_arm *arminsn = &insn->detail->arm;
 
-    if (insn->id == ARM_INS_LDR
-     && arminsn->operands[0].type == ARM_OP_REG
+    if (!(insn_id_props(insn->id) & ID_POOL_LOAD))
+        return false;
+    if (arminsn->operands[0].type == ARM_OP_REG
      && arminsn->operands[1].type == ARM_OP_MEM
      && !arminsn->operands[1].subtracted
      && arminsn->operands[1].mem.base == ARM_REG_PC
@@ -219,1036 +803,5017 @@ static bool is_pool_load(const struct cs_insn *insn)
         return false;
 }
 
-static uint32_t get_pool_load(const struct cs_insn *insn, uint32_t currAddr, int mode)
+static bool IsValidInstruction(struct DisasmState *st, cs_insn * insn, enum LabelType type)
 {
-    assert(is_pool_load(insn));
+    const bool *validGroups = sValidGroups[st->disasm->options.isArm7][type == LABEL_THUMB_CODE];
+    const cs_detail *detail = insn->detail;
+
+    // one pass over the groups instead of a cs_insn_group search per group
+    for (int i = 0; i < detail->groups_count; i++)
+    {
+        if (detail->groups[i] < ARM_GRP_ENDING && validGroups[detail->groups[i]])
+            return true;
+    }
+    return false;
+}
 
-    return (currAddr & ~3) + insn->detail->arm.operands[1].mem.disp + ((mode == LABEL_ARM_CODE) ? 8 : 4);
+// The mode can't go in the low bits of the address: code labels from the
+// config or from pools aren't always aligned.
+static uint64_t insn_key(uint32_t addr, enum LabelType type)
+{
+    return ((uint64_t)addr << 1) | (type == LABEL_THUMB_CODE);
 }
 
-static uint32_t get_branch_target(const struct cs_insn *insn)
+static uint64_t insn_record_key(const struct DecodedInsn *insn)
 {
-    assert(is_branch(insn));
-    assert(insn->detail != NULL);
-    assert(insn->detail->arm.op_count > 0);
+    return ((uint64_t)insn->addr << 1) | ((insn->flags & INSN_THUMB) != 0);
+}
 
-    return insn->detail->arm.operands[0].imm;
+static uint32_t insn_key_hash(uint64_t key)
+{
+    return label_hash((uint32_t)key ^ (uint32_t)(key >> 32));
 }
 
-// Code Analysis
+static void insn_hash_insert(struct DisasmState *st, int index)
+{
+    uint32_t slot = insn_key_hash(insn_record_key(&st->insns[index])) & st->insnHashMask;
 
-static int sJumpTableState = 0;
+    while (st->insnHash[slot] != -1)
+        slot = (slot + 1) & st->insnHashMask;
+    st->insnHash[slot] = index;
+}
 
-static void jump_table_state_machine_thumb(const struct cs_insn *insn, uint32_t addr)
+static int insn_hash_find(struct DisasmState *st, uint64_t key)
 {
-    static uint32_t jumpTableBegin;
-    // sometimes another instruction (like a mov) can interrupt
-    static bool gracePeriod;
-    static bool isBx;
+    uint32_t slot;
 
-    switch (sJumpTableState)
+    if (st->insnHash == NULL)
+        return -1;
+    slot = insn_key_hash(key) & st->insnHashMask;
+    while (st->insnHash[slot] != -1)
     {
-    case 0:
-        // add rX, rX, rX
-        gracePeriod = false;
-        if (insn->id == ARM_INS_ADD && insn->detail->arm.operands[2].type == ARM_OP_REG && insn->detail->arm.operands[1].reg == insn->detail->arm.operands[2].reg)
-            goto match;
-        break;
-    case 1:
-        // add rX, pc
-        if (insn->id == ARM_INS_ADD && insn->detail->arm.operands[1].type == ARM_OP_REG && insn->detail->arm.operands[1].reg == ARM_REG_PC)
-            goto match;
-        break;
-    case 2:
-        // ldrh rX, [rX, #imm]
-        if (insn->id == ARM_INS_LDRH) {
-            jumpTableBegin = insn->detail->arm.operands[1].mem.disp + addr + 2;
-            goto match;
-        }
-        break;
-    case 3:
-        // lsls rX, 16
-        if (insn->id == ARM_INS_LSL)
-            goto match;
-        break;
-    case 4:
-        // asrs rX, 16
-        if (insn->id == ARM_INS_ASR)
-            goto match;
-        break;
-    case 5:
-        // add pc, rX
-        if (insn->id == ARM_INS_ADD)
-        {
-            if (insn->detail->arm.operands[0].reg == ARM_REG_PC)
-            {
-                isBx = false;
-                goto match;
-            }
-            if (insn->detail->arm.operands[1].type == ARM_OP_REG
-             && insn->detail->arm.operands[1].reg == ARM_REG_PC)
-            {
-                sJumpTableState++;
-                return;
-            }
-        }
-        break;
-    case 6:
-        if (is_func_return(insn))
-        {
-            isBx = true;
-            goto match;
-        }
-        break;
+        if (insn_record_key(&st->insns[st->insnHash[slot]]) == key)
+            return st->insnHash[slot];
+        slot = (slot + 1) & st->insnHashMask;
     }
-    // didn't match
-    if (gracePeriod)
-        sJumpTableState = 0;
-    else
-        gracePeriod = true;
-    return;
+    return -1;
+}
 
-    match:
-    if (sJumpTableState >= 5)  // all checks passed
-    {
-        uint32_t target;
-        uint32_t firstTarget = -1u;
-        int i;
+static void insn_store_grow(struct DisasmState *st)
+{
+    uint32_t size;
 
-        for (i = 0; i < gLabelsCount; i++)
-        {
-            if (gLabels[i].addr > jumpTableBegin && gLabels[i].addr < firstTarget)
-                firstTarget = gLabels[i].addr;
-        }
-
-        int numCases = -1;
-        for (i = 1; i < sJumpTableInsnIdx; i++) {
-            if (insn[-i].id == ARM_INS_CMP && insn[-i].detail->arm.operands[1].type == ARM_OP_IMM && insn[-i].detail->arm.operands[1].imm > 0) {
-                numCases = insn[-i].detail->arm.operands[1].imm + 1;
-                break;
-            }
-        }
-        i = 0;
-        assert(ROM_LOAD_ADDR == 0 || jumpTableBegin & ROM_LOAD_ADDR);
-        disasm_add_label(jumpTableBegin, isBx ? LABEL_JUMP_TABLE_THUMB_BX : LABEL_JUMP_TABLE_THUMB, NULL, false);
-        sJumpTableState = 0;
-        // add code labels from jump table
-        addr = jumpTableBegin;
-        while (addr < firstTarget && (numCases < 0 || i < numCases))
-        {
-            int label;
+    st->insnsBufferCount = st->insnsBufferCount ? 2 * st->insnsBufferCount : 0x1000;
+    st->insns = realloc(st->insns, st->insnsBufferCount * sizeof(*st->insns));
+    size = 2 * st->insnsBufferCount;
+    free(st->insnHash);
+    st->insnHash = malloc(size * sizeof(*st->insnHash));
+    if (st->insns == NULL || st->insnHash == NULL)
+        fatal_error("failed to alloc space for decoded instructions. ");
+    st->insnHashMask = size - 1;
+    memset(st->insnHash, -1, size * sizeof(*st->insnHash));
+    for (int i = 0; i < st->insnsCount; i++)
+        insn_hash_insert(st, i);
+}
 
-            target = hword_at(addr) + jumpTableBegin + (isBx ? 0 : 2);
-            if (target - ROM_LOAD_ADDR >= 0x02000000)
-                break;
-            if (!isBx && (target & 1))
-                break;
-            if (target < firstTarget && target > jumpTableBegin)
-                firstTarget = target & ~1;
-            label = disasm_add_label(target & ~1, (!isBx || (target & 3)) ? LABEL_THUMB_CODE : LABEL_ARM_CODE, NULL, false);
-            gLabels[label].branchType = BRANCH_TYPE_B;
-            addr += 2;
-            i++;
-        }
+static uint32_t insn_text_add(struct DisasmState *st, const char *mnemonic, const char *op_str)
+{
+    size_t mnemonicLen = strlen(mnemonic) + 1;
+    size_t opStrLen = strlen(op_str) + 1;
+    uint32_t offset = st->insnTextSize;
 
-        return;
+    while (st->insnTextSize + mnemonicLen + opStrLen > st->insnTextBufferSize)
+    {
+        st->insnTextBufferSize = st->insnTextBufferSize ? 2 * st->insnTextBufferSize : 0x10000;
+        st->insnText = realloc(st->insnText, st->insnTextBufferSize);
+        if (st->insnText == NULL)
+            fatal_error("failed to alloc space for instruction text. ");
     }
-    sJumpTableState++;
+    memcpy(st->insnText + st->insnTextSize, mnemonic, mnemonicLen);
+    memcpy(st->insnText + st->insnTextSize + mnemonicLen, op_str, opStrLen);
+    st->insnTextSize += mnemonicLen + opStrLen;
+    return offset;
 }
 
-static void jump_table_state_machine(const struct cs_insn *insn, uint32_t addr, enum LabelType type)
+static void insn_from_capstone(struct DisasmState *st, struct DecodedInsn *out, cs_insn *insn, enum LabelType type)
 {
-    static uint32_t jumpTableBegin;
+    const struct cs_arm *arminsn = &insn->detail->arm;
 
-    if (type == LABEL_THUMB_CODE) {
-        jump_table_state_machine_thumb(insn, addr);
-        return;
-    }
-    switch (sJumpTableState)
-    {
-    case 0:
-        if (insn->id == ARM_INS_ADD
-            && insn->detail->arm.operands[0].reg == ARM_REG_PC
-            && insn->detail->arm.operands[2].type == ARM_OP_REG
-            && insn->detail->arm.operands[2].shift.type == ARM_SFT_LSL
-            && insn->detail->arm.operands[2].shift.value == 2)
-            goto match;
-        break;
-    case 1:
-        if ((insn->id == ARM_INS_B && insn->detail->arm.cc == ARM_CC_AL) || is_func_return(insn))
-            goto match;
-        break;
-    }
-    sJumpTableState = 0;
-    return;
-match:
-    if (sJumpTableState == 1)
+    out->addr = insn->address;
+    out->id = insn->id;
+    out->size = insn->size;
+    out->cc = arminsn->cc;
+    out->opCount = arminsn->op_count;
+    out->flags = (type == LABEL_THUMB_CODE) ? INSN_THUMB : 0;
+    if (IsValidInstruction(st, insn, type))
+        out->flags |= INSN_VALID;
+    if (cs_is_branch(insn))
+        out->flags |= INSN_BRANCH;
+    if (cs_is_func_return(insn))
+        out->flags |= INSN_RETURN;
+    if (cs_is_pool_load(insn))
+        out->flags |= INSN_POOL_LOAD;
+    // unused operands are zeroed by capstone, so they are copied as well
+    for (int i = 0; i < 3; i++)
     {
-        uint32_t target;
-        uint32_t firstTarget = (is_branch(insn) && !is_func_return(insn)) ? get_branch_target(insn) : -1u;
-        if (firstTarget < addr) firstTarget = -1u;
-        int i;
-        jumpTableBegin = addr + 4;
-        sJumpTableState = 0;
-        // add code labels from jump table
-        addr = jumpTableBegin;
-        int numCases = -1;
-        for (i = 1; i < sJumpTableInsnIdx; i++) {
-            if (insn[-i].id == ARM_INS_CMP) {
-                numCases = insn[-i].detail->arm.operands[1].imm + 1;
-                if (numCases > 1)
-                    break;
-            }
-        }
-        i = 0;
-        disasm_add_label(addr, LABEL_JUMP_TABLE, NULL, false);
-        while (addr < firstTarget && (numCases < 0 || i < numCases))
-        {
-            int label;
-            if (insn[i + 1].id == ARM_INS_B)
-            {
-                target = get_branch_target(&insn[i + 1]);
-                if (target - ROM_LOAD_ADDR >= 0x02000000)
-                {
-                    break;
-                }
-                if (target < firstTarget && target > jumpTableBegin)
-                {
-                    firstTarget = target;
-                }
-                label = disasm_add_label(target, LABEL_ARM_CODE, NULL, false);
-                gLabels[label].branchType = BRANCH_TYPE_B;
-            }
-            else if (!is_func_return(&insn[i + 1]))
-                break;
-            addr += 4;
-            i++;
-        }
+        const cs_arm_op *op = &arminsn->operands[i];
 
-        return;
+        out->ops[i].type = op->type;
+        out->ops[i].shiftType = op->shift.type;
+        out->ops[i].shiftValue = op->shift.value;
+        out->ops[i].subtracted = op->subtracted;
+        out->ops[i].reg = op->reg;
+        out->ops[i].index = op->mem.index;
+        out->ops[i].disp = op->mem.disp;
     }
-    sJumpTableState++;
+    out->text = INSN_NO_TEXT;
 }
 
-static void renew_or_add_new_func_label(enum LabelType type, uint32_t word)
+static bool decoder_open(struct Decoder *decoder)
 {
-    if (word & ROM_LOAD_ADDR)
+    if (cs_open(CS_ARCH_ARM, CS_MODE_ARM, &decoder->capstone) != CS_ERR_OK)
+        return false;
+    if (cs_open(CS_ARCH_ARM, CS_MODE_THUMB, &decoder->capstoneThumb) != CS_ERR_OK)
     {
-        struct Label *label_p = lookup_label(word & ~1);
-
-        if (label_p != NULL)
-        {
-            // maybe it has been processed as a non-function label
-            label_p->processed = false;
-            label_p->branchType = BRANCH_TYPE_BL;
-            label_p->isFunc = true;
-        }
-        else
-        {
-            // implicitly set to BRANCH_TYPE_BL
-            int lab = disasm_add_label(word & ~1, type, NULL, false);
-            assert(lab != -1);
-            gLabels[lab].isFunc = true;
-        }
+        cs_close(&decoder->capstone);
+        return false;
     }
+    cs_option(decoder->capstone, CS_OPT_DETAIL, CS_OPT_ON);
+    cs_option(decoder->capstoneThumb, CS_OPT_DETAIL, CS_OPT_ON);
+    decoder->buffer = cs_malloc(decoder->capstone);
+    if (decoder->buffer == NULL)
+        fatal_error("failed to alloc space for decoded instructions. ");
+    return true;
 }
 
-static bool IsValidInstruction(cs_insn * insn, enum LabelType type)
+static void decoder_close(struct Decoder *decoder)
 {
-    if (cs_insn_group(sCapstone, insn, isArm7 ? ARM_GRP_V4T : ARM_GRP_V5T))
-        return true;
-    if (type == LABEL_ARM_CODE) {
-        return cs_insn_group(sCapstone, insn, ARM_GRP_ARM);
-    } else {
-        return cs_insn_group(sCapstone, insn, ARM_GRP_THUMB);
-    }
+    cs_free(decoder->buffer, 1);
+    cs_close(&decoder->capstoneThumb);
+    cs_close(&decoder->capstone);
+    memset(decoder, 0, sizeof(*decoder));
 }
 
-static void analyze(void)
+// Decodes the instruction in code, at addr, with capstone into decoder->buffer.
+static bool capstone_decode(struct Decoder *decoder, const uint8_t *code, uint32_t addr, enum LabelType type, uint32_t maxSize)
 {
-    while (1)
-    {
-        int li;
-        int i;
-        uint32_t addr;
-        enum LabelType type;
-        struct cs_insn *insn;
-        const int dismAllocSize = 0x1000;
-        int count;
+    csh handle = (type == LABEL_THUMB_CODE) ? decoder->capstoneThumb : decoder->capstone;
+    uint64_t address = addr;
+    size_t size = maxSize;
 
-        if ((li = get_unprocessed_label_index()) == -1)
-            return;
-        addr = gLabels[li].addr;
-        type = gLabels[li].type;
-        if (addr < ROM_LOAD_ADDR || addr >= ROM_LOAD_ADDR + gInputFileBufferSize)
-        {
-            gLabels[li].processed = true;
-            continue;
-        }
+    return cs_disasm_iter(handle, &code, &size, &address, decoder->buffer);
+}
 
-        if (type == LABEL_ARM_CODE || type == LABEL_THUMB_CODE)
-        {
-            cs_option(sCapstone, CS_OPT_MODE, (type == LABEL_ARM_CODE) ? CS_MODE_ARM : CS_MODE_THUMB);
-            sJumpTableState = 0;
-            //fprintf(stderr, "analyzing label at 0x%08X\n", addr);
-            do
-            {
-                uint32_t offset = addr - ROM_LOAD_ADDR;
-                count = cs_disasm(sCapstone, gInputFileBuffer + offset, min(0x1000, gInputFileBufferSize - offset), addr, 0, &insn);
-                for (i = 0; i < count; i++)
-                {
-                    sJumpTableInsnIdx = i;
-                  no_inc:
-                    if (!IsValidInstruction(&insn[i], type)) {
-                        if (type == LABEL_THUMB_CODE)
-                        {
-                            int tmp_cnt;
-                            cs_insn * tmp;
-                            addr += 2;
-                            if (insn[i].size == 2) continue;
-                            tmp_cnt = cs_disasm(sCapstone, gInputFileBuffer + addr - ROM_LOAD_ADDR, 2, addr, 0, &tmp);
-                            if (tmp_cnt != 0)
-                            {
-                                free(insn[i].detail);
-                                insn[i] = *tmp;
-                                free(tmp);
-                            }
-                            goto no_inc;
-                        }
-                        else
-                        {
-                            addr += 4;
-                            continue;
-                        }
-                    };
-                    jump_table_state_machine(&insn[i], addr, type);
+// Fast Path Decoder
 
-                    // fprintf(stderr, "/*0x%08X*/ %s %s\n", addr, insn[i].mnemonic, insn[i].op_str);
-                    if (is_branch(&insn[i]))
-                    {
-                        uint32_t target;
-                        //uint32_t currAddr = addr;
+// Analysis only needs to classify instructions and pull out branch and pool
+// targets, which the common ARMv4T/ARMv5TE encodings give away directly in
+// their opcode bits. These decoders fill in the same fields capstone would
+// for a conservative subset of encodings and give up on everything else, so
+// that capstone only sees the rare ones. They are only used if they agree
+// with capstone on a set of encodings, see fast_decoder_gate, and -V checks
+// them on the module as well.
 
-                        addr += insn[i].size;
+static const uint8_t sArmRegs[16] =
+{
+    ARM_REG_R0, ARM_REG_R1, ARM_REG_R2, ARM_REG_R3,
+    ARM_REG_R4, ARM_REG_R5, ARM_REG_R6, ARM_REG_R7,
+    ARM_REG_R8, ARM_REG_R9, ARM_REG_R10, ARM_REG_R11,
+    ARM_REG_R12, ARM_REG_SP, ARM_REG_LR, ARM_REG_PC,
+};
 
-                        // For BX{COND}, only BXAL can be considered as end of function
-                        if (is_func_return(&insn[i]))
-                        {
-                            struct Label *label_p;
+static struct InsnOperand *fast_op(struct DecodedInsn *insn, uint8_t type)
+{
+    // capstone keeps counting past the operands we store
+    static _Thread_local struct InsnOperand discard;
+    struct InsnOperand *op = (insn->opCount < 3) ? &insn->ops[insn->opCount] : &discard;
 
-                            if (insn[i].id == ARM_INS_BX && insn[i].detail->arm.operands[0].type == ARM_OP_REG)
-                            {
-                                for (int j = i - 1; j >= 0; j--)
-                                {
-                                    if (insn[j].detail->arm.operands[0].reg == insn[i].detail->arm.operands[0].reg)
-                                    {
-                                        if (is_pool_load(&insn[j]))
-                                        {
-                                            // Tail call
-                                            uint32_t pool_target = word_at(
-                                                get_pool_load(&insn[j], insn[j].address, type));
-                                            int added = disasm_add_label(
-                                                pool_target & ~1,
-                                                pool_target & 3 ? LABEL_THUMB_CODE : LABEL_ARM_CODE,
-                                                NULL,
-                                                false
-                                            );
-                                            if (added >= 0 && added < gLabelsCount)
-                                            {
-                                                gLabels[added].isFunc = true;
-                                            }
-                                        }
-                                        break;
-                                    }
-                                }
-                            }
+    insn->opCount++;
+    op->type = type;
+    return op;
+}
 
-                            // It's possible that handwritten code with different mode follows. 
-                            // However, this only causes problem when the address following is
-                            // incorrectly labeled as BRANCH_TYPE_B. 
-                            label_p = lookup_label(addr);
-                            if (label_p != NULL
-                             && (label_p->type == LABEL_THUMB_CODE || label_p->type == LABEL_ARM_CODE)
-                             && label_p->type != type
-                             && label_p->branchType == BRANCH_TYPE_B)
-                            {
-                                label_p->branchType = BRANCH_TYPE_BL;
-                                label_p->isFunc = true;
-                            }
-                            break;
-                        }
+static void fast_op_reg(struct DecodedInsn *insn, int reg)
+{
+    fast_op(insn, ARM_OP_REG)->reg = sArmRegs[reg];
+}
 
-                        if (insn[i].id == ARM_INS_BX) // BX{COND} when COND != AL
-                            continue;
+static void fast_op_imm(struct DecodedInsn *insn, int32_t imm)
+{
+    fast_op(insn, ARM_OP_IMM)->imm = imm;
+}
 
-                        if (insn[i].id == ARM_INS_BLX && insn[i].detail->arm.operands[0].type == ARM_OP_REG)
-                            continue;
+static void fast_op_mem(struct DecodedInsn *insn, int base, int index, int32_t disp)
+{
+    struct InsnOperand *op = fast_op(insn, ARM_OP_MEM);
 
-                        target = get_branch_target(&insn[i]);
-                        assert(target != 0);
+    op->base = sArmRegs[base];
+    op->index = (index >= 0) ? sArmRegs[index] : ARM_REG_INVALID;
+    op->disp = disp;
+}
 
-                        // I don't remember why I needed this condition
-                        //if (!(target >= gLabels[li].addr && target <= currAddr))
-                        if (target != addr)
-                        {
-                            enum LabelType newtype = type;
-                            if (insn[i].id == ARM_INS_BLX)
-                                newtype = type == LABEL_THUMB_CODE ? LABEL_ARM_CODE : LABEL_THUMB_CODE;
-                            int lbl = disasm_add_label(target, newtype, NULL, false);
+static int32_t sign_extend(uint32_t value, int bits)
+{
+    return (int32_t)(value << (32 - bits)) >> (32 - bits);
+}
 
-                            if (!gLabels[lbl].isFunc) // do nothing if it's 100% a func (from func ptr, or instant mode exchange)
-                            {
-                                if (insn[i].id == ARM_INS_BL || insn[i].id == ARM_INS_BLX)
-                                {
-                                    const struct Label *next;
-
-                                    if (gLabels[lbl].branchType != BRANCH_TYPE_B)
-                                        gLabels[lbl].branchType = BRANCH_TYPE_BL;
-                                    if (insn[i].id != ARM_INS_BLX)
-                                    {
-                                        // if the address right after is a pool, then we know
-                                        // for sure that this is a far jump and not a function call
-                                        if (((next = lookup_label(addr)) != NULL && next->type == LABEL_POOL)
-                                            // if the 2 bytes following are zero, assume it's padding
-                                            || (type == LABEL_THUMB_CODE && ((addr & 3) != 0) && hword_at(addr) == 0))
-                                        {
-                                            gLabels[lbl].branchType = BRANCH_TYPE_B;
-                                            break;
-                                        }
-                                    }
-                                }
-                                else
-                                {
-                                    // the label might be given a name in .cfg file, but it's actually not a function
-                                    if (gLabels[lbl].name != NULL)
-                                        free(gLabels[lbl].name);
-                                    gLabels[lbl].name = NULL;
-                                    gLabels[lbl].branchType = BRANCH_TYPE_B;
-                                }
-                            }
-                        }
-                        // unconditional jump and not a function call
-                        if (insn[i].detail->arm.cc == ARM_CC_AL && insn[i].id != ARM_INS_BL && insn[i].id != ARM_INS_BLX)
-                            break;
-                    }
-                    else
-                    {
-                        uint32_t poolAddr;
-                        uint32_t word;
+// Thumb decoders, indexed by the top 5 bits of the first halfword
 
-                        addr += insn[i].size;
+// lsls/lsrs/asrs rd, rm, #imm
+static bool thumb_shift_imm(struct DecodedInsn *insn, uint16_t hw)
+{
+    static const uint16_t ids[] = {ARM_INS_LSL, ARM_INS_LSR, ARM_INS_ASR};
+    uint32_t shift = (hw >> 6) & 31;
 
-                        if (is_func_return(&insn[i]))
-                        {
-                            struct Label *label_p;
-
-                            // It's possible that handwritten code with different mode follows. 
-                            // However, this only causes problem when the address following is
-                            // incorrectly labeled as BRANCH_TYPE_B. 
-                            label_p = lookup_label(addr);
-                            if (label_p != NULL
-                             && (label_p->type == LABEL_THUMB_CODE || label_p->type == LABEL_ARM_CODE)
-                             && label_p->type != type
-                             && label_p->branchType == BRANCH_TYPE_B)
-                            {
-                                label_p->branchType = BRANCH_TYPE_BL;
-                                label_p->isFunc = true;
-                            }
-                            break;
-                        }
+    // lsls #0 is movs, and lsrs/asrs #0 shift by 32
+    if (shift == 0)
+        return false;
+    insn->id = ids[hw >> 11];
+    fast_op_reg(insn, hw & 7);
+    fast_op_reg(insn, (hw >> 3) & 7);
+    fast_op_imm(insn, shift);
+    return true;
+}
 
-                        assert(insn[i].detail != NULL);
+// adds/subs rd, rn, rm and adds/subs rd, rn, #imm
+static bool thumb_add_sub(struct DecodedInsn *insn, uint16_t hw)
+{
+    insn->id = (hw & 0x200) ? ARM_INS_SUB : ARM_INS_ADD;
+    fast_op_reg(insn, hw & 7);
+    fast_op_reg(insn, (hw >> 3) & 7);
+    if (!(hw & 0x400))
+        fast_op_reg(insn, (hw >> 6) & 7);
+    else if ((hw >> 6) & 7)
+        fast_op_imm(insn, (hw >> 6) & 7);
+    else
+        return false;
+    return true;
+}
 
-                        // looks like that this check can only detect thumb mode
-                        // anyway I still put the arm mode things here for a potential future fix
-                        if (insn[i].id == ARM_INS_ADR)
-                        {
-                            word = insn[i].detail->arm.operands[1].imm + (addr - insn[i].size)
-                                 + (type == LABEL_THUMB_CODE ? 4 : 8);
-                            if (type == LABEL_THUMB_CODE)
-                                word &= ~3;
-                            goto check_handwritten_indirect_jump;
-                        }
+// movs/cmp/adds/subs rd, #imm
+static bool thumb_imm8(struct DecodedInsn *insn, uint16_t hw)
+{
+    static const uint16_t ids[] = {ARM_INS_MOV, ARM_INS_CMP, ARM_INS_ADD, ARM_INS_SUB};
 
-                        // fix above check for arm mode
-                        if (type == LABEL_ARM_CODE
-                         && insn[i].id == ARM_INS_ADD
-                         && insn[i].detail->arm.operands[0].type == ARM_OP_REG
-                         && insn[i].detail->arm.operands[1].type == ARM_OP_REG
-                         && insn[i].detail->arm.operands[1].reg == ARM_REG_PC
-                         && insn[i].detail->arm.operands[2].type == ARM_OP_IMM)
-                        {
-                            word = insn[i].detail->arm.operands[2].imm + (addr - insn[i].size) + 8;
-                            goto check_handwritten_indirect_jump;
-                        }
+    insn->id = ids[(hw >> 11) & 3];
+    fast_op_reg(insn, (hw >> 8) & 7);
+    fast_op_imm(insn, hw & 0xFF);
+    return true;
+}
 
-                        if (is_pool_load(&insn[i]))
-                        {
-                            poolAddr = get_pool_load(&insn[i], addr - insn[i].size, type);
-                            assert(poolAddr != 0);
-                            assert((poolAddr & 3) == 0);
-                            disasm_add_label(poolAddr, LABEL_POOL, NULL, false);
-                            word = word_at(poolAddr);
-                            if (insn[i].detail->arm.operands[0].reg == ARM_REG_PC)
-                            {
-                                renew_or_add_new_func_label(word & 1 ? LABEL_THUMB_CODE : LABEL_ARM_CODE, word);
-                                if (insn[i].detail->arm.cc == ARM_CC_AL)
-                                    break;
-                            }
+// register ALU operations, high register operations and bx/blx rm
+static bool thumb_alu_hireg(struct DecodedInsn *insn, uint16_t hw)
+{
+    // negs is printed as rsbs with an extra #0 and muls with an extra register
+    static const uint16_t aluIds[] =
+    {
+        ARM_INS_AND, ARM_INS_EOR, ARM_INS_LSL, ARM_INS_LSR,
+        ARM_INS_ASR, ARM_INS_ADC, ARM_INS_SBC, ARM_INS_ROR,
+        ARM_INS_TST, ARM_INS_INVALID, ARM_INS_CMP, ARM_INS_CMN,
+        ARM_INS_ORR, ARM_INS_INVALID, ARM_INS_BIC, ARM_INS_MVN,
+    };
+    int rd = (hw & 7) | ((hw >> 4) & 8);
+    int rm = (hw >> 3) & 15;
 
-                        check_handwritten_indirect_jump:
-                            if (i < count - 1) // is not last insn in the chunk
-                            {
-                                // check if it's followed with bx RX or mov PC, RX (conditional won't hurt)
-                                if (insn[i + 1].id == ARM_INS_BX)
-                                {
-                                    if (insn[i + 1].detail->arm.operands[0].type == ARM_OP_REG
-                                     && insn[i].detail->arm.operands[0].reg == insn[i + 1].detail->arm.operands[0].reg)
-                                        renew_or_add_new_func_label(word & 1 ? LABEL_THUMB_CODE : LABEL_ARM_CODE, word);
-                                }
-                                else if (insn[i + 1].id == ARM_INS_MOV
-                                      && insn[i + 1].detail->arm.operands[0].type == ARM_OP_REG
-                                      && insn[i + 1].detail->arm.operands[0].reg == ARM_REG_PC
-                                      && insn[i + 1].detail->arm.operands[1].type == ARM_OP_REG
-                                      && insn[i].detail->arm.operands[0].reg == insn[i + 1].detail->arm.operands[1].reg)
-                                {
-                                    renew_or_add_new_func_label(type, word);
-                                }
-                            }
-                        }
-                    }
-                }
-                cs_free(insn, count);
-            } while (count == dismAllocSize);
-            gLabels[li].processed = true;
-            gLabels[li].size = addr - gLabels[li].addr;
-        }
-        gLabels[li].processed = true;
+    if (!(hw & 0x400))
+    {
+        if ((insn->id = aluIds[(hw >> 6) & 15]) == ARM_INS_INVALID)
+            return false;
+        fast_op_reg(insn, hw & 7);
+        fast_op_reg(insn, (hw >> 3) & 7);
+        return true;
     }
+    switch ((hw >> 8) & 3)
+    {
+    case 0:
+        // sp operands are printed in other forms
+        if ((rd < 8 && rm < 8) || rd == 13 || rm == 13)
+            return false;
+        insn->id = ARM_INS_ADD;
+        break;
+    case 1:
+        if ((rd < 8 && rm < 8) || rd == 15)
+            return false;
+        insn->id = ARM_INS_CMP;
+        break;
+    case 2:
+        if (rd < 8 && rm < 8)
+            return false;
+        insn->id = ARM_INS_MOV;
+        if (rd == 15)
+            insn->flags |= INSN_RETURN;
+        break;
+    case 3:
+        if ((hw & 7) != 0 || ((hw & 0x80) && rm == 15))
+            return false;
+        insn->id = (hw & 0x80) ? ARM_INS_BLX : ARM_INS_BX;
+        insn->flags |= INSN_BRANCH;
+        if (insn->id == ARM_INS_BX)
+            insn->flags |= INSN_RETURN;
+        fast_op_reg(insn, rm);
+        return true;
+    }
+    fast_op_reg(insn, rd);
+    fast_op_reg(insn, rm);
+    return true;
 }
 
-// Disassembly Output
+// ldr rd, [pc, #imm]
+static bool thumb_ldr_pc(struct DecodedInsn *insn, uint16_t hw)
+{
+    insn->id = ARM_INS_LDR;
+    insn->flags |= INSN_POOL_LOAD;
+    fast_op_reg(insn, (hw >> 8) & 7);
+    fast_op_mem(insn, 15, -1, (hw & 0xFF) * 4);
+    return true;
+}
 
-static uint32_t print_align(uint32_t addr, enum LabelType labelType)
+// loads and stores with a register offset
+static bool thumb_ldst_reg(struct DecodedInsn *insn, uint16_t hw)
 {
-    if (labelType == LABEL_THUMB_CODE)
+    static const uint16_t ids[] =
     {
-        if ((addr & 3) == 2)
-        {
-            uint16_t next_short = hword_at(addr);
-            if (next_short == 0)
-            {
-                fputs("\t.align 2, 0\n", stdout);
-                addr += 2;
-            }
-            else if (next_short == 0x46C0)
-            {
-                fputs("\tnop\n", stdout);
-                addr += 2;
-            }
-        }
-    }
-    return addr;
+        ARM_INS_STR, ARM_INS_STRH, ARM_INS_STRB, ARM_INS_LDRSB,
+        ARM_INS_LDR, ARM_INS_LDRH, ARM_INS_LDRB, ARM_INS_LDRSH,
+    };
+
+    insn->id = ids[(hw >> 9) & 7];
+    fast_op_reg(insn, hw & 7);
+    fast_op_mem(insn, (hw >> 3) & 7, (hw >> 6) & 7, 0);
+    return true;
 }
 
-static void print_gap(uint32_t addr, uint32_t nextaddr)
+// loads and stores with an immediate offset
+static bool thumb_ldst_imm(struct DecodedInsn *insn, uint16_t hw)
 {
-    if (addr == nextaddr)
-        return;
+    static const struct { uint16_t id; uint8_t scale; } forms[] =
+    {
+        [0x0C] = {ARM_INS_STR, 4},
+        [0x0D] = {ARM_INS_LDR, 4},
+        [0x0E] = {ARM_INS_STRB, 1},
+        [0x0F] = {ARM_INS_LDRB, 1},
+        [0x10] = {ARM_INS_STRH, 2},
+        [0x11] = {ARM_INS_LDRH, 2},
+    };
 
-    assert(addr < nextaddr);
+    insn->id = forms[hw >> 11].id;
+    fast_op_reg(insn, hw & 7);
+    fast_op_mem(insn, (hw >> 3) & 7, -1, ((hw >> 6) & 31) * forms[hw >> 11].scale);
+    return true;
+}
 
-    if (addr % gOptionDataColumnWidth != 0)
-        fputs("\t.byte", stdout);
-    while (addr < nextaddr)
-    {
-        if (addr % gOptionDataColumnWidth == 0)
-            fputs("\t.byte", stdout);
-        if (addr % gOptionDataColumnWidth == (unsigned int)(gOptionDataColumnWidth - 1)
-         || addr == nextaddr - 1)
-            printf(" 0x%02X\n", byte_at(addr));
-        else
-            printf(" 0x%02X,", byte_at(addr));
-        addr++;
-    }
+// str/ldr rd, [sp, #imm]
+static bool thumb_ldst_sp(struct DecodedInsn *insn, uint16_t hw)
+{
+    insn->id = (hw & 0x800) ? ARM_INS_LDR : ARM_INS_STR;
+    fast_op_reg(insn, (hw >> 8) & 7);
+    fast_op_mem(insn, 13, -1, (hw & 0xFF) * 4);
+    return true;
 }
 
-static void __attribute__((format(printf, 1, 3))) do_print_insn(const char * fmt, int caseNum, ...)
+// adr rd, #imm and add rd, sp, #imm
+static bool thumb_add_pc_sp(struct DecodedInsn *insn, uint16_t hw)
 {
-    va_list va_args;
-    va_start(va_args, caseNum);
-    vprintf(fmt, va_args);
-    if (caseNum >= 0)
-        printf(" @ case %d\n", caseNum);
+    fast_op_reg(insn, (hw >> 8) & 7);
+    if (hw & 0x800)
+    {
+        insn->id = ARM_INS_ADD;
+        fast_op_reg(insn, 13);
+    }
     else
-        putchar('\n');
-    va_end(va_args);
+    {
+        insn->id = ARM_INS_ADR;
+    }
+    fast_op_imm(insn, (hw & 0xFF) * 4);
+    return true;
 }
 
-static void print_insn(const cs_insn *insn, uint32_t addr, int mode, int caseNum)
+// add/sub sp, #imm and push/pop
+static bool thumb_misc(struct DecodedInsn *insn, uint16_t hw)
 {
-    struct Label DummyLabel;
-    if (gOptionShowAddrComments)
+    if ((hw & 0xFF00) == 0xB000)
     {
-        do_print_insn("\t/*0x%08X*/ %s %s", caseNum, addr, insn->mnemonic, insn->op_str);
+        insn->id = (hw & 0x80) ? ARM_INS_SUB : ARM_INS_ADD;
+        fast_op_reg(insn, 13);
+        fast_op_imm(insn, (hw & 0x7F) * 4);
+        return true;
     }
-    else
+    if ((hw & 0xF600) == 0xB400 && (hw & 0x1FF) != 0)
     {
-        if (is_branch(insn) && insn->detail->arm.operands[0].type != ARM_OP_REG)
-        {
-            uint32_t target = get_branch_target(insn);
-            struct Label *label = lookup_label(target);
+        bool pop = (hw & 0x800) != 0;
 
-            if (label == NULL) {
-                DummyLabel.addr = target;
-                DummyLabel.name = NULL;
-                DummyLabel.branchType = BRANCH_TYPE_BL;
-                label = &DummyLabel;
-            }
-            if (label->name != NULL)
-                do_print_insn("\t%s %s", caseNum, insn->mnemonic, label->name);
-            else
-                do_print_insn("\t%s %s%08X", caseNum, insn->mnemonic, (label->branchType == BRANCH_TYPE_BL ? functionPrefix : "_"), target);
-        }
-        else if (is_pool_load(insn))
+        insn->id = pop ? ARM_INS_POP : ARM_INS_PUSH;
+        for (int reg = 0; reg < 8; reg++)
         {
-            uint32_t word = get_pool_load(insn, addr, mode);
-            uint32_t value = word_at(word);
-            const struct Label *label_p;
-
-            if (value & 3 && (value & ROM_LOAD_ADDR & 0x0F000000) == (ROM_LOAD_ADDR & 0x0F000000)) // possibly thumb function
-            {
-                if (label_p = lookup_label(value & ~1), label_p != NULL)
-                {
-                    if (label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
-                    {
-                        if (label_p->name != NULL)
-                            do_print_insn("\t%s %s, _%08X @ =%s", caseNum, insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, label_p->name);
-                        else
-                            do_print_insn("\t%s %s, _%08X @ =%s%08X", caseNum, insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, functionPrefix, value & ~1);
-                        return;
-                    }
-                }
-            }
-            label_p = lookup_label(value);
-            if (label_p != NULL)
-            {
-                if (label_p->type != LABEL_THUMB_CODE)
-                {
-                    if (label_p->name != NULL)
-                        do_print_insn("\t%s %s, _%08X @ =%s", caseNum, insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, label_p->name);
-                    else if (label_p->branchType == BRANCH_TYPE_BL)
-                        do_print_insn("\t%s %s, _%08X @ =%s%08X", caseNum, insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, functionPrefix, value);
-                    else // normal label
-                        do_print_insn("\t%s %s, _%08X @ =_%08X", caseNum,
-                          insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, value);
-                    return;
-                }
-            }
-            do_print_insn("\t%s %s, _%08X @ =0x%08X", caseNum, insn->mnemonic, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), word, value);
+            if (hw & (1 << reg))
+                fast_op_reg(insn, reg);
         }
-        else
+        if (hw & 0x100)
         {
-            // fix "add rX, sp, rX"
-            if (insn->id == ARM_INS_ADD
-             && insn->detail->arm.operands[0].type == ARM_OP_REG
-             && insn->detail->arm.operands[1].type == ARM_OP_REG
-             && insn->detail->arm.operands[1].reg == ARM_REG_SP
-             && insn->detail->arm.operands[2].type == ARM_OP_REG)
-            {
-                do_print_insn("\t%s %s, %s", caseNum,
-                  insn->mnemonic,
-                  cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg),
-                  cs_reg_name(sCapstone, insn->detail->arm.operands[1].reg));
-            }
-            // fix thumb adr
-            else if (insn->id == ARM_INS_ADR && mode == LABEL_THUMB_CODE)
-            {
-                uint32_t word = (insn->detail->arm.operands[1].imm + addr + 4) & ~3;
-                const struct Label *label_p = lookup_label(word);
+            fast_op_reg(insn, pop ? 15 : 14);
+            if (pop)
+                insn->flags |= INSN_RETURN;
+        }
+        return true;
+    }
+    return false;
+}
 
-                if (label_p != NULL)
-                {
-                    if (label_p->type != LABEL_THUMB_CODE)
-                    {
-                        if (label_p->name != NULL)
-                            do_print_insn("\tadd %s, pc, #0x%X @ =%s", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[1].imm, label_p->name);
-                        else if (label_p->branchType == BRANCH_TYPE_BL)
-                            do_print_insn("\tadd %s, pc, #0x%X @ =%s%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[1].imm, functionPrefix, word);
-                        else
-                            do_print_insn("\tadd %s, pc, #0x%X @ =_%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[1].imm, word);
-                        return;
-                    }
-                }
-                do_print_insn("\tadd %s, pc, #0x%X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[1].imm);
-            }
-            // arm adr
-            else if (mode == LABEL_ARM_CODE
-                  && insn->id == ARM_INS_ADD
-                  && insn->detail->arm.operands[0].type == ARM_OP_REG
-                  && insn->detail->arm.operands[1].type == ARM_OP_REG
-                  && insn->detail->arm.operands[1].reg == ARM_REG_PC
-                  && insn->detail->arm.operands[2].type == ARM_OP_IMM)
-            {
-                uint32_t word = insn->detail->arm.operands[2].imm + addr + 8;
+// b{cond} label
+static bool thumb_b_cond(struct DecodedInsn *insn, uint16_t hw)
+{
+    int cond = (hw >> 8) & 15;
+
+    // udf and svc
+    if (cond >= 14)
+        return false;
+    insn->id = ARM_INS_B;
+    insn->cc = ARM_CC_EQ + cond;
+    insn->flags |= INSN_BRANCH;
+    fast_op_imm(insn, insn->addr + 4 + sign_extend(hw & 0xFF, 8) * 2);
+    return true;
+}
+
+// b label
+static bool thumb_b(struct DecodedInsn *insn, uint16_t hw)
+{
+    insn->id = ARM_INS_B;
+    insn->flags |= INSN_BRANCH;
+    fast_op_imm(insn, insn->addr + 4 + sign_extend(hw & 0x7FF, 11) * 2);
+    return true;
+}
+
+// bl/blx label, the two halfword pair, with lo the second one
+static bool thumb_bl(struct DecodedInsn *insn, uint16_t hw, uint16_t lo)
+{
+    int32_t offset = sign_extend(((hw & 0x7FF) << 12) | ((lo & 0x7FF) << 1), 23);
+
+    insn->size = 4;
+    insn->flags |= INSN_BRANCH;
+    if ((lo & 0xF800) == 0xF800)
+    {
+        insn->id = ARM_INS_BL;
+        fast_op_imm(insn, insn->addr + 4 + offset);
+    }
+    else if ((lo & 0xF801) == 0xE800)
+    {
+        insn->id = ARM_INS_BLX;
+        fast_op_imm(insn, ((insn->addr + 4) & ~3) + offset);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool (*const sThumbDecoders[32])(struct DecodedInsn *, uint16_t) =
+{
+    [0x00] = thumb_shift_imm, [0x01] = thumb_shift_imm, [0x02] = thumb_shift_imm,
+    [0x03] = thumb_add_sub,
+    [0x04] = thumb_imm8, [0x05] = thumb_imm8, [0x06] = thumb_imm8, [0x07] = thumb_imm8,
+    [0x08] = thumb_alu_hireg,
+    [0x09] = thumb_ldr_pc,
+    [0x0A] = thumb_ldst_reg, [0x0B] = thumb_ldst_reg,
+    [0x0C] = thumb_ldst_imm, [0x0D] = thumb_ldst_imm, [0x0E] = thumb_ldst_imm, [0x0F] = thumb_ldst_imm,
+    [0x10] = thumb_ldst_imm, [0x11] = thumb_ldst_imm,
+    [0x12] = thumb_ldst_sp, [0x13] = thumb_ldst_sp,
+    [0x14] = thumb_add_pc_sp, [0x15] = thumb_add_pc_sp,
+    [0x16] = thumb_misc, [0x17] = thumb_misc,
+    [0x1A] = thumb_b_cond, [0x1B] = thumb_b_cond,
+    [0x1C] = thumb_b,
+};
+
+// ARM decoders, indexed by bits 25-27
+
+// bx/blx rm and data processing with an immediate or immediate-shifted register
+static bool arm_data_proc(struct DecodedInsn *insn, uint32_t w)
+{
+    static const uint16_t ids[] =
+    {
+        ARM_INS_AND, ARM_INS_EOR, ARM_INS_SUB, ARM_INS_RSB,
+        ARM_INS_ADD, ARM_INS_ADC, ARM_INS_SBC, ARM_INS_RSC,
+        ARM_INS_TST, ARM_INS_TEQ, ARM_INS_CMP, ARM_INS_CMN,
+        ARM_INS_ORR, ARM_INS_MOV, ARM_INS_BIC, ARM_INS_MVN,
+    };
+    static const uint8_t shifts[] = {ARM_SFT_LSL, ARM_SFT_LSR, ARM_SFT_ASR, ARM_SFT_ROR};
+    int opcode = (w >> 21) & 15;
+    int rn = (w >> 16) & 15;
+    int rd = (w >> 12) & 15;
+    bool isImm = (w >> 25) & 1;
+
+    if ((w & 0x0FFFFFD0) == 0x012FFF10)
+    {
+        int rm = w & 15;
+
+        if (rm == 15)
+            return false;
+        insn->id = (w & 0x20) ? ARM_INS_BLX : ARM_INS_BX;
+        insn->flags |= INSN_BRANCH;
+        if (insn->id == ARM_INS_BX && insn->cc == ARM_CC_AL)
+            insn->flags |= INSN_RETURN;
+        fast_op_reg(insn, rm);
+        return true;
+    }
+    // register-shifted registers, multiplies and halfword transfers
+    if (!isImm && (w & 0x10))
+        return false;
+    // the compare opcodes without S are status register and other misc instructions
+    if (opcode >= 8 && opcode <= 11 && !(w & 0x100000))
+        return false;
+    // anything involving pc is left to capstone, as are the shift aliases of mov
+    if (rd == 15 || rn == 15 || (!isImm && (w & 15) == 15))
+        return false;
+    if (opcode == 13 && !isImm && (w & 0xFF0) != 0)
+        return false;
+    insn->id = ids[opcode];
+    if (opcode >= 8 && opcode <= 11)
+    {
+        if (rd != 0)
+            return false;
+        fast_op_reg(insn, rn);
+    }
+    else if (opcode == 13 || opcode == 15)
+    {
+        if (rn != 0)
+            return false;
+        fast_op_reg(insn, rd);
+    }
+    else
+    {
+        fast_op_reg(insn, rd);
+        fast_op_reg(insn, rn);
+    }
+    if (isImm)
+    {
+        // rotated immediates may be printed with their rotation
+        if (w & 0xF00)
+            return false;
+        fast_op_imm(insn, w & 0xFF);
+    }
+    else
+    {
+        int shift = (w >> 5) & 3;
+        int amount = (w >> 7) & 31;
+
+        // lsr/asr #0 shift by 32 and ror #0 is rrx
+        if (amount == 0 && shift != 0)
+            return false;
+        fast_op_reg(insn, w & 15);
+        if (amount != 0)
+        {
+            insn->ops[insn->opCount - 1].shiftType = shifts[shift];
+            insn->ops[insn->opCount - 1].shiftValue = amount;
+        }
+    }
+    return true;
+}
+
+// ldr/str/ldrb/strb rd, [rn, #+imm]
+static bool arm_ldst_imm(struct DecodedInsn *insn, uint32_t w)
+{
+    int rn = (w >> 16) & 15;
+    int rd = (w >> 12) & 15;
+    bool load = (w >> 20) & 1;
+    bool byte = (w >> 22) & 1;
+
+    // only positive offsets without writeback, which push and pop are printed as
+    if ((w & 0x01A00000) != 0x01800000)
+        return false;
+    if (rn == 15)
+    {
+        if (!load || byte)
+            return false;
+        insn->flags |= INSN_POOL_LOAD;
+    }
+    else if (rd == 15)
+    {
+        return false;
+    }
+    insn->id = load ? (byte ? ARM_INS_LDRB : ARM_INS_LDR) : (byte ? ARM_INS_STRB : ARM_INS_STR);
+    fast_op_reg(insn, rd);
+    fast_op_mem(insn, rn, -1, w & 0xFFF);
+    return true;
+}
+
+// b/bl label
+static bool arm_branch(struct DecodedInsn *insn, uint32_t w)
+{
+    insn->id = (w & 0x1000000) ? ARM_INS_BL : ARM_INS_B;
+    insn->flags |= INSN_BRANCH;
+    fast_op_imm(insn, insn->addr + 8 + sign_extend(w & 0xFFFFFF, 24) * 4);
+    return true;
+}
+
+static bool (*const sArmDecoders[8])(struct DecodedInsn *, uint32_t) =
+{
+    [0] = arm_data_proc, [1] = arm_data_proc,
+    [2] = arm_ldst_imm,
+    [5] = arm_branch,
+};
+
+static uint16_t read_hword(const uint8_t *code)
+{
+    return code[0] | (code[1] << 8);
+}
+
+static uint32_t read_word(const uint8_t *code)
+{
+    return code[0] | (code[1] << 8) | (code[2] << 16) | ((uint32_t)code[3] << 24);
+}
+
+// Decodes the instruction in code, at addr, into out if it is one the fast
+// path knows capstone's answer for. Instructions the fast path takes are
+// always valid.
+static bool fast_decode(struct DecodedInsn *out, const uint8_t *code, uint32_t addr, enum LabelType type, uint32_t maxSize)
+{
+    memset(out, 0, sizeof(*out));
+    out->addr = addr;
+    out->cc = ARM_CC_AL;
+    out->text = INSN_NO_TEXT;
+    if (type == LABEL_THUMB_CODE)
+    {
+        uint16_t hw;
+
+        if (maxSize < 2)
+            return false;
+        hw = read_hword(code);
+        out->size = 2;
+        out->flags = INSN_VALID | INSN_THUMB;
+        if ((hw >> 11) == 0x1E)
+            return maxSize >= 4 && thumb_bl(out, hw, read_hword(code + 2));
+        return sThumbDecoders[hw >> 11] != NULL && sThumbDecoders[hw >> 11](out, hw);
+    }
+    else
+    {
+        uint32_t w;
+        int cond;
+
+        if (maxSize < 4)
+            return false;
+        w = read_word(code);
+        // the unconditional space holds blx label and coprocessor instructions
+        if ((cond = w >> 28) == 15)
+            return false;
+        out->size = 4;
+        out->cc = (cond == 14) ? ARM_CC_AL : ARM_CC_EQ + cond;
+        out->flags = INSN_VALID;
+        return sArmDecoders[(w >> 25) & 7] != NULL && sArmDecoders[(w >> 25) & 7](out, w);
+    }
+}
+
+// Output
+
+// Where the current thread prints to: the output sink and stderr if NULL.
+static _Thread_local struct OutBuffer *sOut = NULL;
+static _Thread_local struct OutBuffer *sErr = NULL;
+
+// The main thread formats into one sink buffer while the writer thread writes
+// the other one out, so formatting never waits for the pipe or the disk
+// unless it gets a whole buffer ahead.
+#define SINK_BUFFER_SIZE 0x100000
+
+static void out_buffer_reserve(struct OutBuffer *buffer, size_t size)
+{
+    while (buffer->size + size > buffer->bufferSize)
+    {
+        buffer->bufferSize = buffer->bufferSize ? 2 * buffer->bufferSize : 0x10000;
+        buffer->data = realloc(buffer->data, buffer->bufferSize);
+        if (buffer->data == NULL)
+            fatal_error("failed to alloc space for output. ");
+    }
+}
+
+static void out_buffer_vprintf(struct OutBuffer *buffer, FILE *stream, const char *fmt, va_list args)
+{
+    va_list copy;
+    int length;
+
+    if (buffer == NULL)
+    {
+        vfprintf(stream, fmt, args);
+        return;
+    }
+    out_buffer_reserve(buffer, 0x100);
+    va_copy(copy, args);
+    length = vsnprintf(buffer->data + buffer->size, buffer->bufferSize - buffer->size, fmt, copy);
+    va_end(copy);
+    if ((size_t)length >= buffer->bufferSize - buffer->size)
+    {
+        out_buffer_reserve(buffer, length + 1);
+        vsnprintf(buffer->data + buffer->size, length + 1, fmt, args);
+    }
+    buffer->size += length;
+}
+
+// Failing stops the output. It's reported on the main thread, the next time it
+// hands over a buffer.
+static void sink_write(struct DisasmState *st, const char *data, size_t size)
+{
+    while (size != 0 && st->sinkError == 0)
+    {
+        ssize_t written = write(st->sinkFd, data, size);
+
+        if (written < 0)
+        {
+            if (errno != EINTR)
+                st->sinkError = errno;
+            continue;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+// Nothing here goes through fatal_error: a write that fails is kept in
+// sinkError for the main thread to report.
+static void *sink_main(void *arg)
+{
+    struct DisasmState *st = arg;
+
+    pthread_mutex_lock(&st->sinkLock);
+    while (1)
+    {
+        struct OutBuffer *buffer;
+        double time;
+
+        while (!st->sinkBusy && !st->sinkExit)
+            pthread_cond_wait(&st->sinkCond, &st->sinkLock);
+        if (!st->sinkBusy)
+            break;
+        buffer = &st->sinkBuffers[!st->sinkFill];
+        pthread_mutex_unlock(&st->sinkLock);
+
+        time = wall_time();
+        sink_write(st, buffer->data, buffer->size);
+        st->sinkWriteTime += wall_time() - time;
+        st->sinkBytes += buffer->size;
+        buffer->size = 0;
+
+        pthread_mutex_lock(&st->sinkLock);
+        st->sinkBusy = false;
+        pthread_cond_broadcast(&st->sinkCond);
+    }
+    pthread_mutex_unlock(&st->sinkLock);
+    return NULL;
+}
+
+// Hands the buffer formatted so far to the writer thread, once it is done
+// with the previous one. Returns the errno of a write that failed, or 0.
+static int sink_hand_over(struct DisasmState *st)
+{
+    double time = wall_time();
+    int error;
+
+    pthread_mutex_lock(&st->sinkLock);
+    while (st->sinkBusy)
+        pthread_cond_wait(&st->sinkCond, &st->sinkLock);
+    st->sinkWaitTime += wall_time() - time;
+    error = st->sinkError;
+    st->sinkFill = !st->sinkFill;
+    st->sinkBusy = true;
+    pthread_cond_broadcast(&st->sinkCond);
+    pthread_mutex_unlock(&st->sinkLock);
+    return error;
+}
+
+static void sink_flush(struct DisasmState *st)
+{
+    int error = sink_hand_over(st);
+
+    if (error != 0)
+        fatal_error("failed to write output: %s", strerror(error));
+}
+
+// Writes everything left and stops the writer thread. Returns the errno of a
+// write that failed, or 0. Also runs when a disassembly that failed is
+// destroyed, so that output printed before the error isn't lost.
+static int sink_stop(struct DisasmState *st)
+{
+    int error;
+
+    if (!st->sinkOpen)
+        return 0;
+    sink_hand_over(st);
+    pthread_mutex_lock(&st->sinkLock);
+    st->sinkExit = true;
+    pthread_cond_broadcast(&st->sinkCond);
+    pthread_mutex_unlock(&st->sinkLock);
+    pthread_join(st->sinkThread, NULL);
+    st->sinkOpen = false;
+    error = st->sinkError;
+#ifndef _WIN32
+    // drop what preallocation reserved past the end
+    if (st->sinkPreallocated && error == 0 && ftruncate(st->sinkFd, st->sinkBytes) != 0)
+        error = errno;
+#endif
+    if (st->sinkIsFile)
+        close(st->sinkFd);
+    for (int i = 0; i < 2; i++)
+    {
+        free(st->sinkBuffers[i].data);
+        st->sinkBuffers[i] = (struct OutBuffer){0};
+    }
+    return error;
+}
+
+static void sink_close(struct DisasmState *st)
+{
+    int error = sink_stop(st);
+
+    if (error != 0)
+        fatal_error("failed to write output: %s", strerror(error));
+    if (st->disasm->options.printStatistics)
+        fprintf(stderr, "output: %llu bytes, %.3f s writing, %.3f s of it waited for\n",
+                (unsigned long long)st->sinkBytes, st->sinkWriteTime, st->sinkWaitTime);
+}
+
+// Sends the output to fileName, or to stdout if it is NULL. sizeHint is how
+// large the output will be about, for the file to be preallocated.
+static void sink_open(struct DisasmState *st, const char *fileName, size_t sizeHint)
+{
+    if (fileName != NULL)
+    {
+#ifdef _WIN32
+        st->sinkFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+#else
+        int error;
+
+        st->sinkFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+        if (st->sinkFd < 0)
+            fatal_error("failed to open output file %s: %s", fileName, strerror(errno));
+        st->sinkIsFile = true;
+#ifndef _WIN32
+        // Keeps the file in few extents. Where that isn't possible, as on a
+        // file system without it or a device, the output goes there as it is,
+        // but running out of space is reported before anything is printed.
+        error = posix_fallocate(st->sinkFd, 0, sizeHint);
+        if (error != 0 && error != EINVAL && error != EOPNOTSUPP && error != ENODEV && error != ESPIPE && error != EINTR)
+        {
+            close(st->sinkFd);
+            st->sinkFd = -1;
+            fatal_error("failed to allocate output file %s: %s", fileName, strerror(error));
+        }
+        st->sinkPreallocated = error == 0;
+#else
+        (void)sizeHint;
+#endif
+    }
+    else
+    {
+        fflush(stdout);
+        st->sinkFd = fileno(stdout);
+        st->sinkIsFile = st->sinkPreallocated = false;
+    }
+    st->sinkFill = 0;
+    st->sinkBusy = st->sinkExit = false;
+    st->sinkError = 0;
+    st->sinkBytes = 0;
+    st->sinkWriteTime = st->sinkWaitTime = 0;
+    if (pthread_create(&st->sinkThread, NULL, sink_main, st) != 0)
+    {
+        if (st->sinkIsFile)
+            close(st->sinkFd);
+        fatal_error("failed to start output thread. ");
+    }
+    st->sinkOpen = true;
+}
+
+static void out_write(struct DisasmState *st, const char *s, size_t length)
+{
+    struct OutBuffer *buffer = (sOut != NULL) ? sOut : &st->sinkBuffers[st->sinkFill];
+
+    out_buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->size, s, length);
+    buffer->size += length;
+    if (sOut == NULL && buffer->size >= SINK_BUFFER_SIZE)
+        sink_flush(st);
+}
+
+static void out_str(struct DisasmState *st, const char *s)
+{
+    out_write(st, s, strlen(s));
+}
+
+static void __attribute__((format(printf, 2, 3))) out_printf(struct DisasmState *st, const char *fmt, ...)
+{
+    struct OutBuffer *buffer = (sOut != NULL) ? sOut : &st->sinkBuffers[st->sinkFill];
+    va_list args;
+
+    va_start(args, fmt);
+    out_buffer_vprintf(buffer, NULL, fmt, args);
+    va_end(args);
+    if (sOut == NULL && buffer->size >= SINK_BUFFER_SIZE)
+        sink_flush(st);
+}
+
+static void __attribute__((format(printf, 1, 2))) err_printf(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    out_buffer_vprintf(sErr, stderr, fmt, args);
+    va_end(args);
+}
+
+// Instruction Text
+
+// Lines of disassembly are built here and written out in one go.
+static _Thread_local char sLine[0x400];
+static _Thread_local size_t sLineLength;
+static _Thread_local bool sLineDiscard;
+
+static void line_write(struct DisasmState *st, const char *s, size_t length)
+{
+    if (sLineLength + length > sizeof(sLine))
+    {
+        if (!sLineDiscard)
+            out_write(st, sLine, sLineLength);
+        sLineLength = 0;
+        if (length > sizeof(sLine))
+        {
+            if (!sLineDiscard)
+                out_write(st, s, length);
+            return;
+        }
+    }
+    memcpy(sLine + sLineLength, s, length);
+    sLineLength += length;
+}
+
+static void line_str(struct DisasmState *st, const char *s)
+{
+    line_write(st, s, strlen(s));
+}
+
+static void line_char(struct DisasmState *st, char c)
+{
+    line_write(st, &c, 1);
+}
+
+// Appends value in uppercase hex, zero padded to at least the given number of digits.
+static void line_hex(struct DisasmState *st, uint32_t value, int digits)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char buffer[8];
+    int n = 0;
+
+    do
+    {
+        buffer[7 - n++] = hexDigits[value & 15];
+        value >>= 4;
+    } while (value != 0 || n < digits);
+    line_write(st, buffer + 8 - n, n);
+}
+
+static void line_dec(struct DisasmState *st, uint32_t value)
+{
+    char buffer[10];
+    int n = 0;
+
+    do
+    {
+        buffer[9 - n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    line_write(st, buffer + 10 - n, n);
+}
+
+static void line_end(struct DisasmState *st, int caseNum)
+{
+    if (caseNum >= 0)
+    {
+        line_str(st, " @ case ");
+        line_dec(st, caseNum);
+    }
+    line_char(st, '\n');
+    if (!sLineDiscard)
+        out_write(st, sLine, sLineLength);
+    sLineLength = 0;
+}
+
+static const char *reg_name(struct DisasmState *st, int reg)
+{
+    static const char *const names[] =
+    {
+        "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+        "r8", "sb", "sl", "fp", "ip",
+    };
+
+    if (reg >= ARM_REG_R0 && reg <= ARM_REG_R12)
+        return names[reg - ARM_REG_R0];
+    switch (reg)
+    {
+    case ARM_REG_SP:
+        return "sp";
+    case ARM_REG_LR:
+        return "lr";
+    case ARM_REG_PC:
+        return "pc";
+    }
+    return cs_reg_name(st->decoder.capstone, reg);
+}
+
+static void line_reg(struct DisasmState *st, int reg)
+{
+    line_str(st, reg_name(st, reg));
+}
+
+// Immediates are printed in decimal up to 9 and in hex above, like capstone does.
+static void line_magnitude(struct DisasmState *st, uint32_t value)
+{
+    if (value > 9)
+    {
+        line_str(st, "0x");
+        for (int shift = 28; shift >= 0; shift -= 4)
+        {
+            if ((value >> shift) != 0 || shift == 0)
+                line_char(st, "0123456789abcdef"[(value >> shift) & 15]);
+        }
+    }
+    else
+    {
+        line_dec(st, value);
+    }
+}
+
+static void line_imm(struct DisasmState *st, int32_t value)
+{
+    if (value < 0)
+    {
+        line_str(st, "#-");
+        line_magnitude(st, -(uint32_t)value);
+    }
+    else
+    {
+        line_char(st, '#');
+        line_magnitude(st, value);
+    }
+}
+
+// Branch targets are addresses, so they are never printed as negative.
+static void line_target(struct DisasmState *st, uint32_t value)
+{
+    line_char(st, '#');
+    line_magnitude(st, value);
+}
+
+static const char *insn_name(int id)
+{
+    switch (id)
+    {
+    case ARM_INS_AND:   return "and";
+    case ARM_INS_EOR:   return "eor";
+    case ARM_INS_SUB:   return "sub";
+    case ARM_INS_RSB:   return "rsb";
+    case ARM_INS_ADD:   return "add";
+    case ARM_INS_ADC:   return "adc";
+    case ARM_INS_SBC:   return "sbc";
+    case ARM_INS_RSC:   return "rsc";
+    case ARM_INS_TST:   return "tst";
+    case ARM_INS_TEQ:   return "teq";
+    case ARM_INS_CMP:   return "cmp";
+    case ARM_INS_CMN:   return "cmn";
+    case ARM_INS_ORR:   return "orr";
+    case ARM_INS_MOV:   return "mov";
+    case ARM_INS_BIC:   return "bic";
+    case ARM_INS_MVN:   return "mvn";
+    case ARM_INS_LSL:   return "lsl";
+    case ARM_INS_LSR:   return "lsr";
+    case ARM_INS_ASR:   return "asr";
+    case ARM_INS_ROR:   return "ror";
+    case ARM_INS_B:     return "b";
+    case ARM_INS_BL:    return "bl";
+    case ARM_INS_BX:    return "bx";
+    case ARM_INS_BLX:   return "blx";
+    case ARM_INS_LDR:   return "ldr";
+    case ARM_INS_LDRB:  return "ldrb";
+    case ARM_INS_LDRH:  return "ldrh";
+    case ARM_INS_LDRSB: return "ldrsb";
+    case ARM_INS_LDRSH: return "ldrsh";
+    case ARM_INS_STR:   return "str";
+    case ARM_INS_STRB:  return "strb";
+    case ARM_INS_STRH:  return "strh";
+    case ARM_INS_PUSH:  return "push";
+    case ARM_INS_POP:   return "pop";
+    case ARM_INS_ADR:   return "adr";
+    }
+    fatal_error("no name for instruction %d\n", id);
+}
+
+static bool is_compare(int id)
+{
+    return id == ARM_INS_TST || id == ARM_INS_TEQ || id == ARM_INS_CMP || id == ARM_INS_CMN;
+}
+
+// Whether an instruction from the fast path is printed with an 's' suffix.
+static bool fast_sets_flags(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    if (insn->flags & INSN_THUMB)
+    {
+        uint16_t hw = hword_at(st, insn->addr);
+
+        // shifts, add/sub, the imm8 forms and the register ALU operations
+        if (hw < 0x4000)
+            return !is_compare(insn->id);
+        if ((hw & 0xFC00) == 0x4000)
+            return !is_compare(insn->id);
+        return false;
+    }
+    else
+    {
+        uint32_t w = word_at(st, insn->addr);
+
+        if ((w & 0x0C000000) != 0 || insn->id == ARM_INS_BX || insn->id == ARM_INS_BLX)
+            return false;
+        return (w & 0x100000) && !is_compare(insn->id);
+    }
+}
+
+static void line_mnemonic(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    static const char *const conditions[] =
+    {
+        [ARM_CC_EQ] = "eq", [ARM_CC_NE] = "ne", [ARM_CC_HS] = "hs", [ARM_CC_LO] = "lo",
+        [ARM_CC_MI] = "mi", [ARM_CC_PL] = "pl", [ARM_CC_VS] = "vs", [ARM_CC_VC] = "vc",
+        [ARM_CC_HI] = "hi", [ARM_CC_LS] = "ls", [ARM_CC_GE] = "ge", [ARM_CC_LT] = "lt",
+        [ARM_CC_GT] = "gt", [ARM_CC_LE] = "le", [ARM_CC_AL] = "",
+    };
+
+    if (insn->text != INSN_NO_TEXT)
+    {
+        line_str(st, insn_mnemonic(st, insn));
+        return;
+    }
+    line_str(st, insn_name(insn->id));
+    if (fast_sets_flags(st, insn))
+        line_char(st, 's');
+    line_str(st, conditions[insn->cc]);
+}
+
+static void line_operands(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    static const char *const shifts[] =
+    {
+        [ARM_SFT_ASR] = "asr", [ARM_SFT_LSL] = "lsl", [ARM_SFT_LSR] = "lsr", [ARM_SFT_ROR] = "ror",
+    };
+
+    if (insn->text != INSN_NO_TEXT)
+    {
+        line_str(st, insn_op_str(st, insn));
+        return;
+    }
+    // the fast path only takes the Thumb forms, whose list is in the low 9 bits
+    if (insn->id == ARM_INS_PUSH || insn->id == ARM_INS_POP)
+    {
+        uint16_t hw = hword_at(st, insn->addr);
+        const char *separator = "{";
+
+        for (int reg = 0; reg < 8; reg++)
+        {
+            if (hw & (1 << reg))
+            {
+                line_str(st, separator);
+                line_reg(st, ARM_REG_R0 + reg);
+                separator = ", ";
+            }
+        }
+        if (hw & 0x100)
+        {
+            line_str(st, separator);
+            line_str(st, (insn->id == ARM_INS_POP) ? "pc" : "lr");
+        }
+        line_char(st, '}');
+        return;
+    }
+    for (int i = 0; i < insn->opCount; i++)
+    {
+        const struct InsnOperand *op = &insn->ops[i];
+
+        if (i != 0)
+            line_str(st, ", ");
+        switch (op->type)
+        {
+        case ARM_OP_REG:
+            line_reg(st, op->reg);
+            if (op->shiftType != ARM_SFT_INVALID)
+            {
+                line_str(st, ", ");
+                line_str(st, shifts[op->shiftType]);
+                line_char(st, ' ');
+                line_imm(st, op->shiftValue);
+            }
+            break;
+        case ARM_OP_IMM:
+            if (insn->flags & INSN_BRANCH)
+                line_target(st, op->imm);
+            else
+                line_imm(st, op->imm);
+            break;
+        case ARM_OP_MEM:
+            line_char(st, '[');
+            line_reg(st, op->base);
+            if (op->index != ARM_REG_INVALID)
+            {
+                line_str(st, ", ");
+                line_reg(st, op->index);
+            }
+            // pc relative loads keep a zero offset, others drop it
+            else if (op->disp != 0 || op->base == ARM_REG_PC)
+            {
+                line_str(st, ", ");
+                line_imm(st, op->disp);
+            }
+            line_char(st, ']');
+            break;
+        }
+    }
+}
+
+// Returns the instruction as capstone would print it. The text is only valid
+// until the next line is built.
+static const char *insn_text(struct DisasmState *st, const struct DecodedInsn *insn)
+{
+    sLineDiscard = true;
+    line_mnemonic(st, insn);
+    line_char(st, ' ');
+    line_operands(st, insn);
+    line_char(st, '\0');
+    sLineDiscard = false;
+    sLineLength = 0;
+    return sLine;
+}
+
+static bool insn_same(const struct DecodedInsn *a, const struct DecodedInsn *b)
+{
+    if (a->addr != b->addr || a->id != b->id || a->size != b->size || a->cc != b->cc
+     || a->flags != b->flags || a->opCount != b->opCount)
+        return false;
+    for (int i = 0; i < 3; i++)
+    {
+        if (a->ops[i].type != b->ops[i].type
+         || a->ops[i].shiftType != b->ops[i].shiftType
+         || a->ops[i].shiftValue != b->ops[i].shiftValue
+         || a->ops[i].subtracted != b->ops[i].subtracted
+         || a->ops[i].reg != b->ops[i].reg
+         || a->ops[i].index != b->ops[i].index
+         || a->ops[i].disp != b->ops[i].disp)
+            return false;
+    }
+    return true;
+}
+
+// Compares the fast path with capstone at every halfword (Thumb) or word (ARM)
+// of the module it takes, and returns the number of mismatches. report names
+// what is compared in the first few mismatches printed, if any are.
+static int fast_decoder_compare(struct DisasmState *st, enum LabelType type, int *taken, int *positions, const char *report)
+{
+    uint32_t step = (type == LABEL_THUMB_CODE) ? 2 : 4;
+    uint32_t end = st->disasm->romLoadAddr + (st->disasm->inputFileBufferSize & ~(step - 1));
+    int mismatches = 0;
+    struct DecodedInsn fast, slow;
+    char text[CS_MNEMONIC_SIZE + sizeof(st->decoder.buffer->op_str) + 1];
+    const char *fastText;
+
+    *taken = *positions = 0;
+    for (uint32_t addr = st->disasm->romLoadAddr; addr < end; addr += step)
+    {
+        const uint8_t *code = st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr);
+
+        (*positions)++;
+        if (!fast_decode(&fast, code, addr, type, end - addr))
+            continue;
+        (*taken)++;
+        if (!capstone_decode(&st->decoder, code, addr, type, end - addr))
+        {
+            if (report != NULL && mismatches < 20)
+                fprintf(stderr, "verify: %s instruction at 0x%08X (0x%0*X) doesn't decode with capstone\n",
+                        report, addr, step * 2, step == 2 ? hword_at(st, addr) : word_at(st, addr));
+            mismatches++;
+            continue;
+        }
+        insn_from_capstone(st, &slow, st->decoder.buffer, type);
+        snprintf(text, sizeof(text), "%s %s", st->decoder.buffer->mnemonic, st->decoder.buffer->op_str);
+        fastText = insn_text(st, &fast);
+        if (insn_same(&fast, &slow) && strcmp(fastText, text) == 0)
+            continue;
+        if (report != NULL && mismatches < 20)
+            fprintf(stderr, "verify: %s instruction at 0x%08X (0x%0*X) decodes differently: fast path '%s' (id %d), capstone '%s' (id %d)\n",
+                    report, addr, step * 2, step == 2 ? hword_at(st, addr) : word_at(st, addr),
+                    fastText, fast.id, text, slow.id);
+        mismatches++;
+    }
+    return mismatches;
+}
+
+// The encodings the fast path is checked on besides the module: every Thumb
+// halfword, every BL prefix with a random suffix, then for every combination
+// of the ARM opcode bits it looks at (27-20 and 7-4) a few random words, and
+// random words. The random parts are the same on every run.
+#define FAST_DECODER_ARM_SAMPLES 4
+#define FAST_DECODER_RANDOM_WORDS 0x2000
+
+static uint8_t *fast_decoder_patterns(size_t *size)
+{
+    size_t count = 0x10000 + 2 * 0x800 + 2 * (FAST_DECODER_ARM_SAMPLES * 0x1000 + FAST_DECODER_RANDOM_WORDS);
+    uint8_t *buffer = malloc(count * 2);
+    uint32_t random = 0x4E445341;
+    size_t n = 0;
+
+    if (buffer == NULL)
+        fatal_error("failed to alloc space for the decoder check. ");
+// little endian, like the module
+#define PUT_HWORD(value) (buffer[n++] = (value) & 0xFF, buffer[n++] = ((value) >> 8) & 0xFF)
+// xorshift32
+#define NEXT_RANDOM() (random ^= random << 13, random ^= random >> 17, random ^= random << 5)
+    for (uint32_t i = 0; i < 0x10000; i++)
+        PUT_HWORD(i);
+    for (uint32_t i = 0; i < 0x800; i++)
+    {
+        NEXT_RANDOM();
+        PUT_HWORD(0xF000 | i);
+        PUT_HWORD(((random & 0x800) ? 0xF800 : 0xE800) | (random & 0x7FF));
+    }
+    for (uint32_t i = 0; i < FAST_DECODER_ARM_SAMPLES * 0x1000 + FAST_DECODER_RANDOM_WORDS; i++)
+    {
+        uint32_t opcode = i % 0x1000;
+        uint32_t w = NEXT_RANDOM();
+
+        if (i < FAST_DECODER_ARM_SAMPLES * 0x1000)
+            w = (w & ~0x0FF000F0) | (opcode >> 4) << 20 | (opcode & 15) << 4;
+        PUT_HWORD(w);
+        PUT_HWORD(w >> 16);
+    }
+#undef NEXT_RANDOM
+#undef PUT_HWORD
+    assert(n == count * 2);
+    *size = n;
+    return buffer;
+}
+
+// Compares the fast path with capstone on fast_decoder_patterns in both modes,
+// and returns the number of mismatches. The context stands in for a module of
+// them meanwhile, since printing an instruction reads its bytes.
+static int fast_decoder_check(struct DisasmState *st, bool report)
+{
+    struct NdsDisasm *disasm = st->disasm;
+    uint8_t *buffer = disasm->inputFileBuffer;
+    size_t bufferSize = disasm->inputFileBufferSize;
+    uint32_t loadAddr = disasm->romLoadAddr;
+    int mismatches = 0;
+
+    disasm->inputFileBuffer = fast_decoder_patterns(&disasm->inputFileBufferSize);
+    disasm->romLoadAddr = 0;
+    for (int t = 0; t < 2; t++)
+    {
+        enum LabelType type = t ? LABEL_THUMB_CODE : LABEL_ARM_CODE;
+        int taken, positions, n;
+
+        n = fast_decoder_compare(st, type, &taken, &positions, report ? (t ? "thumb pattern" : "arm pattern") : NULL);
+        if (report)
+            fprintf(stderr, "verify: %s patterns: %d of %d positions take the fast path, %d mismatches\n",
+                    t ? "thumb" : "arm", taken, positions, n);
+        mismatches += n;
+    }
+    free(disasm->inputFileBuffer);
+    disasm->inputFileBuffer = buffer;
+    disasm->inputFileBufferSize = bufferSize;
+    disasm->romLoadAddr = loadAddr;
+    return mismatches;
+}
+
+// Whether the fast path agrees with the capstone this runs with on
+// fast_decoder_check. That only depends on capstone and whether it's an ARM7
+// module, so it is checked once per process for each.
+static bool fast_decoder_gate(struct DisasmState *st)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static int checked[2];  // 1 if it agrees, -1 if not
+    int isArm7 = st->disasm->options.isArm7;
+
+    pthread_mutex_lock(&lock);
+    if (checked[isArm7] == 0)
+    {
+        checked[isArm7] = (fast_decoder_check(st, false) == 0) ? 1 : -1;
+        if (checked[isArm7] == -1)
+            fprintf(stderr, "warning: the fast path decoder doesn't match capstone %d.%d, so it is off. Run with -V for details\n",
+                    CS_VERSION_MAJOR, CS_VERSION_MINOR);
+    }
+    pthread_mutex_unlock(&lock);
+    return checked[isArm7] == 1;
+}
+
+// Differential test of the fast path against capstone over every halfword
+// (Thumb) and word (ARM) of the module, followed by a throughput comparison,
+// and then over fast_decoder_patterns. Mismatches are an error.
+static void verify_fast_decoder(struct DisasmState *st)
+{
+    int mismatches = 0;
+
+    for (int t = 0; t < 2; t++)
+    {
+        enum LabelType type = t ? LABEL_THUMB_CODE : LABEL_ARM_CODE;
+        uint32_t step = t ? 2 : 4;
+        uint32_t end = st->disasm->romLoadAddr + (st->disasm->inputFileBufferSize & ~(step - 1));
+        int taken, positions, n, decoded = 0;
+        struct DecodedInsn fast, slow;
+        clock_t fastTime, slowTime;
+
+        n = fast_decoder_compare(st, type, &taken, &positions, t ? "thumb" : "arm");
+        mismatches += n;
+
+        fastTime = clock();
+        for (uint32_t addr = st->disasm->romLoadAddr; addr < end; addr += step)
+            decoded += fast_decode(&fast, st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr), addr, type, end - addr);
+        fastTime = clock() - fastTime;
+        slowTime = clock();
+        for (uint32_t addr = st->disasm->romLoadAddr; addr < end; addr += step)
+        {
+            if (capstone_decode(&st->decoder, st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr), addr, type, end - addr))
+                insn_from_capstone(st, &slow, st->decoder.buffer, type);
+        }
+        slowTime = clock() - slowTime;
+
+        fprintf(stderr, "verify: %s: %d of %d positions take the fast path, %d mismatches\n",
+                t ? "thumb" : "arm", taken, positions, n);
+        fprintf(stderr, "verify: %s: fast path %.0f positions/s (%d decoded), capstone %.0f positions/s\n",
+                t ? "thumb" : "arm",
+                positions / ((double)max(fastTime, 1) / CLOCKS_PER_SEC), decoded,
+                positions / ((double)max(slowTime, 1) / CLOCKS_PER_SEC));
+    }
+    mismatches += fast_decoder_check(st, true);
+    if (mismatches != 0)
+        fatal_error("the fast path decoder doesn't match capstone %d.%d", CS_VERSION_MAJOR, CS_VERSION_MINOR);
+}
+
+static void insn_store_init(struct DisasmState *st)
+{
+    st->thumbUndecodable = calloc((st->disasm->inputFileBufferSize / 2 + 31) / 32 + 1, sizeof(uint32_t));
+    if (st->thumbUndecodable == NULL)
+        fatal_error("failed to alloc space for decoded instructions. ");
+}
+
+static void insn_store_free(struct DisasmState *st)
+{
+    if (st->disasm->options.printStatistics)
+    {
+        fprintf(stderr, "instruction store: %d instructions, %zu bytes each + %zu bytes of text, %zu bytes allocated (capstone: %zu bytes per instruction)\n",
+                st->insnsCount, sizeof(struct DecodedInsn), st->insnTextSize,
+                st->insnsBufferCount * (sizeof(*st->insns) + 2 * sizeof(*st->insnHash)) + st->insnTextBufferSize,
+                sizeof(cs_insn) + sizeof(cs_detail));
+        fprintf(stderr, "instruction store: %llu instructions from the fast path, %llu from capstone\n",
+                (unsigned long long)st->fastDecoded, (unsigned long long)st->capstoneDecoded);
+        fprintf(stderr, "thumb resync: %d resyncs, %d halfwords skipped, %d of them already known not to decode\n",
+                sResyncs, sResyncSkipped, sResyncKnown);
+    }
+    free(st->thumbUndecodable);
+    st->thumbUndecodable = NULL;
+    free(st->insns);
+    free(st->insnHash);
+    free(st->insnText);
+    st->insns = NULL;
+    st->insnHash = NULL;
+    st->insnText = NULL;
+    st->insnsCount = st->insnsBufferCount = 0;
+    st->insnTextSize = st->insnTextBufferSize = 0;
+}
+
+// Returns the instruction at addr in the given mode, or NULL if nothing
+// decodes from at most maxSize bytes there. Instructions are only decoded the
+// first time they are asked for, and only go through capstone if the fast path
+// doesn't handle them. The returned pointer is only valid until the next call.
+static const struct DecodedInsn *decode_insn(struct DisasmState *st, uint32_t addr, enum LabelType type, uint32_t maxSize)
+{
+    int i = insn_hash_find(st, insn_key(addr, type));
+    const uint8_t *code;
+
+    if (i != -1)
+        return (st->insns[i].size <= maxSize) ? &st->insns[i] : NULL;
+    if (addr - st->disasm->romLoadAddr >= st->disasm->inputFileBufferSize)
+        return NULL;
+    code = st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr);
+    maxSize = min(maxSize, st->disasm->inputFileBufferSize - (addr - st->disasm->romLoadAddr));
+    if (sIsWorker)
+    {
+        static _Thread_local struct DecodedInsn insn;
+
+        if (st->fastDecode && fast_decode(&insn, code, addr, type, maxSize))
+            return &insn;
+        sWorkerMissed = true;
+        return NULL;
+    }
+    if (st->insnsCount == st->insnsBufferCount)
+        insn_store_grow(st);
+    if (st->fastDecode && fast_decode(&st->insns[st->insnsCount], code, addr, type, maxSize))
+    {
+        st->fastDecoded++;
+    }
+    else
+    {
+        if (!capstone_decode(&st->decoder, code, addr, type, maxSize))
+            return NULL;
+        insn_from_capstone(st, &st->insns[st->insnsCount], st->decoder.buffer, type);
+        st->insns[st->insnsCount].text = insn_text_add(st, st->decoder.buffer->mnemonic, st->decoder.buffer->op_str);
+        st->capstoneDecoded++;
+    }
+    i = st->insnsCount++;
+    st->bytesDecoded += st->insns[i].size;
+    insn_hash_insert(st, i);
+    return &st->insns[i];
+}
+
+// Thumb code resumes after an invalid instruction at the next halfword that
+// decodes on its own, since the second half of a 32-bit encoding may well be
+// an instruction. Returns that address, or end if there is none before it.
+// The halfwords skipped on the way are data, which analysis ignores and the
+// printer emits as .hword.
+static uint32_t thumb_resync(struct DisasmState *st, uint32_t addr, uint32_t end)
+{
+    sResyncs++;
+    for (; addr < end; addr += 2)
+    {
+        uint32_t bit = (addr - st->disasm->romLoadAddr) / 2;
+
+        if ((st->thumbUndecodable[bit / 32] >> (bit % 32)) & 1)
+        {
+            sResyncKnown++;
+        }
+        else
+        {
+            if (decode_insn(st, addr, LABEL_THUMB_CODE, min(2, end - addr)) != NULL)
+                break;
+            // workers only read the bitmap
+            if (!sIsWorker)
+                st->thumbUndecodable[bit / 32] |= 1u << (bit % 32);
+        }
+        sResyncSkipped++;
+    }
+    return addr;
+}
+
+// Code Analysis
+
+// Analysis never looks further than this many bytes past the start of a label.
+#define ANALYSIS_WINDOW_SIZE 0x1000
+
+static void window_init(struct DisasmState *st)
+{
+    // every instruction is at least a halfword long
+    st->window.insns = calloc(ANALYSIS_WINDOW_SIZE / 2, sizeof(*st->window.insns));
+    if (st->window.insns == NULL)
+        fatal_error("failed to alloc space for decoded instructions. ");
+}
+
+static void window_free(struct DisasmState *st)
+{
+    free(st->window.insns);
+    memset(&st->window, 0, sizeof(st->window));
+}
+
+static void window_reset(struct DisasmState *st, uint32_t start, uint32_t end, enum LabelType type)
+{
+    st->window.count = 0;
+    st->window.type = type;
+    st->window.next = start;
+    st->window.end = end;
+    st->bytesWindowed += end - start;
+}
+
+// Drops the instructions from index i on and continues decoding where Thumb
+// code resyncs after addr.
+static void window_rewind(struct DisasmState *st, int i, uint32_t addr)
+{
+    st->window.count = i;
+    st->window.next = thumb_resync(st, addr, st->window.end);
+}
+
+// Returns instruction i of the window, decoding up to it if needed, or NULL if
+// the bytes there don't decode or are past the end of the window.
+static struct DecodedInsn *window_insn(struct DisasmState *st, int i)
+{
+    while (st->window.count <= i)
+    {
+        const struct DecodedInsn *insn;
+
+        if (st->window.next >= st->window.end)
+            return NULL;
+        if ((insn = decode_insn(st, st->window.next, st->window.type, st->window.end - st->window.next)) == NULL)
+            return NULL;
+        st->window.insns[st->window.count++] = *insn;
+        st->window.next += insn->size;
+    }
+    return &st->window.insns[i];
+}
+
+static void jump_table_state_machine_thumb(struct DisasmState *st, struct JumpTableState *jt, const struct DecodedInsn *insn, uint32_t addr)
+{
+    switch (jt->state)
+    {
+    case 0:
+        // add rX, rX, rX
+        jt->gracePeriod = false;
+        if (insn->id == ARM_INS_ADD && insn->ops[2].type == ARM_OP_REG && insn->ops[1].reg == insn->ops[2].reg)
+            goto match;
+        break;
+    case 1:
+        // add rX, pc
+        if (insn->id == ARM_INS_ADD && insn->ops[1].type == ARM_OP_REG && insn->ops[1].reg == ARM_REG_PC)
+            goto match;
+        break;
+    case 2:
+        // ldrh rX, [rX, #imm]
+        if (insn->id == ARM_INS_LDRH) {
+            jt->tableBegin = insn->ops[1].disp + addr + 2;
+            goto match;
+        }
+        break;
+    case 3:
+        // lsls rX, 16
+        if (insn->id == ARM_INS_LSL)
+            goto match;
+        break;
+    case 4:
+        // asrs rX, 16
+        if (insn->id == ARM_INS_ASR)
+            goto match;
+        break;
+    case 5:
+        // add pc, rX
+        if (insn->id == ARM_INS_ADD)
+        {
+            if (insn->ops[0].reg == ARM_REG_PC)
+            {
+                jt->isBx = false;
+                goto match;
+            }
+            if (insn->ops[1].type == ARM_OP_REG
+             && insn->ops[1].reg == ARM_REG_PC)
+            {
+                jt->state++;
+                return;
+            }
+        }
+        break;
+    case 6:
+        if (is_func_return(insn))
+        {
+            jt->isBx = true;
+            goto match;
+        }
+        break;
+    }
+    // didn't match
+    if (jt->gracePeriod)
+        jt->state = 0;
+    else
+        jt->gracePeriod = true;
+    return;
+
+    match:
+    if (jt->state >= 5)  // all checks passed
+    {
+        uint32_t target;
+        uint32_t firstTarget = -1u;
+        int i;
+
+        if ((i = label_order_neighbor(st, jt->tableBegin, 1)) != -1)
+            firstTarget = st->labels[i].addr;
+
+        int numCases = -1;
+        for (i = 1; i < jt->insnIdx; i++) {
+            if (insn[-i].id == ARM_INS_CMP && insn[-i].ops[1].type == ARM_OP_IMM && insn[-i].ops[1].imm > 0) {
+                numCases = insn[-i].ops[1].imm + 1;
+                break;
+            }
+        }
+        i = 0;
+        assert(st->disasm->romLoadAddr == 0 || jt->tableBegin & st->disasm->romLoadAddr);
+        disasm_add_label(st->disasm, jt->tableBegin, jt->isBx ? LABEL_JUMP_TABLE_THUMB_BX : LABEL_JUMP_TABLE_THUMB, NULL, false);
+        jt->state = 0;
+        // add code labels from jump table
+        addr = jt->tableBegin;
+        while (addr < firstTarget && (numCases < 0 || i < numCases))
+        {
+            int label;
+
+            target = hword_at(st, addr) + jt->tableBegin + (jt->isBx ? 0 : 2);
+            if (target - st->disasm->romLoadAddr >= 0x02000000)
+                break;
+            if (!jt->isBx && (target & 1))
+                break;
+            if (target < firstTarget && target > jt->tableBegin)
+                firstTarget = target & ~1;
+            label = disasm_add_label(st->disasm, target & ~1, (!jt->isBx || (target & 3)) ? LABEL_THUMB_CODE : LABEL_ARM_CODE, NULL, false);
+            st->labels[label].branchType = BRANCH_TYPE_B;
+            addr += 2;
+            i++;
+        }
+
+        return;
+    }
+    jt->state++;
+}
+
+static inline void jump_table_state_machine(struct DisasmState *st, struct JumpTableState *jt, const struct DecodedInsn *insn, uint32_t addr, enum LabelType type)
+{
+    if (type == LABEL_THUMB_CODE) {
+        jump_table_state_machine_thumb(st, jt, insn, addr);
+        return;
+    }
+    switch (jt->state)
+    {
+    case 0:
+        if (insn->id == ARM_INS_ADD
+            && insn->ops[0].reg == ARM_REG_PC
+            && insn->ops[2].type == ARM_OP_REG
+            && insn->ops[2].shiftType == ARM_SFT_LSL
+            && insn->ops[2].shiftValue == 2)
+            goto match;
+        break;
+    case 1:
+        if ((insn->id == ARM_INS_B && insn->cc == ARM_CC_AL) || is_func_return(insn))
+            goto match;
+        break;
+    }
+    jt->state = 0;
+    return;
+match:
+    if (jt->state == 1)
+    {
+        uint32_t target;
+        uint32_t firstTarget = (is_branch(insn) && !is_func_return(insn)) ? get_branch_target(insn) : -1u;
+        if (firstTarget < addr) firstTarget = -1u;
+        int i;
+        jt->tableBegin = addr + 4;
+        jt->state = 0;
+        // add code labels from jump table
+        addr = jt->tableBegin;
+        int numCases = -1;
+        for (i = 1; i < jt->insnIdx; i++) {
+            if (insn[-i].id == ARM_INS_CMP) {
+                numCases = insn[-i].ops[1].imm + 1;
+                if (numCases > 1)
+                    break;
+            }
+        }
+        i = 0;
+        disasm_add_label(st->disasm, addr, LABEL_JUMP_TABLE, NULL, false);
+        while (addr < firstTarget && (numCases < 0 || i < numCases))
+        {
+            int label;
+            if (window_insn(st, jt->insnIdx + i + 1) == NULL)
+            {
+                jt->cutOff = true;
+                break;
+            }
+            if (insn[i + 1].id == ARM_INS_B)
+            {
+                target = get_branch_target(&insn[i + 1]);
+                if (target - st->disasm->romLoadAddr >= 0x02000000)
+                {
+                    break;
+                }
+                if (target < firstTarget && target > jt->tableBegin)
+                {
+                    firstTarget = target;
+                }
+                label = disasm_add_label(st->disasm, target, LABEL_ARM_CODE, NULL, false);
+                st->labels[label].branchType = BRANCH_TYPE_B;
+            }
+            else if (!is_func_return(&insn[i + 1]))
+                break;
+            addr += 4;
+            i++;
+        }
+
+        return;
+    }
+    jt->state++;
+}
+
+static void renew_or_add_new_func_label(struct DisasmState *st, enum LabelType type, uint32_t word)
+{
+    if (word & st->disasm->romLoadAddr)
+    {
+        struct Label *label_p = lookup_label(st, word & ~1);
+
+        if (label_p != NULL)
+        {
+            // maybe it has been processed as a non-function label
+            label_set_pending(st, label_p - st->labels);
+            label_p->branchType = BRANCH_TYPE_BL;
+            label_p->isFunc = true;
+        }
+        else
+        {
+            // implicitly set to BRANCH_TYPE_BL
+            int lab = disasm_add_label(st->disasm, word & ~1, type, NULL, false);
+            assert(lab != -1);
+            st->labels[lab].isFunc = true;
+        }
+    }
+}
+
+static size_t coverage_words(struct DisasmState *st)
+{
+    return (st->disasm->inputFileBufferSize / 2 + 31) / 32 + 1;
+}
+
+static void coverage_init(struct DisasmState *st)
+{
+    size_t words = coverage_words(st);
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        st->codeStarts[mode] = calloc(words, sizeof(uint32_t));
+        st->codeCovered[mode] = calloc(words, sizeof(uint32_t));
+        st->codeStops[mode] = calloc(words, sizeof(uint32_t));
+        if (st->codeStarts[mode] == NULL || st->codeCovered[mode] == NULL || st->codeStops[mode] == NULL)
+            fatal_error("failed to alloc space for code coverage. ");
+    }
+}
+
+static void coverage_free(struct DisasmState *st)
+{
+    for (int mode = 0; mode < 2; mode++)
+    {
+        free(st->codeStarts[mode]);
+        free(st->codeCovered[mode]);
+        free(st->codeStops[mode]);
+        st->codeStarts[mode] = st->codeCovered[mode] = st->codeStops[mode] = NULL;
+    }
+}
+
+static bool coverage_is_start(struct DisasmState *st, enum LabelType type, uint32_t addr)
+{
+    uint32_t bit = (addr - st->disasm->romLoadAddr) / 2;
+
+    if (addr - st->disasm->romLoadAddr >= st->disasm->inputFileBufferSize)
+        return false;
+    return (st->codeStarts[type == LABEL_THUMB_CODE][bit / 32] >> (bit % 32)) & 1;
+}
+
+static void coverage_mark(struct DisasmState *st, enum LabelType type, uint32_t addr, uint32_t size, bool isStart)
+{
+    uint32_t bit = (addr - st->disasm->romLoadAddr) / 2;
+    int mode = (type == LABEL_THUMB_CODE);
+
+    if (isStart)
+        st->codeStarts[mode][bit / 32] |= 1u << (bit % 32);
+    for (uint32_t n = 0; n < size / 2; n++, bit++)
+        st->codeCovered[mode][bit / 32] |= 1u << (bit % 32);
+}
+
+// Marks that a trace stopped at end, after a return or a branch away.
+static void coverage_mark_stop(struct DisasmState *st, enum LabelType type, uint32_t end)
+{
+    uint32_t bit = (end - st->disasm->romLoadAddr) / 2 - 1;
+
+    st->codeStops[type == LABEL_THUMB_CODE][bit / 32] |= 1u << (bit % 32);
+}
+
+// Returns where the traced code from the instruction at addr on ends, and
+// sets *stopped if a trace stopped there rather than running out of its
+// window. Traces that merely follow on from it don't count.
+static uint32_t coverage_trace_end(struct DisasmState *st, enum LabelType type, uint32_t addr, bool *stopped)
+{
+    int mode = (type == LABEL_THUMB_CODE);
+    const uint32_t *covered = st->codeCovered[mode];
+    const uint32_t *stops = st->codeStops[mode];
+    uint32_t bit = (addr - st->disasm->romLoadAddr) / 2;
+    uint32_t nbits = st->disasm->inputFileBufferSize / 2;
+
+    *stopped = false;
+    while (bit < nbits)
+    {
+        uint32_t mask = 1u << (bit % 32);
+
+        // skip over fully covered words without a stop
+        if ((bit % 32) == 0 && covered[bit / 32] == 0xFFFFFFFF && stops[bit / 32] == 0)
+        {
+            bit += 32;
+            continue;
+        }
+        if (!(covered[bit / 32] & mask))
+            break;
+        if (stops[bit / 32] & mask)
+        {
+            *stopped = true;
+            return st->disasm->romLoadAddr + (bit + 1) * 2;
+        }
+        bit++;
+    }
+    return st->disasm->romLoadAddr + min(bit, nbits) * 2;
+}
+
+// What the lookbacks of analyze_code could find in the window so far: the
+// registers last loaded from a pool, for a tail call through BX, and any CMP,
+// for the number of cases of a jump table. A trace spliced onto another one
+// wouldn't see what the other had in its window, so neither may have any.
+struct TraceLookback
+{
+    uint64_t poolRegs[(ARM_REG_ENDING + 63) / 64];
+    bool cmp;
+};
+
+static void lookback_add(struct TraceLookback *lookback, const struct DecodedInsn *insn)
+{
+    // like the BX lookback, whatever the operand is
+    uint32_t reg = insn->ops[0].reg;
+
+    if (insn->id == ARM_INS_CMP)
+        lookback->cmp = true;
+    if (reg >= ARM_REG_ENDING)
+        return;
+    if (is_pool_load(insn))
+        lookback->poolRegs[reg / 64] |= 1ull << (reg % 64);
+    else
+        lookback->poolRegs[reg / 64] &= ~(1ull << (reg % 64));
+}
+
+static bool lookback_empty(const struct TraceLookback *lookback)
+{
+    for (size_t i = 0; i < sizeof(lookback->poolRegs) / sizeof(lookback->poolRegs[0]); i++)
+    {
+        if (lookback->poolRegs[i] != 0)
+            return false;
+    }
+    return !lookback->cmp;
+}
+
+// Worker Threads
+
+// With -j, worker threads format the output a chunk at a time ahead of the
+// main thread, see print_disassembly. Analysis stays serial: which labels it
+// finds, and what it makes of them, depends on the order it goes through the
+// worklist in.
+
+struct PrintWorker
+{
+    pthread_t thread;
+    struct DisasmState *st;    // what it works on
+    bool failed;               // in the current batch, with why in error
+    char error[CONTEXT_ERROR_SIZE];
+};
+
+static void worker_batch(void *arg)
+{
+    struct PrintWorker *worker = arg;
+    struct DisasmState *st = worker->st;
+    int next;
+
+    while ((next = __atomic_fetch_add(&st->batchNext, 1, __ATOMIC_RELAXED)) < st->batchCount)
+        st->batchJob(st, worker, next);
+}
+
+// A job that fails leaves the rest of the batch to the other workers, and its
+// error to workers_run.
+static void *worker_main(void *arg)
+{
+    struct PrintWorker *worker = arg;
+    struct DisasmState *st = worker->st;
+    int generation = 0;
+
+    sIsWorker = true;
+    pthread_mutex_lock(&st->workersLock);
+    while (1)
+    {
+        while (!st->workersExit && st->batchGeneration == generation)
+            pthread_cond_wait(&st->batchStart, &st->workersLock);
+        if (st->workersExit)
+            break;
+        generation = st->batchGeneration;
+        pthread_mutex_unlock(&st->workersLock);
+
+        worker->failed = !context_run_job(worker_batch, worker, worker->error);
+
+        pthread_mutex_lock(&st->workersLock);
+        if (--st->batchBusy == 0)
+            pthread_cond_signal(&st->batchDone);
+    }
+    pthread_mutex_unlock(&st->workersLock);
+    return NULL;
+}
+
+static void workers_init(struct DisasmState *st)
+{
+    if (st->disasm->options.printThreads <= 1)
+        return;
+    st->workers = calloc(st->disasm->options.printThreads, sizeof(*st->workers));
+    if (st->workers == NULL)
+        fatal_error("failed to alloc space for worker threads. ");
+    st->workersExit = false;
+    for (st->workersCount = 0; st->workersCount < st->disasm->options.printThreads; st->workersCount++)
+    {
+        struct PrintWorker *worker = &st->workers[st->workersCount];
+
+        worker->st = st;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+            fatal_error("failed to start worker thread. ");
+    }
+}
+
+static void workers_free(struct DisasmState *st)
+{
+    if (st->workersCount == 0)
+        return;
+    pthread_mutex_lock(&st->workersLock);
+    st->workersExit = true;
+    pthread_cond_broadcast(&st->batchStart);
+    pthread_mutex_unlock(&st->workersLock);
+    for (int i = 0; i < st->workersCount; i++)
+        pthread_join(st->workers[i].thread, NULL);
+    free(st->workers);
+    st->workers = NULL;
+    st->workersCount = 0;
+}
+
+// Runs job for every index below count on the workers, and waits for them.
+// An error in a job is raised here, on the thread that owns the disassembly.
+static void workers_run(struct DisasmState *st, void (*job)(struct DisasmState *st, struct PrintWorker *worker, int index), int count)
+{
+    pthread_mutex_lock(&st->workersLock);
+    st->batchJob = job;
+    st->batchCount = count;
+    st->batchNext = 0;
+    st->batchBusy = st->workersCount;
+    st->batchGeneration++;
+    pthread_cond_broadcast(&st->batchStart);
+    while (st->batchBusy != 0)
+        pthread_cond_wait(&st->batchDone, &st->workersLock);
+    pthread_mutex_unlock(&st->workersLock);
+    for (int i = 0; i < st->workersCount; i++)
+    {
+        if (st->workers[i].failed)
+            fatal_error("%s", st->workers[i].error);
+    }
+}
+
+// Traces the code at label li until it returns or branches away for good.
+// type is a constant in each instantiation below, so the compiler drops every
+// check of the mode that doesn't apply.
+static inline __attribute__((always_inline)) void analyze_code(struct DisasmState *st, int li, const enum LabelType type)
+{
+    uint32_t addr = st->labels[li].addr;
+    uint32_t windowEnd = addr + min(ANALYSIS_WINDOW_SIZE, st->disasm->inputFileBufferSize - (addr - st->disasm->romLoadAddr));
+    uint32_t noSpliceBefore = 0;
+    bool stopped = true;
+    struct TraceLookback lookback = {0};
+    struct DecodedInsn *insn;
+    int i;
+
+    st->labels[li].analyzeCount++;
+    st->labels[li].splice = NO_SPLICE;
+    st->jumpTable.state = 0;
+    st->jumpTable.cutOff = false;
+    //fprintf(stderr, "analyzing label at 0x%08X\n", addr);
+    window_reset(st, addr, windowEnd, type);
+    insn = st->window.insns;
+    for (i = 0; ; i++)
+    {
+        uint32_t nextAddr = (i < st->window.count) ? insn[i].addr : st->window.next;
+        bool clean = st->jumpTable.state == 0 && lookback_empty(&lookback);
+
+        // Already traced from another label: splice onto that trace, unless
+        // either has something in its window that would be looked back at.
+        // If it ran out of its window before this one's ends, this one goes
+        // on by itself, as it couldn't pick up where that one left off.
+        if (clean && !st->noSplice && nextAddr >= noSpliceBefore && coverage_is_start(st, type, nextAddr))
+        {
+            bool joinedStopped;
+            uint32_t end = coverage_trace_end(st, type, nextAddr, &joinedStopped);
+
+            if (joinedStopped || end >= windowEnd)
+            {
+                addr = min(end, windowEnd);
+                st->splicedTraces++;
+                st->labels[li].splice = nextAddr;
+                stopped = false;
+                break;
+            }
+            noSpliceBefore = end;
+        }
+        if (window_insn(st, i) == NULL)
+        {
+            stopped = false;
+            break;
+        }
+        st->jumpTable.insnIdx = i;
+        addr = insn[i].addr;
+        if (!is_valid_insn(&insn[i])) {
+            if (type == LABEL_THUMB_CODE)
+            {
+                coverage_mark(st, type, addr, 2, false);
+                addr += 2;
+                if (insn[i].size == 2)
+                {
+                    lookback_add(&lookback, &insn[i]);
+                    continue;
+                }
+                // retry from the second half of the instruction
+                window_rewind(st, i--, addr);
+                continue;
+            }
+            else
+            {
+                coverage_mark(st, type, addr, 4, false);
+                addr += 4;
+                lookback_add(&lookback, &insn[i]);
+                continue;
+            }
+        };
+        // the CMP lookbacks skip the first instruction of the window, which
+        // this one is for a trace spliced onto it
+        coverage_mark(st, type, addr, insn[i].size, clean && insn[i].id != ARM_INS_CMP);
+        lookback_add(&lookback, &insn[i]);
+        jump_table_state_machine(st, &st->jumpTable, &insn[i], addr, type);
+
+        // fprintf(stderr, "/*0x%08X*/ %s %s\n", addr, insn[i].mnemonic, insn[i].op_str);
+        if (is_branch(&insn[i]))
+        {
+            uint32_t target;
+            //uint32_t currAddr = addr;
+
+            addr += insn[i].size;
+
+            // For BX{COND}, only BXAL can be considered as end of function
+            if (is_func_return(&insn[i]))
+            {
+                struct Label *label_p;
+
+                if (insn[i].id == ARM_INS_BX && insn[i].ops[0].type == ARM_OP_REG)
+                {
+                    for (int j = i - 1; j >= 0; j--)
+                    {
+                        if (insn[j].ops[0].reg == insn[i].ops[0].reg)
+                        {
+                            if (is_pool_load(&insn[j]))
+                            {
+                                // Tail call
+                                uint32_t pool_target = word_at(st, 
+                                    get_pool_load(&insn[j], insn[j].addr, type));
+                                int added = disasm_add_label(st->disasm, 
+                                    pool_target & ~1,
+                                    pool_target & 3 ? LABEL_THUMB_CODE : LABEL_ARM_CODE,
+                                    NULL,
+                                    false
+                                );
+                                if (added >= 0 && added < st->labelsCount)
+                                {
+                                    st->labels[added].isFunc = true;
+                                }
+                            }
+                            break;
+                        }
+                    }
+                }
+
+                // It's possible that handwritten code with different mode follows. 
+                // However, this only causes problem when the address following is
+                // incorrectly labeled as BRANCH_TYPE_B. 
+                label_p = lookup_label(st, addr);
+                if (label_p != NULL
+                 && (label_p->type == LABEL_THUMB_CODE || label_p->type == LABEL_ARM_CODE)
+                 && label_p->type != type
+                 && label_p->branchType == BRANCH_TYPE_B)
+                {
+                    label_p->branchType = BRANCH_TYPE_BL;
+                    label_p->isFunc = true;
+                }
+                break;
+            }
+
+            if (insn[i].id == ARM_INS_BX) // BX{COND} when COND != AL
+                continue;
+
+            if (insn[i].id == ARM_INS_BLX && insn[i].ops[0].type == ARM_OP_REG)
+                continue;
+
+            target = get_branch_target(&insn[i]);
+            assert(target != 0);
+
+            // I don't remember why I needed this condition
+            //if (!(target >= labels[li].addr && target <= currAddr))
+            if (target != addr)
+            {
+                enum LabelType newtype = type;
+                if (insn[i].id == ARM_INS_BLX)
+                    newtype = type == LABEL_THUMB_CODE ? LABEL_ARM_CODE : LABEL_THUMB_CODE;
+                int lbl = disasm_add_label(st->disasm, target, newtype, NULL, false);
+
+                if (!st->labels[lbl].isFunc) // do nothing if it's 100% a func (from func ptr, or instant mode exchange)
+                {
+                    if (insn[i].id == ARM_INS_BL || insn[i].id == ARM_INS_BLX)
+                    {
+                        const struct Label *next;
+
+                        if (st->labels[lbl].branchType != BRANCH_TYPE_B)
+                            st->labels[lbl].branchType = BRANCH_TYPE_BL;
+                        if (insn[i].id != ARM_INS_BLX)
+                        {
+                            // if the address right after is a pool, then we know
+                            // for sure that this is a far jump and not a function call
+                            if (((next = lookup_label(st, addr)) != NULL && next->type == LABEL_POOL)
+                                // if the 2 bytes following are zero, assume it's padding
+                                || (type == LABEL_THUMB_CODE && ((addr & 3) != 0) && hword_at(st, addr) == 0))
+                            {
+                                st->labels[lbl].branchType = BRANCH_TYPE_B;
+                                break;
+                            }
+                        }
+                    }
+                    else
+                    {
+                        // the label might be given a name in .cfg file, but it's actually not a function
+                        if (st->labels[lbl].name != NULL)
+                            free(st->labels[lbl].name);
+                        st->labels[lbl].name = NULL;
+                        st->labels[lbl].unnamed = true;
+                        st->labels[lbl].branchType = BRANCH_TYPE_B;
+                    }
+                }
+            }
+            // unconditional jump and not a function call
+            if (insn[i].cc == ARM_CC_AL && insn[i].id != ARM_INS_BL && insn[i].id != ARM_INS_BLX)
+                break;
+        }
+        else
+        {
+            uint32_t poolAddr;
+            uint32_t word;
+
+            addr += insn[i].size;
+
+            if (is_func_return(&insn[i]))
+            {
+                struct Label *label_p;
+
+                // It's possible that handwritten code with different mode follows. 
+                // However, this only causes problem when the address following is
+                // incorrectly labeled as BRANCH_TYPE_B. 
+                label_p = lookup_label(st, addr);
+                if (label_p != NULL
+                 && (label_p->type == LABEL_THUMB_CODE || label_p->type == LABEL_ARM_CODE)
+                 && label_p->type != type
+                 && label_p->branchType == BRANCH_TYPE_B)
+                {
+                    label_p->branchType = BRANCH_TYPE_BL;
+                    label_p->isFunc = true;
+                }
+                break;
+            }
+
+            // looks like that this check can only detect thumb mode
+            // anyway I still put the arm mode things here for a potential future fix
+            if (insn[i].id == ARM_INS_ADR)
+            {
+                word = insn[i].ops[1].imm + (addr - insn[i].size)
+                     + (type == LABEL_THUMB_CODE ? 4 : 8);
+                if (type == LABEL_THUMB_CODE)
+                    word &= ~3;
+                goto check_handwritten_indirect_jump;
+            }
+
+            // fix above check for arm mode
+            if (type == LABEL_ARM_CODE
+             && insn[i].id == ARM_INS_ADD
+             && insn[i].ops[0].type == ARM_OP_REG
+             && insn[i].ops[1].type == ARM_OP_REG
+             && insn[i].ops[1].reg == ARM_REG_PC
+             && insn[i].ops[2].type == ARM_OP_IMM)
+            {
+                word = insn[i].ops[2].imm + (addr - insn[i].size) + 8;
+                goto check_handwritten_indirect_jump;
+            }
+
+            if (is_pool_load(&insn[i]))
+            {
+                poolAddr = get_pool_load(&insn[i], addr - insn[i].size, type);
+                assert(poolAddr != 0);
+                assert((poolAddr & 3) == 0);
+                disasm_add_label(st->disasm, poolAddr, LABEL_POOL, NULL, false);
+                word = word_at(st, poolAddr);
+                if (insn[i].ops[0].reg == ARM_REG_PC)
+                {
+                    renew_or_add_new_func_label(st, word & 1 ? LABEL_THUMB_CODE : LABEL_ARM_CODE, word);
+                    if (insn[i].cc == ARM_CC_AL)
+                        break;
+                }
+
+            check_handwritten_indirect_jump:
+                if (window_insn(st, i + 1) != NULL) // is not the last insn in the window
+                {
+                    // check if it's followed with bx RX or mov PC, RX (conditional won't hurt)
+                    if (insn[i + 1].id == ARM_INS_BX)
+                    {
+                        if (insn[i + 1].ops[0].type == ARM_OP_REG
+                         && insn[i].ops[0].reg == insn[i + 1].ops[0].reg)
+                            renew_or_add_new_func_label(st, word & 1 ? LABEL_THUMB_CODE : LABEL_ARM_CODE, word);
+                    }
+                    else if (insn[i + 1].id == ARM_INS_MOV
+                          && insn[i + 1].ops[0].type == ARM_OP_REG
+                          && insn[i + 1].ops[0].reg == ARM_REG_PC
+                          && insn[i + 1].ops[1].type == ARM_OP_REG
+                          && insn[i].ops[0].reg == insn[i + 1].ops[1].reg)
+                    {
+                        renew_or_add_new_func_label(st, type, word);
+                    }
+                }
+            }
+        }
+    }
+    // a trace that joins this one further on could see more of the table
+    if (stopped && !st->jumpTable.cutOff)
+        coverage_mark_stop(st, type, addr);
+    st->labels[li].processed = true;
+    st->labels[li].size = addr - st->labels[li].addr;
+    st->bytesUsed += st->labels[li].size;
+}
+
+static void analyze_arm(struct DisasmState *st, int li)
+{
+    analyze_code(st, li, LABEL_ARM_CODE);
+}
+
+static void analyze_thumb(struct DisasmState *st, int li)
+{
+    analyze_code(st, li, LABEL_THUMB_CODE);
+}
+
+// Analysis Database
+
+// With -R, the labels analysis ends up with are saved for the module, along
+// with the config labels it started from, which labels each trace added or
+// looked up, and the code coverage. The next run compares its config with the
+// saved one. If only names changed, nothing is analyzed. Otherwise the labels
+// still added by traces from unchanged config labels are kept, and only the
+// new and retyped config labels, and the kept traces that touched anything
+// else or joined one that isn't kept, are traced again. The coverage of a kept
+// trace is put back when the worklist gets to where it was traced, so the
+// traces in between stop where they did in a full analysis. Like -A, a
+// different order can still split overlapping traces differently.
+//
+// File layout, little endian:
+//   struct AnalysisHeader
+//   struct AnalysisConfig[configCount]  sorted by address
+//   struct AnalysisLabel[labelCount]    sorted by address
+//   uint32_t edges[edgeCount]           AnalysisLabel indices, by the label whose trace made them
+//   uint32_t coverage[6][words]         splice points, covered halfwords, then stops, ARM then Thumb
+
+#define ANALYSIS_MAGIC          0x41534E44 // "NDSA"
+#define ANALYSIS_VERSION        3
+#define ANALYSIS_EDGE_LOOKUP    0x80000000 // the trace only looked the label up
+
+enum
+{
+    ANALYSIS_FUNC       = 1 << 0,
+    ANALYSIS_CONFIG     = 1 << 1,
+    ANALYSIS_UNNAMED    = 1 << 2,
+};
+
+struct AnalysisHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t configCount;
+    uint32_t labelCount;
+    uint32_t edgeCount;
+    uint32_t reserved;
+};
+
+struct AnalysisConfig
+{
+    uint32_t addr;
+    uint32_t type;
+};
+
+struct AnalysisLabel
+{
+    uint32_t addr;
+    uint32_t size;
+    uint32_t edgeFirst;
+    uint32_t edgeCount;
+    uint32_t splice;
+    uint8_t type;
+    uint8_t branchType;
+    uint8_t flags;
+    uint8_t reserved;
+};
+
+// What happens to each saved label on an incremental run
+enum
+{
+    SAVED_KEPT      = 1 << 0, // still added by a trace that's up to date
+    SAVED_STALE     = 1 << 1, // its trace no longer happens as saved
+    SAVED_TAINTED   = 1 << 2, // a stale trace added or changed it
+    SAVED_RETRACE   = 1 << 3, // kept, but its trace touched or joined one that isn't
+    SAVED_ROOT      = 1 << 4, // a config label as it was last time
+    SAVED_CHANGED   = 1 << 5, // a config label that's new, retyped or dropped
+};
+
+// Binary search by address, which both saved tables start with.
+static int analysis_search(const void *table, uint32_t count, size_t stride, uint32_t addr)
+{
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (*(const uint32_t *)((const uint8_t *)table + mid * stride) < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < count && *(const uint32_t *)((const uint8_t *)table + lo * stride) == addr)
+        return lo;
+    return -1;
+}
+
+static void analysis_restore_label(struct DisasmState *st, const struct AnalysisLabel *saved, bool retrace)
+{
+    int i = disasm_add_label(st->disasm, saved->addr, saved->type, NULL, false);
+
+    if (i == -1)
+        return;
+    st->labels[i].branchType = saved->branchType;
+    st->labels[i].size = saved->size;
+    st->labels[i].isFunc = (saved->flags & ANALYSIS_FUNC) != 0;
+    st->labels[i].unnamed = (saved->flags & ANALYSIS_UNNAMED) != 0;
+    st->labels[i].splice = saved->splice;
+    if (st->labels[i].unnamed && st->labels[i].name != NULL)
+    {
+        free(st->labels[i].name);
+        st->labels[i].name = NULL;
+    }
+    if (retrace)
+        label_set_pending(st, i);
+    else
+        st->labels[i].processed = true;
+}
+
+// Gets the halfwords a saved code label's trace went over itself, or with
+// joined, those of the traced code it joined. Returns false if there are none.
+static bool analysis_trace_range(struct DisasmState *st, const struct AnalysisLabel *saved, bool joined, uint32_t *start, uint32_t *end)
+{
+    uint32_t offset = saved->addr - st->disasm->romLoadAddr;
+    uint32_t size;
+
+    if (saved->size == UNKNOWN_SIZE || offset >= st->disasm->inputFileBufferSize
+     || (saved->type != LABEL_ARM_CODE && saved->type != LABEL_THUMB_CODE))
+        return false;
+    size = min(saved->size, st->disasm->inputFileBufferSize - offset);
+    *start = offset / 2;
+    *end = (offset + size + 1) / 2;
+    if (saved->splice != NO_SPLICE && saved->splice - st->disasm->romLoadAddr < offset + size)
+    {
+        if (joined)
+            *start = (saved->splice - st->disasm->romLoadAddr) / 2;
+        else
+            *end = (saved->splice - st->disasm->romLoadAddr) / 2;
+    }
+    return *start < *end;
+}
+
+static int restored_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Sorts restored into the order the worklist pops labels in, see
+// worklist_before: by address, then index, or by index alone.
+static void restored_sort(struct DisasmState *st)
+{
+    uint64_t *keys = malloc(max(st->restoredCount, 1) * sizeof(*keys));
+
+    if (keys == NULL)
+        fatal_error("failed to alloc space for the analysis database. ");
+    for (int i = 0; i < st->restoredCount; i++)
+        keys[i] = (st->disasm->options.analyzeInAddressOrder ? (uint64_t)st->labels[st->restored[i]].addr << 32 : 0) | (uint32_t)st->restored[i];
+    qsort(keys, st->restoredCount, sizeof(*keys), restored_compare);
+    for (int i = 0; i < st->restoredCount; i++)
+        st->restored[i] = (int)(uint32_t)keys[i];
+    free(keys);
+}
+
+// Puts the saved coverage of the restored traces that come before label li in
+// the worklist in place, or of all that are left if li is -1, so that traces
+// of this run stop where they run into one, as they did before. A restored
+// trace that runs into where one of this run could be spliced onto is traced
+// again instead, as it might have stopped there. Returns true if there are any.
+static bool analysis_seed(struct DisasmState *st, int li)
+{
+    size_t words = coverage_words(st);
+    bool any = false;
+
+    for (; st->seededCount < st->restoredCount && (li == -1 || worklist_before(st, st->restored[st->seededCount], li)); st->seededCount++)
+    {
+        struct Label *label = &st->labels[st->restored[st->seededCount]];
+        int mode = (label->type == LABEL_THUMB_CODE);
+        uint32_t start = (label->addr - st->disasm->romLoadAddr) / 2;
+        uint32_t end;
+        bool joined = false;
+
+        if (label->analyzeCount != 0 || label->size == UNKNOWN_SIZE
+         || (label->type != LABEL_ARM_CODE && label->type != LABEL_THUMB_CODE)
+         || label->addr - st->disasm->romLoadAddr >= st->disasm->inputFileBufferSize)
+            continue;
+        // past a splice, the rest is another trace's
+        end = min(label->splice != NO_SPLICE ? (label->splice - st->disasm->romLoadAddr) / 2 : start + label->size / 2,
+                  st->disasm->inputFileBufferSize / 2);
+        for (uint32_t bit = start; bit < end && !joined; bit++)
+            joined = (st->codeStarts[mode][bit / 32] >> (bit % 32)) & 1;
+        if (joined)
+        {
+            label_set_pending(st, st->restored[st->seededCount]);
+            any = true;
+            continue;
+        }
+        for (uint32_t bit = start; bit < end; bit++)
+        {
+            uint32_t mask = 1u << (bit % 32);
+
+            st->codeStarts[mode][bit / 32] |= st->restoredCoverage[mode * words + bit / 32] & mask;
+            st->codeCovered[mode][bit / 32] |= st->restoredCoverage[(2 + mode) * words + bit / 32] & mask;
+            st->codeStops[mode][bit / 32] |= st->restoredCoverage[(4 + mode) * words + bit / 32] & mask;
+        }
+    }
+    return any;
+}
+
+// Releases what analysis_restore has mapped and allocated, which is kept in the
+// state for a corrupt database or a failed alloc on the way to be released too.
+static void analysis_restore_free(struct DisasmState *st)
+{
+    if (st->analysisFile != NULL)
+        unmap_file(st->analysisFile, st->analysisFileSize);
+    free(st->restoreState);
+    free(st->restoreStack);
+    free(st->restoreStale);
+    st->analysisFile = NULL;
+    st->restoreState = st->restoreStale = NULL;
+    st->restoreStack = NULL;
+}
+
+// Sets up the labels from the saved analysis of the module, if there is one,
+// and returns true if that leaves nothing to analyze. Every label so far
+// comes from the config.
+static bool analysis_restore(struct DisasmState *st)
+{
+    const struct AnalysisHeader *header;
+    const struct AnalysisConfig *config;
+    const struct AnalysisLabel *saved;
+    const uint32_t *edges;
+    int stackCount = 0;
+    uint32_t key[4];
+    int changed = 0, removed = 0, kept = 0, retraced = 0, tainted;
+
+    if (st->disasm->options.analysisDirectory == NULL)
+        return false;
+    label_order_flush(st);
+    st->config = malloc(max(st->labelsCount, 1) * sizeof(*st->config));
+    if (st->config == NULL)
+        fatal_error("failed to alloc space for the analysis database. ");
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        st->config[i].addr = st->labels[st->labelOrder[i]].addr;
+        st->config[i].type = st->labels[st->labelOrder[i]].type;
+    }
+    st->configCount = st->labelsCount;
+
+    key[0] = st->disasm->romLoadAddr;
+    key[1] = st->disasm->inputFileBufferSize;
+    key[2] = st->disasm->options.analyzeInAddressOrder;
+    key[3] = ANALYSIS_VERSION;
+    st->analysisKey = content_hash((const uint8_t *)key, sizeof(key)) ^ content_hash(st->disasm->inputFileBuffer, st->disasm->inputFileBufferSize);
+    snprintf(st->analysisPath, sizeof(st->analysisPath), "%s/%016llX.adb", st->disasm->options.analysisDirectory, (unsigned long long)st->analysisKey);
+    if (!map_file(st->analysisPath, &st->analysisFile, &st->analysisFileSize))
+    {
+        st->analysisFile = NULL;
+        return false;
+    }
+
+    header = (const struct AnalysisHeader *)st->analysisFile;
+    config = (const struct AnalysisConfig *)(header + 1);
+    saved = (const struct AnalysisLabel *)(config + (st->analysisFileSize >= sizeof(*header) ? header->configCount : 0));
+    edges = (const uint32_t *)(saved + (st->analysisFileSize >= sizeof(*header) ? header->labelCount : 0));
+    if (st->analysisFileSize < sizeof(*header) || header->magic != ANALYSIS_MAGIC || header->version != ANALYSIS_VERSION
+     || header->key != st->analysisKey
+     || st->analysisFileSize != sizeof(*header) + (size_t)header->configCount * sizeof(*config)
+                           + (size_t)header->labelCount * sizeof(*saved) + (size_t)header->edgeCount * sizeof(*edges)
+                           + 6 * coverage_words(st) * sizeof(uint32_t))
+    {
+        // left behind by something else, it'll be replaced
+        analysis_restore_free(st);
+        return false;
+    }
+    for (uint32_t i = 0; i < header->labelCount; i++)
+    {
+        if (saved[i].edgeFirst > header->edgeCount || saved[i].edgeCount > header->edgeCount - saved[i].edgeFirst
+         || saved[i].type > LABEL_ASCII || saved[i].branchType > BRANCH_TYPE_BL)
+            fatal_error("analysis database %s is corrupt", st->analysisPath);
+    }
+    for (uint32_t i = 0; i < header->configCount; i++)
+    {
+        if (config[i].type > LABEL_ASCII)
+            fatal_error("analysis database %s is corrupt", st->analysisPath);
+    }
+    for (uint32_t i = 0; i < header->edgeCount; i++)
+    {
+        if ((edges[i] & ~ANALYSIS_EDGE_LOOKUP) >= header->labelCount)
+            fatal_error("analysis database %s is corrupt", st->analysisPath);
+    }
+
+    st->restoreState = calloc(max(header->labelCount, 1), sizeof(*st->restoreState));
+    st->restoreStack = malloc(max(header->labelCount, 1) * sizeof(*st->restoreStack));
+    st->restored = malloc(max(header->labelCount, 1) * sizeof(*st->restored));
+    if (st->restoreState == NULL || st->restoreStack == NULL || st->restored == NULL)
+        fatal_error("failed to alloc space for the analysis database. ");
+
+    // Config labels that are new or have another type are traced from
+    // scratch. Naming a label analysis found is only a rename.
+    for (int i = 0; i < st->configCount; i++)
+    {
+        int c = analysis_search(config, header->configCount, sizeof(*config), st->config[i].addr);
+        int l = analysis_search(saved, header->labelCount, sizeof(*saved), st->config[i].addr);
+        bool same = (c != -1) ? config[c].type == st->config[i].type : (l != -1 && saved[l].type == st->config[i].type);
+
+        if (same && l != -1)
+        {
+            st->restoreState[l] |= SAVED_ROOT;
+        }
+        else
+        {
+            changed++;
+            if (l != -1)
+                st->restoreState[l] |= SAVED_CHANGED;
+        }
+    }
+    for (uint32_t i = 0; i < header->configCount; i++)
+    {
+        int l = analysis_search(saved, header->labelCount, sizeof(*saved), config[i].addr);
+
+        if (label_hash_find(st, config[i].addr) != -1)
+            continue;
+        removed++;
+        if (l != -1)
+            st->restoreState[l] |= SAVED_CHANGED;
+    }
+
+    if (changed == 0 && removed == 0)
+    {
+        for (uint32_t i = 0; i < header->labelCount; i++)
+        {
+            analysis_restore_label(st, &saved[i], false);
+            // the server lists them as xrefs
+            for (uint32_t e = saved[i].edgeFirst; st->resident && e < saved[i].edgeFirst + saved[i].edgeCount; e++)
+                edge_add(st, saved[i].addr, saved[edges[e] & ~ANALYSIS_EDGE_LOOKUP].addr, !(edges[e] & ANALYSIS_EDGE_LOOKUP), true);
+        }
+        if (st->disasm->options.printStatistics)
+            fprintf(stderr, "analysis database: only names changed, %u labels restored\n", header->labelCount);
+        free(st->restored);
+        st->restored = NULL;
+        free(st->config);
+        st->config = NULL;
+        analysis_restore_free(st);
+        return true;
+    }
+
+    // Keep what traces from the unchanged config labels added, but don't go
+    // on past a label a stale trace touched, since what its own trace found
+    // may be down to the stale one. That can leave more traces stale, so
+    // repeat until nothing more is tainted.
+    do
+    {
+        tainted = 0;
+        for (uint32_t i = 0; i < header->labelCount; i++)
+        {
+            st->restoreState[i] &= ~(SAVED_KEPT | SAVED_STALE);
+            if (st->restoreState[i] & SAVED_ROOT)
+            {
+                st->restoreState[i] |= SAVED_KEPT;
+                st->restoreStack[stackCount++] = i;
+            }
+        }
+        while (stackCount > 0)
+        {
+            int l = st->restoreStack[--stackCount];
+
+            if (st->restoreState[l] & SAVED_TAINTED)
+                continue;
+            for (uint32_t e = saved[l].edgeFirst; e < saved[l].edgeFirst + saved[l].edgeCount; e++)
+            {
+                uint32_t to = edges[e];
+
+                if ((to & ANALYSIS_EDGE_LOOKUP) || (st->restoreState[to] & (SAVED_KEPT | SAVED_CHANGED)))
+                    continue;
+                st->restoreState[to] |= SAVED_KEPT;
+                st->restoreStack[stackCount++] = to;
+            }
+        }
+        // whatever a dropped, retyped or tainted label's trace touched may
+        // carry its effects, so it's found again by tracing everything that
+        // touches it
+        for (uint32_t i = 0; i < header->labelCount; i++)
+        {
+            if ((st->restoreState[i] & (SAVED_KEPT | SAVED_TAINTED)) == SAVED_KEPT)
+                continue;
+            if (!(st->restoreState[i] & SAVED_KEPT))
+                st->restoreState[i] |= SAVED_STALE;
+            for (uint32_t e = saved[i].edgeFirst; e < saved[i].edgeFirst + saved[i].edgeCount; e++)
+            {
+                uint32_t to = edges[e] & ~ANALYSIS_EDGE_LOOKUP;
+
+                if (!(st->restoreState[to] & SAVED_TAINTED))
+                {
+                    st->restoreState[to] |= SAVED_TAINTED;
+                    if (st->restoreState[to] & SAVED_KEPT)
+                        tainted++;
+                }
+            }
+        }
+    } while (tainted != 0);
+    // A trace that stopped where a stale one had been is missing the rest,
+    // and its size, which runs on to the end of the traced code it joined,
+    // may have been down to one
+    st->restoreStale = calloc(st->disasm->inputFileBufferSize / 2 / 8 + 1, 1);
+    if (st->restoreStale == NULL)
+        fatal_error("failed to alloc space for the analysis database. ");
+    for (uint32_t i = 0; i < header->labelCount; i++)
+    {
+        uint32_t start, end;
+
+        if ((st->restoreState[i] & (SAVED_KEPT | SAVED_TAINTED)) == SAVED_KEPT
+         || !analysis_trace_range(st, &saved[i], false, &start, &end))
+            continue;
+        for (uint32_t h = start; h < end; h++)
+            st->restoreStale[h / 8] |= 1 << (h % 8);
+    }
+    for (uint32_t i = 0; i < header->labelCount; i++)
+    {
+        uint32_t start, end;
+        bool joined = false;
+
+        if ((st->restoreState[i] & (SAVED_KEPT | SAVED_TAINTED)) != SAVED_KEPT)
+            continue;
+        if (saved[i].splice != NO_SPLICE && analysis_trace_range(st, &saved[i], true, &start, &end))
+        {
+            for (uint32_t h = start; h < end && !joined; h++)
+                joined = (st->restoreStale[h / 8] >> (h % 8)) & 1;
+        }
+        if (joined)
+        {
+            st->restoreState[i] |= SAVED_RETRACE;
+            continue;
+        }
+        for (uint32_t e = saved[i].edgeFirst; e < saved[i].edgeFirst + saved[i].edgeCount; e++)
+        {
+            uint8_t to = st->restoreState[edges[e] & ~ANALYSIS_EDGE_LOOKUP];
+
+            if (!(to & SAVED_KEPT) || (to & SAVED_TAINTED))
+            {
+                st->restoreState[i] |= SAVED_RETRACE;
+                break;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < header->labelCount; i++)
+    {
+        bool retrace = (st->restoreState[i] & SAVED_RETRACE) != 0;
+        int index;
+
+        // tainted labels are left to the traces that add them, or the config
+        if (!(st->restoreState[i] & SAVED_KEPT) || (st->restoreState[i] & SAVED_TAINTED))
+            continue;
+        analysis_restore_label(st, &saved[i], retrace);
+        kept++;
+        if (retrace)
+        {
+            retraced++;
+            continue;
+        }
+        if ((index = label_hash_find(st, saved[i].addr)) != -1)
+            st->restored[st->restoredCount++] = index;
+        // what it touched is all kept, or it would be traced again
+        for (uint32_t e = saved[i].edgeFirst; e < saved[i].edgeFirst + saved[i].edgeCount; e++)
+            edge_add(st, saved[i].addr, saved[edges[e] & ~ANALYSIS_EDGE_LOOKUP].addr, !(edges[e] & ANALYSIS_EDGE_LOOKUP), true);
+    }
+    if (st->restoredCount != 0)
+        restored_sort(st);
+    st->restoredCoverage = malloc(6 * coverage_words(st) * sizeof(uint32_t));
+    if (st->restoredCoverage == NULL)
+        fatal_error("failed to alloc space for the analysis database. ");
+    memcpy(st->restoredCoverage, edges + header->edgeCount, 6 * coverage_words(st) * sizeof(uint32_t));
+    if (st->disasm->options.printStatistics)
+        fprintf(stderr, "analysis database: %d config labels new or retyped, %d removed, %d of %u labels restored, %d of them traced again\n",
+                changed, removed, kept, header->labelCount, retraced);
+    analysis_restore_free(st);
+    return false;
+}
+
+static int edge_compare(const void *a, const void *b)
+{
+    const struct AnalysisEdge *x = a, *y = b;
+
+    if (x->from != y->from)
+        return x->from < y->from ? -1 : 1;
+    if (x->to != y->to)
+        return x->to < y->to ? -1 : 1;
+    // additions first, so that they're the copy that's kept
+    return (int)y->added - (int)x->added;
+}
+
+// Saves the labels analysis ended up with for the next run.
+static void analysis_save(struct DisasmState *st)
+{
+    struct AnalysisHeader header = {0};
+    struct AnalysisLabel *labels;
+    uint32_t *edges;
+    int *position;
+    int e = 0;
+    uint8_t *data;
+    size_t size;
+
+    if (st->disasm->options.analysisDirectory == NULL)
+        return;
+    label_order_flush(st);
+    if (st->edgesCount != 0)
+        qsort(st->edges, st->edgesCount, sizeof(*st->edges), edge_compare);
+    size = (size_t)st->configCount * sizeof(*st->config) + (size_t)st->labelsCount * sizeof(*labels) + (size_t)st->edgesCount * sizeof(*edges)
+         + 6 * coverage_words(st) * sizeof(uint32_t);
+    data = malloc(max(size, 1));
+    position = malloc(max(st->labelsCount, 1) * sizeof(*position));
+    if (data == NULL || position == NULL)
+    {
+        free(data);
+        free(position);
+        fatal_error("failed to alloc space for the analysis database. ");
+    }
+    memcpy(data, st->config, (size_t)st->configCount * sizeof(*st->config));
+    labels = (struct AnalysisLabel *)(data + (size_t)st->configCount * sizeof(*st->config));
+    edges = (uint32_t *)(labels + st->labelsCount);
+    for (int i = 0; i < st->labelsCount; i++)
+        position[st->labelOrder[i]] = i;
+
+    header.edgeCount = 0;
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        const struct Label *label = &st->labels[st->labelOrder[i]];
+        struct AnalysisLabel *out = &labels[i];
+
+        memset(out, 0, sizeof(*out));
+        out->addr = label->addr;
+        out->size = label->size;
+        out->type = label->type;
+        out->branchType = label->branchType;
+        out->splice = label->splice;
+        out->flags = (label->isFunc ? ANALYSIS_FUNC : 0)
+                   | (label->isFromConfig ? ANALYSIS_CONFIG : 0)
+                   | (label->unnamed ? ANALYSIS_UNNAMED : 0);
+        // the edges are in the same address order as the labels
+        out->edgeFirst = header.edgeCount;
+        while (e < st->edgesCount && st->edges[e].from < label->addr)
+            e++;
+        for (; e < st->edgesCount && st->edges[e].from == label->addr; e++)
+        {
+            uint32_t edge;
+
+            // a restored label traced again has new edges instead
+            if (st->edges[e].restored && label->analyzeCount != 0)
+                continue;
+            edge = position[label_hash_find(st, st->edges[e].to)] | (st->edges[e].added ? 0 : ANALYSIS_EDGE_LOOKUP);
+            if (header.edgeCount > out->edgeFirst
+             && ((edges[header.edgeCount - 1] ^ edge) & ~ANALYSIS_EDGE_LOOKUP) == 0)
+                continue;
+            edges[header.edgeCount++] = edge;
+        }
+        out->edgeCount = header.edgeCount - out->edgeFirst;
+    }
+
+    header.magic = ANALYSIS_MAGIC;
+    header.version = ANALYSIS_VERSION;
+    header.key = st->analysisKey;
+    header.configCount = st->configCount;
+    header.labelCount = st->labelsCount;
+    size -= (size_t)(st->edgesCount - header.edgeCount) * sizeof(*edges);
+    for (int mode = 0; mode < 2; mode++)
+    {
+        memcpy(edges + header.edgeCount + mode * coverage_words(st), st->codeStarts[mode], coverage_words(st) * sizeof(uint32_t));
+        memcpy(edges + header.edgeCount + (2 + mode) * coverage_words(st), st->codeCovered[mode], coverage_words(st) * sizeof(uint32_t));
+        memcpy(edges + header.edgeCount + (4 + mode) * coverage_words(st), st->codeStops[mode], coverage_words(st) * sizeof(uint32_t));
+    }
+    file_replace(st->disasm->options.analysisDirectory, st->analysisPath, &header, sizeof(header), data, size);
+    free(data);
+    free(position);
+    free(st->config);
+    st->config = NULL;
+    free(st->restored);
+    st->restored = NULL;
+    st->restoredCount = 0;
+    st->seededCount = 0;
+    free(st->restoredCoverage);
+    st->restoredCoverage = NULL;
+}
+
+static void analyze(struct DisasmState *st)
+{
+    double startTime = wall_time();
+
+    window_init(st);
+    while (1)
+    {
+        int li;
+        uint32_t addr;
+        enum LabelType type;
+
+        if ((li = worklist_pop(st)) == -1)
+        {
+            if (analysis_seed(st, -1))
+                continue;
+            break;
+        }
+        if (st->labels[li].processed)
+            continue;
+        addr = st->labels[li].addr;
+        type = st->labels[li].type;
+        if (addr < st->disasm->romLoadAddr || addr >= st->disasm->romLoadAddr + st->disasm->inputFileBufferSize)
+        {
+            st->labels[li].processed = true;
+            continue;
+        }
+
+        if (analysis_seed(st, li))
+        {
+            // those traced again come first
+            label_set_pending(st, li);
+            continue;
+        }
+        st->tracing = li;
+        if (type == LABEL_ARM_CODE)
+            analyze_arm(st, li);
+        else if (type == LABEL_THUMB_CODE)
+            analyze_thumb(st, li);
+        st->tracing = -1;
+        st->labels[li].processed = true;
+    }
+
+    window_free(st);
+
+    if (st->disasm->options.printStatistics)
+    {
+        fprintf(stderr, "analysis: %.3f s\n", wall_time() - startTime);
+        int analyses = 0, reanalyzed = 0;
+
+        for (int i = 0; i < st->labelsCount; i++)
+        {
+            analyses += st->labels[i].analyzeCount;
+            if (st->labels[i].analyzeCount > 1)
+            {
+                reanalyzed++;
+                fprintf(stderr, "label 0x%08X re-analyzed %d times\n", st->labels[i].addr, st->labels[i].analyzeCount - 1);
+            }
+        }
+        fprintf(stderr, "analysis: %d labels, %d code label analyses, %d labels re-analyzed\n", st->labelsCount, analyses, reanalyzed);
+        fprintf(stderr, "decoder: %llu bytes decoded, %llu bytes used (%llu bytes with whole-window decoding)\n",
+                (unsigned long long)st->bytesDecoded, (unsigned long long)st->bytesUsed, (unsigned long long)st->bytesWindowed);
+        fprintf(stderr, "decoder: %d traces spliced onto already traced code\n", st->splicedTraces);
+    }
+}
+
+// Disassembly Output
+
+static uint32_t print_align(struct DisasmState *st, uint32_t addr, enum LabelType labelType)
+{
+    if (labelType == LABEL_THUMB_CODE)
+    {
+        if ((addr & 3) == 2)
+        {
+            uint16_t next_short = hword_at(st, addr);
+            if (next_short == 0)
+            {
+                out_str(st, "\t.align 2, 0\n");
+                addr += 2;
+            }
+            else if (next_short == 0x46C0)
+            {
+                out_str(st, "\tnop\n");
+                addr += 2;
+            }
+        }
+    }
+    return addr;
+}
+
+// Data Blobs
+
+// With -B, data of at least blobThreshold bytes is written to binary files
+// next to the output and pulled in with .incbin, rather than printed as .byte
+// lines for the assembler to parse again. The files are named after a hash of
+// their contents, so data that repeats is only written once.
+
+struct Blob
+{
+    uint64_t hash;
+    uint32_t addr;  // where the data was first seen
+    uint32_t size;
+};
+
+// FNV-1a
+uint64_t content_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+// Blob files are named after the output file without its extension, or
+// "ndsdisasm" for stdout, followed by the hash. Split output keeps them in
+// its directory.
+static void blobs_init(struct DisasmState *st)
+{
+    const char *name = (st->disasm->options.outputFileName != NULL) ? st->disasm->options.outputFileName : "ndsdisasm";
+    char splitName[0x1000];
+
+    if (st->disasm->options.splitDirectory != NULL)
+    {
+        if ((size_t)snprintf(splitName, sizeof(splitName), "%s/blob", st->disasm->options.splitDirectory) >= sizeof(splitName))
+            fatal_error("split directory name too long: %s", st->disasm->options.splitDirectory);
+        name = splitName;
+    }
+    const char *base = strrchr(name, '/');
+    const char *ext = strrchr((base != NULL) ? base : name, '.');
+    size_t length = (ext != NULL) ? (size_t)(ext - name) : strlen(name);
+
+    if (st->disasm->options.blobThreshold == 0)
+        return;
+    st->blobPrefix = malloc(length + 1);
+    if (st->blobPrefix == NULL)
+        fatal_error("failed to alloc space for blobs. ");
+    memcpy(st->blobPrefix, name, length);
+    st->blobPrefix[length] = 0;
+}
+
+static void blobs_free(struct DisasmState *st)
+{
+    if (st->blobPrefix != NULL && st->disasm->options.printStatistics)
+        fprintf(stderr, "blobs: %d files, %llu bytes\n", st->blobsCount, (unsigned long long)st->blobBytes);
+    free(st->blobs);
+    free(st->blobPrefix);
+    st->blobs = NULL;
+    st->blobPrefix = NULL;
+    st->blobsMask = 0;
+    st->blobsCount = 0;
+    st->blobBytes = 0;
+}
+
+static void blob_insert(struct DisasmState *st, const struct Blob *blob)
+{
+    uint32_t slot = blob->hash & st->blobsMask;
+
+    while (st->blobs[slot].size != 0)
+        slot = (slot + 1) & st->blobsMask;
+    st->blobs[slot] = *blob;
+}
+
+// Returns the blob with the given hash, adding it if there is none, or NULL
+// if there isn't the memory to add it. Runs with blobsLock held, so it
+// leaves failing to the caller.
+static struct Blob *blob_lookup(struct DisasmState *st, uint64_t hash, uint32_t addr, uint32_t size, bool *added)
+{
+    uint32_t slot;
+
+    if (2 * (st->blobsCount + 1) > (int)(st->blobsMask + 1))
+    {
+        struct Blob *old = st->blobs;
+        uint32_t oldSize = old ? st->blobsMask + 1 : 0;
+        struct Blob *blobs = calloc(oldSize ? 2 * oldSize : 0x100, sizeof(*blobs));
+
+        if (blobs == NULL)
+            return NULL;
+        st->blobs = blobs;
+        st->blobsMask = oldSize ? 2 * oldSize - 1 : 0xFF;
+        for (uint32_t i = 0; i < oldSize; i++)
+            if (old[i].size != 0)
+                blob_insert(st, &old[i]);
+        free(old);
+    }
+    for (slot = hash & st->blobsMask; st->blobs[slot].size != 0; slot = (slot + 1) & st->blobsMask)
+    {
+        if (st->blobs[slot].hash == hash)
+        {
+            *added = false;
+            return &st->blobs[slot];
+        }
+    }
+    st->blobs[slot] = (struct Blob){hash, addr, size};
+    st->blobsCount++;
+    *added = true;
+    return &st->blobs[slot];
+}
+
+// Prints the data as an .incbin of its blob, writing the file the first time
+// the data is seen. Returns false if it has to be printed as text instead,
+// because another blob has the same hash.
+static bool print_blob(struct DisasmState *st, uint32_t addr, uint32_t size)
+{
+    const uint8_t *data = st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr);
+    uint64_t hash = content_hash(data, size);
+    char fileName[0x1000];
+    const struct Blob *blob;
+    bool added, same;
+
+    if ((size_t)snprintf(fileName, sizeof(fileName), "%s_%016llX.bin", st->blobPrefix, (unsigned long long)hash) >= sizeof(fileName))
+        fatal_error("blob file name too long: %s", st->blobPrefix);
+    // the workers print blobs too
+    pthread_mutex_lock(&st->blobsLock);
+    blob = blob_lookup(st, hash, addr, size, &added);
+    if (blob == NULL)
+    {
+        pthread_mutex_unlock(&st->blobsLock);
+        fatal_error("failed to alloc space for blobs. ");
+    }
+    same = (blob->size == size && memcmp(st->disasm->inputFileBuffer + (blob->addr - st->disasm->romLoadAddr), data, size) == 0);
+    if (added)
+    {
+        FILE *file = fopen(fileName, "wb");
+        bool written = file != NULL && fwrite(data, 1, size, file) == size;
+
+        if (file != NULL && fclose(file) != 0)
+            written = false;
+        if (!written)
+        {
+            pthread_mutex_unlock(&st->blobsLock);
+            fatal_error("failed to write blob file %s", fileName);
+        }
+        st->blobBytes += size;
+    }
+    pthread_mutex_unlock(&st->blobsLock);
+    if (!same)
+        return false;
+    out_printf(st, "\t.incbin \"%s\", 0, 0x%X\n", fileName, size);
+    return true;
+}
+
+// Split Output
+
+// With -S, the disassembly is split into one file per function in the given
+// directory, or per -Sr range of addresses, starting at a function each. An
+// index lists the files in order with a hash of their text, which covers
+// both the bytes they assemble from and the names they refer to. Files whose
+// hash is the same as in the previous run's index aren't written again, so
+// that their timestamps only change along with their contents.
+
+struct SplitFile
+{
+    char *name;
+    uint64_t hash;
+    uint32_t start;
+};
+
+static int split_file_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct SplitFile *)a)->name, ((const struct SplitFile *)b)->name);
+}
+
+static char *split_path(struct DisasmState *st, const char *name, const char *ext)
+{
+    size_t size = strlen(st->disasm->options.splitDirectory) + strlen(name) + strlen(ext) + 2;
+    char *path = malloc(size);
+
+    if (path == NULL)
+        fatal_error("failed to alloc space for split output. ");
+    snprintf(path, size, "%s/%s%s", st->disasm->options.splitDirectory, name, ext);
+    return path;
+}
+
+static void split_load_index(struct DisasmState *st)
+{
+    char *path = split_path(st, "index", ".txt");
+    FILE *file = fopen(path, "r");
+    char line[0x200];
+    int bufferCount = 0;
+
+    free(path);
+    if (file == NULL)
+        return;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        struct SplitFile entry;
+        unsigned long long hash;
+        char name[256];
+
+        if (sscanf(line, "%255s %llx %x", name, &hash, &entry.start) != 3)
+            continue;
+        if (st->splitOldCount == bufferCount)
+        {
+            bufferCount = bufferCount ? 2 * bufferCount : 0x100;
+            st->splitOld = realloc(st->splitOld, bufferCount * sizeof(*st->splitOld));
+            if (st->splitOld == NULL)
+                fatal_error("failed to alloc space for split output. ");
+        }
+        entry.name = strdup(name);
+        entry.hash = hash;
+        st->splitOld[st->splitOldCount++] = entry;
+    }
+    fclose(file);
+    qsort(st->splitOld, st->splitOldCount, sizeof(*st->splitOld), split_file_compare);
+}
+
+// Fails on a file that couldn't be written, after freeing its path.
+static noreturn void split_write_error(const char *what, char *path)
+{
+    char message[0x400];
+
+    snprintf(message, sizeof(message), "failed to write split output %s %s", what, path);
+    free(path);
+    fatal_error("%s", message);
+}
+
+// Writes out the file printed so far, unless it hasn't changed.
+static void split_end(struct DisasmState *st)
+{
+    struct SplitFile entry = {st->splitName, 0, st->splitStart};
+    const struct SplitFile *old;
+    char *path;
+    FILE *file;
+
+    if (st->splitText.size == 0)
+        return;
+    entry.hash = content_hash((const uint8_t *)st->splitText.data, st->splitText.size);
+    path = split_path(st, st->splitName, ".s");
+    old = bsearch(&entry, st->splitOld, st->splitOldCount, sizeof(*st->splitOld), split_file_compare);
+    if (old == NULL || old->hash != entry.hash || (file = fopen(path, "rb")) == NULL)
+    {
+        bool written;
+
+        file = fopen(path, "wb");
+        if (file == NULL)
+            split_write_error("file", path);
+        written = fwrite(st->splitText.data, 1, st->splitText.size, file) == st->splitText.size;
+        if (fclose(file) != 0 || !written)
+        {
+            // the old index may still have its hash, so it can't be left
+            // there to pass for up to date
+            remove(path);
+            split_write_error("file", path);
+        }
+        st->splitWritten++;
+    }
+    else
+        fclose(file);
+    free(path);
+
+    if (st->splitFilesCount == st->splitFilesBufferCount)
+    {
+        st->splitFilesBufferCount = st->splitFilesBufferCount ? 2 * st->splitFilesBufferCount : 0x100;
+        st->splitFiles = realloc(st->splitFiles, st->splitFilesBufferCount * sizeof(*st->splitFiles));
+        if (st->splitFiles == NULL)
+            fatal_error("failed to alloc space for split output. ");
+    }
+    entry.name = strdup(st->splitName);
+    if (entry.name == NULL)
+        fatal_error("failed to alloc space for split output. ");
+    st->splitFiles[st->splitFilesCount++] = entry;
+    st->splitText.size = 0;
+}
+
+// Called at every function start: begins a new file there, unless it is in
+// the same -Sr range as the current one.
+static void split_begin(struct DisasmState *st, const char *name, uint32_t addr)
+{
+    if (st->splitText.size != 0 && st->disasm->options.splitRange != 0 && addr / st->disasm->options.splitRange == st->splitStart / st->disasm->options.splitRange)
+        return;
+    split_end(st);
+    snprintf(st->splitName, sizeof(st->splitName), "%s", name);
+    st->splitStart = addr;
+}
+
+static void split_open(struct DisasmState *st)
+{
+#ifdef _WIN32
+    if (_mkdir(st->disasm->options.splitDirectory) != 0 && errno != EEXIST)
+#else
+    if (mkdir(st->disasm->options.splitDirectory, 0777) != 0 && errno != EEXIST)
+#endif
+        fatal_error("failed to create split output directory %s: %s", st->disasm->options.splitDirectory, strerror(errno));
+    split_load_index(st);
+    // what comes before the first function is named after where it starts
+    snprintf(st->splitName, sizeof(st->splitName), "_%08X", st->disasm->romLoadAddr);
+    st->splitStart = st->disasm->romLoadAddr;
+    sOut = &st->splitText;
+}
+
+static void split_free(struct DisasmState *st)
+{
+    for (int i = 0; i < st->splitOldCount; i++)
+        free(st->splitOld[i].name);
+    for (int i = 0; i < st->splitFilesCount; i++)
+        free(st->splitFiles[i].name);
+    free(st->splitFiles);
+    free(st->splitOld);
+    free(st->splitText.data);
+    st->splitFiles = st->splitOld = NULL;
+    st->splitFilesCount = st->splitFilesBufferCount = st->splitOldCount = 0;
+    st->splitText = (struct OutBuffer){0};
+}
+
+// Writes the last file and the index, and removes the files of the previous
+// run that are gone.
+static void split_close(struct DisasmState *st)
+{
+    char *path;
+    FILE *file;
+
+    split_end(st);
+    sOut = NULL;
+    path = split_path(st, "index", ".txt");
+    if ((file = fopen(path, "w")) == NULL)
+        split_write_error("index", path);
+    for (int i = 0; i < st->splitFilesCount; i++)
+        fprintf(file, "%s %016llX 0x%08X\n", st->splitFiles[i].name, (unsigned long long)st->splitFiles[i].hash, st->splitFiles[i].start);
+    if (fclose(file) != 0)
+    {
+        remove(path);
+        split_write_error("index", path);
+    }
+    free(path);
+
+    qsort(st->splitFiles, st->splitFilesCount, sizeof(*st->splitFiles), split_file_compare);
+    for (int i = 0; i < st->splitOldCount; i++)
+    {
+        if (bsearch(&st->splitOld[i], st->splitFiles, st->splitFilesCount, sizeof(*st->splitFiles), split_file_compare) == NULL)
+        {
+            path = split_path(st, st->splitOld[i].name, ".s");
+            if (remove(path) == 0)
+                st->splitRemoved++;
+            free(path);
+        }
+    }
+    if (st->disasm->options.printStatistics)
+        fprintf(stderr, "split: %d files, %d written, %d removed\n", st->splitFilesCount, st->splitWritten, st->splitRemoved);
+    split_free(st);
+}
+
+// Writes the uppercase hex digits of count bytes, two per byte.
+static void hex_digits(char *out, const uint8_t *bytes, size_t count)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+#ifdef __SSE2__
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i letters = _mm_set1_epi8('A' - '0' - 10);
+
+    for (; count >= 16; count -= 16, bytes += 16, out += 32)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)bytes);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble);
+        __m128i lo = _mm_and_si128(b, nibble);
+
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letters));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letters));
+        _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; count > 0; count--, bytes++)
+    {
+        *out++ = hexDigits[*bytes >> 4];
+        *out++ = hexDigits[*bytes & 15];
+    }
+}
+
+// Prints the bytes as .byte lines, gOptionDataColumnWidth bytes to a line.
+// Lines break at multiples of the width, so a gap that starts in the middle of
+// a row gets a shorter first line.
+static void print_gap(struct DisasmState *st, uint32_t addr, uint32_t nextaddr)
+{
+    if (addr == nextaddr)
+        return;
+
+    assert(addr < nextaddr);
+    assert(nextaddr - st->disasm->romLoadAddr <= st->disasm->inputFileBufferSize);
+
+    if (st->blobPrefix != NULL && nextaddr - addr >= st->disasm->options.blobThreshold && print_blob(st, addr, nextaddr - addr))
+        return;
+    while (addr < nextaddr)
+    {
+        uint32_t rowEnd = min(addr - addr % gOptionDataColumnWidth + gOptionDataColumnWidth, nextaddr);
+
+        line_str(st, "\t.byte");
+        // the row goes out 16 bytes at a time: " 0xHH," for each
+        while (addr < rowEnd)
+        {
+            char digits[32];
+            char text[16 * 6];
+            uint32_t count = min(rowEnd - addr, 16);
+
+            hex_digits(digits, st->disasm->inputFileBuffer + (addr - st->disasm->romLoadAddr), count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                memcpy(text + 6 * i, " 0x", 3);
+                text[6 * i + 3] = digits[2 * i];
+                text[6 * i + 4] = digits[2 * i + 1];
+                text[6 * i + 5] = ',';
+            }
+            addr += count;
+            // no comma after the last byte of the row
+            line_write(st, text, 6 * count - (addr == rowEnd));
+        }
+        line_end(st, -1);
+    }
+}
+
+// Checks print_gap against printing every byte with printf, which is what it
+// replaces, for gaps starting at every offset into a row, and compares their
+// throughput over the whole module.
+static void verify_hex_dump(struct DisasmState *st)
+{
+    struct OutBuffer fast = {0}, slow = {0};
+    uint32_t end = st->disasm->romLoadAddr + st->disasm->inputFileBufferSize;
+    double fastTime = 0, slowTime = 0;
+    int mismatches = 0;
+
+    for (int start = 0; start < gOptionDataColumnWidth && (uint32_t)start < st->disasm->inputFileBufferSize; start++)
+    {
+        double time;
+
+        fast.size = slow.size = 0;
+        time = wall_time();
+        sOut = &fast;
+        print_gap(st, st->disasm->romLoadAddr + start, end);
+        fastTime += wall_time() - time;
+
+        time = wall_time();
+        sOut = &slow;
+        for (uint32_t addr = st->disasm->romLoadAddr + start; addr < end; addr++)
+        {
+            if (addr == st->disasm->romLoadAddr + start || addr % gOptionDataColumnWidth == 0)
+                out_str(st, "\t.byte");
+            if (addr % gOptionDataColumnWidth == (unsigned int)(gOptionDataColumnWidth - 1)
+             || addr == end - 1)
+                out_printf(st, " 0x%02X\n", byte_at(st, addr));
+            else
+                out_printf(st, " 0x%02X,", byte_at(st, addr));
+        }
+        slowTime += wall_time() - time;
+        sOut = NULL;
+
+        if (fast.size != slow.size || memcmp(fast.data, slow.data, fast.size) != 0)
+        {
+            if (mismatches++ < 20)
+                fprintf(stderr, "verify: hex dump from 0x%08X differs from printf\n", st->disasm->romLoadAddr + start);
+        }
+    }
+    fprintf(stderr, "verify: hex dump: %d mismatches, %.1f MB/s (printf %.1f MB/s)\n", mismatches,
+            gOptionDataColumnWidth * (double)st->disasm->inputFileBufferSize / 1e6 / max(fastTime, 1e-9),
+            gOptionDataColumnWidth * (double)st->disasm->inputFileBufferSize / 1e6 / max(slowTime, 1e-9));
+    free(fast.data);
+    free(slow.data);
+}
+
+// The name another module gives value, if value is outside this one and the
+// -x symbol index knows it. A Thumb function pointer has the low bit set. If
+// more than one module that could be loaded has a symbol there, returns NULL
+// and points *ambiguous at a comment listing them.
+static const char *extern_name(struct DisasmState *st, uint32_t value, const char **ambiguous)
+{
+    const char *name;
+    char kind;
+
+    *ambiguous = NULL;
+    if (st->disasm->options.symbolIndexFile == NULL || value - st->disasm->romLoadAddr < st->disasm->inputFileBufferSize)
+        return NULL;
+    if (value & 1)
+    {
+        name = symbols_find(st->disasm, value & ~1, &kind, ambiguous);
+        if (name != NULL && kind == 't')
+            return name;
+    }
+    return symbols_find(st->disasm, value, &kind, ambiguous);
+}
+
+// Appends the name another module gives value, or prefix and value.
+static void line_value(struct DisasmState *st, uint32_t value, const char *prefix)
+{
+    const char *ambiguous;
+    const char *name = extern_name(st, value, &ambiguous);
+
+    if (name != NULL)
+    {
+        line_str(st, name);
+    }
+    else
+    {
+        line_str(st, prefix);
+        line_hex(st, value, 8);
+    }
+    if (ambiguous != NULL)
+    {
+        line_str(st, " @ ");
+        line_str(st, ambiguous);
+    }
+}
+
+// Appends the label's name, or the one made up from its address.
+static void line_label(struct DisasmState *st, const struct Label *label, uint32_t addr)
+{
+    if (label->name != NULL)
+        line_str(st, label->name);
+    else
+        line_value(st, addr, (label->branchType == BRANCH_TYPE_BL) ? st->disasm->functionPrefix : "_");
+}
+
+// Appends "add rX, pc, #imm" the way the pc-relative address forms are printed.
+static void line_add_pc(struct DisasmState *st, int reg, int32_t imm)
+{
+    line_str(st, "\tadd ");
+    line_reg(st, reg);
+    line_str(st, ", pc, #0x");
+    line_hex(st, imm, 0);
+}
+
+static void print_insn(struct DisasmState *st, const struct DecodedInsn *insn, uint32_t addr, int mode, int caseNum)
+{
+    if (gOptionShowAddrComments)
+    {
+        line_str(st, "\t/*0x");
+        line_hex(st, addr, 8);
+        line_str(st, "*/ ");
+        line_mnemonic(st, insn);
+        line_char(st, ' ');
+        line_operands(st, insn);
+    }
+    else if (is_branch(insn) && insn->ops[0].type != ARM_OP_REG)
+    {
+        uint32_t target = get_branch_target(insn);
+        const struct Label *label_p = lookup_label(st, target);
+
+        line_char(st, '\t');
+        line_mnemonic(st, insn);
+        line_char(st, ' ');
+        if (label_p != NULL)
+            line_label(st, label_p, target);
+        else
+            line_value(st, target, st->disasm->functionPrefix);
+    }
+    else if (is_pool_load(insn))
+    {
+        uint32_t word = get_pool_load(insn, addr, mode);
+        uint32_t value = word_at(st, word);
+        const struct Label *label_p;
+
+        line_char(st, '\t');
+        line_mnemonic(st, insn);
+        line_char(st, ' ');
+        line_reg(st, insn->ops[0].reg);
+        line_str(st, ", _");
+        line_hex(st, word, 8);
+        line_str(st, " @ =");
+        if (value & 3 && (value & st->disasm->romLoadAddr & 0x0F000000) == (st->disasm->romLoadAddr & 0x0F000000) // possibly thumb function
+         && (label_p = lookup_label(st, value & ~1)) != NULL
+         && label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
+        {
+            line_label(st, label_p, value & ~1);
+        }
+        else if ((label_p = lookup_label(st, value)) != NULL && label_p->type != LABEL_THUMB_CODE)
+        {
+            line_label(st, label_p, value);
+        }
+        else
+        {
+            line_value(st, value, "0x");
+        }
+    }
+    // fix "add rX, sp, rX"
+    else if (insn->id == ARM_INS_ADD
+          && insn->ops[0].type == ARM_OP_REG
+          && insn->ops[1].type == ARM_OP_REG
+          && insn->ops[1].reg == ARM_REG_SP
+          && insn->ops[2].type == ARM_OP_REG)
+    {
+        line_char(st, '\t');
+        line_mnemonic(st, insn);
+        line_char(st, ' ');
+        line_reg(st, insn->ops[0].reg);
+        line_str(st, ", ");
+        line_reg(st, insn->ops[1].reg);
+    }
+    // fix thumb adr
+    else if (insn->id == ARM_INS_ADR && mode == LABEL_THUMB_CODE)
+    {
+        uint32_t word = (insn->ops[1].imm + addr + 4) & ~3;
+        const struct Label *label_p = lookup_label(st, word);
+
+        line_add_pc(st, insn->ops[0].reg, insn->ops[1].imm);
+        if (label_p != NULL && label_p->type != LABEL_THUMB_CODE)
+        {
+            line_str(st, " @ =");
+            line_label(st, label_p, word);
+        }
+    }
+    // arm adr
+    else if (mode == LABEL_ARM_CODE
+          && insn->id == ARM_INS_ADD
+          && insn->ops[0].type == ARM_OP_REG
+          && insn->ops[1].type == ARM_OP_REG
+          && insn->ops[1].reg == ARM_REG_PC
+          && insn->ops[2].type == ARM_OP_IMM)
+    {
+        uint32_t word = insn->ops[2].imm + addr + 8;
+        const struct Label *label_p;
+
+        line_add_pc(st, insn->ops[0].reg, insn->ops[2].imm);
+        line_str(st, " @ =");
+        if (word & 3 && word & st->disasm->romLoadAddr // possibly thumb function
+         && (label_p = lookup_label(st, word & ~1)) != NULL
+         && label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
+        {
+            line_label(st, label_p, word & ~1);
+        }
+        else if ((label_p = lookup_label(st, word)) != NULL && label_p->type != LABEL_THUMB_CODE)
+        {
+            line_label(st, label_p, word);
+        }
+        else
+        {
+            line_str(st, "0x");
+            line_hex(st, word, 8);
+        }
+    }
+    else
+    {
+        line_char(st, '\t');
+        line_mnemonic(st, insn);
+        line_char(st, ' ');
+        line_operands(st, insn);
+    }
+    line_end(st, caseNum);
+}
+
+// Fixes up the size of label i so that it ends where the next label starts,
+// or at the end of the module if it is data.
+static void label_fix_size(struct DisasmState *st, int i)
+{
+    // TODO: compute actual size during analysis phase
+    if (st->labels[i].type == LABEL_POOL)
+        st->labels[i].size = 4;
+    if (i + 1 < st->labelsCount)
+    {
+        if (st->labels[i].size == UNKNOWN_SIZE
+         || st->labels[i].addr + st->labels[i].size > st->labels[i + 1].addr)
+            st->labels[i].size = st->labels[i + 1].addr - st->labels[i].addr;
+        if (st->labels[i].addr + st->labels[i].size >= st->disasm->romLoadAddr + st->disasm->inputFileBufferSize
+         && st->labels[i].type == LABEL_DATA)
+            st->labels[i].size = st->disasm->romLoadAddr + st->disasm->inputFileBufferSize - st->labels[i].addr;
+    }
+}
+
+// Printing stops at a label other than data that runs into the end of the module.
+static bool label_runs_past_end(struct DisasmState *st, int i)
+{
+    return i + 1 < st->labelsCount
+        && st->labels[i].addr + st->labels[i].size >= st->disasm->romLoadAddr + st->disasm->inputFileBufferSize
+        && st->labels[i].type != LABEL_DATA;
+}
+
+// Where printing is at, between two labels.
+struct PrintState
+{
+    int i;
+    uint32_t addr;
+    uint32_t lastAddr;
+    uint32_t endaddr;
+    enum LabelType lastLabel;
+    char lastName[256];
+    bool done;      // reached the end of the module
+    bool aborted;   // stopped at an error, without the closing comment
+};
+
+// Prints a pool word holding value as name, as the name another module gives
+// it, or as prefix and value.
+static void print_pool_word(struct DisasmState *st, uint32_t addr, uint32_t value, const char *name, const char *prefix)
+{
+    const char *ambiguous = NULL;
+
+    if (name == NULL)
+        name = extern_name(st, value, &ambiguous);
+    if (name != NULL)
+        out_printf(st, "_%08X: .4byte %s\n", addr, name);
+    else if (ambiguous != NULL)
+        out_printf(st, "_%08X: .4byte %s%08X @ %s\n", addr, prefix, value, ambiguous);
+    else
+        out_printf(st, "_%08X: .4byte %s%08X\n", addr, prefix, value);
+}
+
+static void print_state_init(struct DisasmState *st, struct PrintState *ps, int i)
+{
+    ps->i = i;
+    // a module with no labels is all gap
+    ps->addr = ps->lastAddr = (i < st->labelsCount) ? st->labels[i].addr : st->disasm->romLoadAddr + st->disasm->inputFileBufferSize;
+    ps->endaddr = -1u;
+    ps->lastLabel = LABEL_DATA;
+    ps->lastName[0] = 0;
+    ps->done = ps->aborted = false;
+}
+
+// Prints from label ps->i on, up to label stop or the end of the module, and
+// leaves ps where it stopped.
+static void print_labels(struct DisasmState *st, struct PrintState *ps, int stop)
+{
+    const uint32_t romEnd = st->disasm->romLoadAddr + st->disasm->inputFileBufferSize;
+    int i = ps->i;
+    int li;
+    char *last_name = ps->lastName;
+    enum LabelType last_label = ps->lastLabel;
+    uint32_t addr = ps->addr, lastAddr = ps->lastAddr, endaddr = ps->endaddr;
+
+    while (addr < romEnd)
+    {
+        if (i >= stop || sWorkerMissed)
+            goto out;
+        li = i;
+        uint32_t nextAddr;
+        if (st->labels[i].addr < st->disasm->romLoadAddr)
+        {
+            goto next;
+        }
+        if (st->labels[i].addr >= romEnd)
+            break;
+        if (label_runs_past_end(st, i))
+            break;
+
+        switch (st->labels[i].type)
+        {
+        case LABEL_ARM_CODE:
+        case LABEL_THUMB_CODE:
+            {
+                uint32_t end = addr + st->labels[i].size;
+                int mode = (st->labels[i].type == LABEL_ARM_CODE) ? CS_MODE_ARM : CS_MODE_THUMB;
+
+                // This is a function. Use the 'sub_XXXXXXXX' label
+                if (st->labels[i].branchType == BRANCH_TYPE_BL)
+                {
+                    unsigned int unalignedMask = (mode == CS_MODE_ARM) ? 3 : 1;
+
+                    if (addr & unalignedMask)
+                    {
+                        err_printf("error: function at 0x%08X is not aligned\n", addr);
+                        ps->aborted = true;
+                        goto out;
+                    }
+                    last_label = st->labels[i].type;
+                    if (st->labels[i].name != NULL)
+                        strcpy(last_name, st->labels[i].name);
+                    else
+                        sprintf(last_name, "%s%08X", st->disasm->functionPrefix, addr);
+                    if (st->disasm->options.splitDirectory != NULL)
+                        split_begin(st, last_name, addr);
+                    out_printf(st, "\n\t%s %s\n",
+                               (last_label == LABEL_ARM_CODE) ? "arm_func_start" : (addr & 2 ? "non_word_aligned_thumb_func_start" : "thumb_func_start"),
+                               last_name);
+                    out_printf(st, "%s: @ 0x%08X\n", last_name, addr);
+                }
+                // Just a normal code label. Use the '_XXXXXXXX' label
+                else
+                {
+                    if (st->labels[i].name != NULL)
+                        out_printf(st, "%s:\n", st->labels[i].name);
+                    else
+                        out_printf(st, "_%08X:\n", addr);
+                }
+
+                assert(st->labels[i].size != UNKNOWN_SIZE);
+                while (addr < end)
+                {
+                    const struct DecodedInsn *insn = decode_insn(st, addr, st->labels[i].type, end - addr);
+
+                    if (insn == NULL)
+                        break;
+                    if (!is_valid_insn(insn)) {
+                        if (st->labels[i].type == LABEL_THUMB_CODE)
+                        {
+                            uint32_t next = addr + 2;
+
+                            // retry from the second half of the instruction
+                            if (insn->size != 2)
+                                next = thumb_resync(st, next, end);
+                            for (; addr < next; addr += 2)
+                                out_printf(st, "\t.hword 0x%04X\n", hword_at(st, addr));
+                        }
+                        else
+                        {
+                            out_printf(st, "\t.word 0x%08X\n", word_at(st, addr));
+                            addr += 4;
+                        }
+                        continue;
+                    }
+                    print_insn(st, insn, addr, st->labels[i].type, -1);
+                    addr += insn->size;
+                }
+
+                // align pool if it comes next
+                if (i + 1 < st->labelsCount && st->labels[i + 1].type == LABEL_POOL)
+                {
+                    const uint8_t zeros[3] = {0};
+                    int diff = st->labels[i + 1].addr - addr;
+                    if (diff == 0
+                     || (diff > 0 && diff < 4 && memcmp(st->disasm->inputFileBuffer + addr - st->disasm->romLoadAddr, zeros, diff) == 0))
+                    {
+                        out_str(st, "\t.align 2, 0\n");
+                        addr += diff;
+                    }
+                }
+            }
+            break;
+        case LABEL_POOL:
+            {
+                uint32_t value = word_at(st, addr);
                 const struct Label *label_p;
 
-                if (word & 3 && word & ROM_LOAD_ADDR) // possibly thumb function
+                if (value & 3 && (value & st->disasm->romLoadAddr & 0x0F000000) == (st->disasm->romLoadAddr & 0x0F000000)) // possibly thumb function
+                {
+                    if (label_p = lookup_label(st, value & ~1), label_p != NULL)
+                    {
+                        if (label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
+                        {
+                            print_pool_word(st, addr, value & ~1, label_p->name, st->disasm->functionPrefix);
+                            addr += 4;
+                            break;
+                        }
+                    }
+                }
+                label_p = lookup_label(st, value);
+                if (label_p != NULL)
+                {
+                    if (label_p->type != LABEL_THUMB_CODE)
+                    {
+                        print_pool_word(st, addr, value, label_p->name,
+                                        (label_p->branchType == BRANCH_TYPE_BL) ? st->disasm->functionPrefix : "_");
+                        addr += 4;
+                        break;
+                    }
+                }
+                print_pool_word(st, addr, value, NULL, "0x");
+                addr += 4;
+            }
+            break;
+        case LABEL_JUMP_TABLE_THUMB:
+        case LABEL_JUMP_TABLE_THUMB_BX:
+        {
+            uint32_t start = addr;
+            uint32_t end = addr + st->labels[i].size;
+            int caseNum = 0;
+
+            out_printf(st, "_%08X: @ jump table\n", addr);
+            while (addr < end)
+            {
+                uint16_t offset = hword_at(st, addr);
+                uint32_t word = start + offset + (st->labels[i].type == LABEL_JUMP_TABLE_THUMB_BX ? 0 : 2);
+
+                if (st->labels[i].type == LABEL_JUMP_TABLE_THUMB_BX)
+                    out_printf(st, "\t.2byte _%08X - _%08X + %d @ case %i\n", word & ~1, start, word & 1 ? 1 : 0, caseNum);
+                else
+                    out_printf(st, "\t.2byte _%08X - _%08X - 2 @ case %i\n", word & ~1, start, caseNum);
+                caseNum++;
+                addr += 2;
+            }
+        }
+            break;
+        case LABEL_JUMP_TABLE:
+            {
+                uint32_t end = addr + st->labels[i].size;
+                const struct DecodedInsn *insn;
+                int caseNum = 0;
+
+                out_printf(st, "_%08X: @ jump table\n", addr);
+                while (addr < end && (insn = decode_insn(st, addr, LABEL_ARM_CODE, end - addr)) != NULL)
                 {
-                    if (label_p = lookup_label(word & ~1), label_p != NULL)
-                    {
-                        if (label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
-                        {
-                            if (label_p->name != NULL)
-                                do_print_insn("\tadd %s, pc, #0x%X @ =%s", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, label_p->name);
-                            else
-                                do_print_insn("\tadd %s, pc, #0x%X @ =%s%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, functionPrefix, word & ~1);
-                            return;
-                        }
-                    }
+                    print_insn(st, insn, addr, LABEL_ARM_CODE, caseNum++);
+                    addr += 4;
                 }
-                label_p = lookup_label(word);
-                if (label_p != NULL)
+            }
+            break;
+        case LABEL_DATA:
+            if (st->labels[i].size == UNKNOWN_SIZE || i + 1 >= st->labelsCount)
+                nextAddr = romEnd;
+            else
+                nextAddr = min(st->labels[i + 1].addr, romEnd);
+            if (st->labels[i].name)
+                out_printf(st, "%s: @ 0x%08X\n", st->labels[i].name, addr);
+            else
+                out_printf(st, "_%08X:\n", addr);
+            print_gap(st, addr, nextAddr);
+            addr = nextAddr;
+            break;
+        case LABEL_ASCII:
+            if (st->labels[i].name)
+                out_printf(st, "%s: @ 0x%08X\n", st->labels[i].name, addr);
+            else
+                out_printf(st, "_%08X:\n", addr);
+            const char * s = (const char *)&st->disasm->inputFileBuffer[addr - st->disasm->romLoadAddr];
+            // the module may be mapped, so don't read past its end
+            size_t slen = strnlen(s, romEnd - addr);
+            if (addr + slen + 1 >= romEnd)
+            {
+                // leave the error to the main thread, in case it never gets here
+                if (sIsWorker)
                 {
-                    if (label_p->type != LABEL_THUMB_CODE)
-                    {
-                        if (label_p->name != NULL)
-                            do_print_insn("\tadd %s, pc, #0x%X @ =%s", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, label_p->name);
-                        else if (label_p->branchType == BRANCH_TYPE_BL)
-                            do_print_insn("\tadd %s, pc, #0x%X @ =%s%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, functionPrefix, word);
-                        else
-                            do_print_insn("\tadd %s, pc, #0x%X @ =_%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, word);
-                        return;
-                    }
+                    sWorkerMissed = true;
+                    goto out;
                 }
-                do_print_insn("\tadd %s, pc, #0x%X @ =0x%08X", caseNum, cs_reg_name(sCapstone, insn->detail->arm.operands[0].reg), insn->detail->arm.operands[2].imm, word);
+                fatal_error("Improperly terminated string at 0x%08X\n", addr);
             }
-            else
-                do_print_insn("\t%s %s", caseNum, insn->mnemonic, insn->op_str);
+            out_printf(st, "\t.asciz \"%s\"\n", s);
+            addr += slen + 1;
+            break;
+        default:
+            fatal_error("unrecognized label type: %d\n", st->labels[i].type);
+        }
+        endaddr = addr = print_align(st, addr, st->labels[i].type);
+    next:
+        i++;
+        if (i >= st->labelsCount)
+        {
+            // This is a function end
+            if (last_name[0])
+            {
+                out_printf(st, "\t%s %s\n", (last_label == LABEL_THUMB_CODE) ? "thumb_func_end" : "arm_func_end", last_name);
+                last_name[0] = 0;
+            }
+            break;
+        }
+
+        nextAddr = st->labels[i].addr;
+        // assert(addr <= nextAddr);
+        while (addr > nextAddr) {
+            err_printf("Warning: label at 0x%08X is inside function at 0x%08X\n"
+                       "(trying to insert %s into %s)\n", nextAddr, lastAddr, gLabelTypeNames[st->labels[i].type], gLabelTypeNames[st->labels[li].type]);
+            ++i;
+            if (i == st->labelsCount)
+                break;
+            nextAddr = st->labels[i].addr;
+        }
+        assert(i != st->labelsCount);
+        lastAddr = nextAddr;
+
+        if (((last_label != LABEL_DATA
+         && (st->labels[i].type == LABEL_THUMB_CODE || st->labels[i].type == LABEL_ARM_CODE)
+         && st->labels[i].branchType == BRANCH_TYPE_BL) || (st->labels[i].isFromConfig))
+         && last_name[0])
+        {
+            // This is a function end
+            out_printf(st, "\t%s %s\n", (last_label == LABEL_THUMB_CODE) ? "thumb_func_end" : "arm_func_end", last_name);
+            last_name[0] = 0;
+        }
+
+        if (addr >= st->disasm->romLoadAddr && (nextAddr <= romEnd || st->disasm->options.dumpUnDisassembled) && addr != nextAddr) // prevent out-of-bound read
+        {
+            out_printf(st, "_%08X:\n", addr);
+            print_gap(st, addr, min(nextAddr, romEnd));
+        }
+        addr = nextAddr;
+    }
+    ps->done = true;
+out:
+    ps->i = i;
+    ps->addr = addr;
+    ps->lastAddr = lastAddr;
+    ps->endaddr = endaddr;
+    ps->lastLabel = last_label;
+}
+
+// Parallel Formatting
+
+// With -j the labels are cut into chunks at function starts, and the workers
+// format each chunk into a buffer of its own, starting from a fresh state:
+// printing a function never depends on what came before its start label, other
+// than through where the previous chunk stopped. The main thread then writes
+// the chunks out in order. A chunk whose start the previous one printed past
+// (a label inside a function), or that needed something only the main thread
+// can do, is printed again from where the previous chunk really stopped. The
+// output is the same as with a single thread.
+
+#define PRINT_CHUNK_LABELS 32
+#define PRINT_CHUNKS_PER_THREAD 4
+
+struct PrintChunk
+{
+    int start;              // index into labels of the first label
+    int end;                // and of the first label of the next chunk
+    struct OutBuffer out;
+    struct OutBuffer err;
+    struct PrintState exit; // where the chunk stopped
+    bool missed;
+};
+
+// Whether the chunk can start at label i: a function that doesn't run into the
+// end of the module, so that its iteration doesn't read the state it starts in.
+static bool print_chunk_start(struct DisasmState *st, int i)
+{
+    return (st->labels[i].type == LABEL_ARM_CODE || st->labels[i].type == LABEL_THUMB_CODE)
+        && st->labels[i].branchType == BRANCH_TYPE_BL
+        && st->labels[i].addr - st->disasm->romLoadAddr < st->disasm->inputFileBufferSize
+        && !label_runs_past_end(st, i);
+}
+
+static void print_chunk_job(struct DisasmState *st, struct PrintWorker *worker, int index)
+{
+    struct PrintChunk *chunk = &st->printChunks[index];
+
+    (void)worker;
+    chunk->out.size = 0;
+    chunk->err.size = 0;
+    sOut = &chunk->out;
+    sErr = &chunk->err;
+    sWorkerMissed = false;
+    print_state_init(st, &chunk->exit, chunk->start);
+    print_labels(st, &chunk->exit, chunk->end);
+    chunk->missed = sWorkerMissed;
+    sOut = NULL;
+    sErr = NULL;
+}
+
+static void print_chunks_free(struct DisasmState *st)
+{
+    if (st->printChunks == NULL)
+        return;
+    for (int c = 0; c < st->workersCount * PRINT_CHUNKS_PER_THREAD; c++)
+    {
+        free(st->printChunks[c].out.data);
+        free(st->printChunks[c].err.data);
+    }
+    free(st->printChunks);
+    st->printChunks = NULL;
+}
+
+static void print_chunks(struct DisasmState *st, struct PrintState *ps)
+{
+    int waveSize = st->workersCount * PRINT_CHUNKS_PER_THREAD;
+    int start = 0;
+
+    st->printChunks = calloc(waveSize, sizeof(*st->printChunks));
+    if (st->printChunks == NULL)
+        fatal_error("failed to alloc space for output. ");
+    while (start < st->labelsCount && !ps->done && !ps->aborted)
+    {
+        int count;
+
+        for (count = 0; count < waveSize && start < st->labelsCount; count++)
+        {
+            int end = min(start + PRINT_CHUNK_LABELS, st->labelsCount);
+
+            while (end < st->labelsCount && !print_chunk_start(st, end))
+                end++;
+            st->printChunks[count].start = start;
+            st->printChunks[count].end = end;
+            start = end;
+        }
+        workers_run(st, print_chunk_job, count);
+
+        for (int c = 0; c < count && !ps->done && !ps->aborted; c++)
+        {
+            const struct PrintChunk *chunk = &st->printChunks[c];
+
+            if (ps->i == chunk->start && !chunk->missed)
+            {
+                out_write(st, chunk->out.data, chunk->out.size);
+                fwrite(chunk->err.data, 1, chunk->err.size, stderr);
+                *ps = chunk->exit;
+                st->printChunksFormatted++;
+            }
+            else if (ps->i < chunk->end)
+            {
+                print_labels(st, ps, chunk->end);
+                st->printChunksReprinted++;
+            }
+        }
+    }
+    print_chunks_free(st);
+}
+
+// Puts the labels in address order and settles what printing needs to know
+// about them.
+static void labels_finish(struct DisasmState *st)
+{
+    int i;
+
+    label_order_apply(st);
+
+    for (i = 0; i < st->labelsCount; i++)
+    {
+        if (st->labels[i].type == LABEL_ARM_CODE || st->labels[i].type == LABEL_THUMB_CODE)
+            assert(st->labels[i].processed);
+    }
+    // check mode exchange right after func return
+    for (i = 1; i < st->labelsCount; i++)
+        if ((st->labels[i - 1].type == LABEL_ARM_CODE && st->labels[i].type == LABEL_THUMB_CODE)
+         || (st->labels[i - 1].type == LABEL_THUMB_CODE && st->labels[i].type == LABEL_ARM_CODE))
+            st->labels[i].branchType = BRANCH_TYPE_BL;
+    for (i = 0; i < st->labelsCount; i++)
+        if (st->labels[i].addr - st->disasm->romLoadAddr < st->disasm->inputFileBufferSize)
+            label_fix_size(st, i);
+}
+
+static void print_disassembly(struct DisasmState *st)
+{
+    struct PrintState ps;
+
+    labels_finish(st);
+    print_state_init(st, &ps, 0);
+    if (ps.addr > st->disasm->romLoadAddr && st->disasm->options.dumpUnDisassembled)
+    {
+        out_printf(st, "_%08X:\n", st->disasm->romLoadAddr);
+        print_gap(st, st->disasm->romLoadAddr, min(ps.addr, st->disasm->romLoadAddr + st->disasm->inputFileBufferSize));
+    }
+
+    // split output is printed on the main thread, file by file
+    if (st->workersCount != 0 && st->disasm->options.splitDirectory == NULL)
+        print_chunks(st, &ps);
+    else
+        print_labels(st, &ps, st->labelsCount);
+    if (ps.aborted)
+        return;
+    if (st->disasm->options.dumpUnDisassembled && ps.addr >= st->disasm->romLoadAddr && ps.addr < st->disasm->romLoadAddr + st->disasm->inputFileBufferSize)
+    {
+        out_printf(st, "_%08X:\n", ps.addr);
+        print_gap(st, ps.addr, st->disasm->romLoadAddr + st->disasm->inputFileBufferSize);
+    }
+    else
+        out_printf(st, "\t@ 0x%08X\n", ps.endaddr);
+}
+
+static void elf_symbols_free(struct ElfSymbol *symbols, int count)
+{
+    for (int i = 0; i < count; i++)
+        free((char *)symbols[i].name);
+    free(symbols);
+}
+
+// Passes the labels to the ELF writer in address order, named the way they
+// are printed. Functions are sized up to the next function, other labels up to
+// the next label. The bytes between labels that aren't covered are data.
+static void write_elf(struct DisasmState *st)
+{
+    struct ElfSymbol *symbols = malloc((2 * st->labelsCount + 1) * sizeof(*symbols));
+    uint32_t end = st->disasm->romLoadAddr + st->disasm->inputFileBufferSize;
+    int count = 0;
+    bool written;
+
+    if (symbols == NULL)
+        fatal_error("failed to alloc space for ELF output. ");
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        const struct Label *label = &st->labels[i];
+        struct ElfSymbol *symbol = &symbols[count++];
+        bool isCode = (label->type == LABEL_ARM_CODE || label->type == LABEL_THUMB_CODE);
+        uint32_t labelEnd;
+        char *name;
+
+        if (label->addr - st->disasm->romLoadAddr >= st->disasm->inputFileBufferSize)
+        {
+            count--;
+            continue;
+        }
+        symbol->addr = label->addr;
+        symbol->function = isCode && label->branchType == BRANCH_TYPE_BL;
+        symbol->global = symbol->function || (label->name != NULL && !isCode);
+        if (label->type == LABEL_ARM_CODE || label->type == LABEL_JUMP_TABLE)
+            symbol->mapping = 'a';
+        else if (label->type == LABEL_THUMB_CODE)
+            symbol->mapping = 't';
+        else
+            symbol->mapping = 'd';
+        if (label->name != NULL)
+            name = strdup(label->name);
+        else if ((name = malloc(strlen(st->disasm->functionPrefix) + 10)) != NULL)
+            sprintf(name, "%s%08X", symbol->function ? st->disasm->functionPrefix : "_", label->addr);
+        if (name == NULL)
+        {
+            elf_symbols_free(symbols, count - 1);
+            fatal_error("failed to alloc space for ELF output. ");
+        }
+        symbol->name = name;
+
+        if (label->size != UNKNOWN_SIZE)
+            labelEnd = min(label->addr + label->size, end);
+        else
+            labelEnd = (i + 1 < st->labelsCount) ? min(st->labels[i + 1].addr, end) : end;
+        symbol->size = labelEnd - label->addr;
+        if (symbol->function)
+        {
+            int next = i + 1;
+
+            while (next < st->labelsCount
+                && !((st->labels[next].type == LABEL_ARM_CODE || st->labels[next].type == LABEL_THUMB_CODE)
+                  && st->labels[next].branchType == BRANCH_TYPE_BL))
+                next++;
+            symbol->size = min((next < st->labelsCount) ? st->labels[next].addr : end, end) - label->addr;
+        }
+        if (labelEnd < end && (i + 1 == st->labelsCount || labelEnd < st->labels[i + 1].addr) && symbol->mapping != 'd')
+            symbols[count++] = (struct ElfSymbol){NULL, labelEnd, 0, 'd', false, false};
+    }
+    written = elf_write(st->disasm, st->disasm->options.elfFileName, symbols, count);
+    elf_symbols_free(symbols, count);
+    if (!written)
+        fatal_error("failed to write ELF object %s", st->disasm->options.elfFileName);
+}
+
+// Writes the module's functions and data labels, named the way they're
+// printed, for the symbol index of a batch run with -x.
+static void write_symbols(struct DisasmState *st)
+{
+    FILE *file = fopen(st->disasm->symbolExportFile, "wb");
+
+    if (file == NULL)
+        fatal_error("failed to write symbol file %s", st->disasm->symbolExportFile);
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        const struct Label *label = &st->labels[i];
+        char kind;
+
+        if (label->addr - st->disasm->romLoadAddr >= st->disasm->inputFileBufferSize)
+            continue;
+        if (label->type == LABEL_ARM_CODE && label->branchType == BRANCH_TYPE_BL)
+            kind = 'a';
+        else if (label->type == LABEL_THUMB_CODE && label->branchType == BRANCH_TYPE_BL)
+            kind = 't';
+        else if (label->type == LABEL_DATA || label->type == LABEL_ASCII)
+            kind = 'd';
+        else
+            continue;
+        if (label->name != NULL)
+            fprintf(file, "%08X %c %s\n", label->addr, kind, label->name);
+        else
+            fprintf(file, "%08X %c %s%08X\n", label->addr, kind, (kind == 'd') ? "_" : st->disasm->functionPrefix, label->addr);
+    }
+    if (fclose(file) != 0)
+        fatal_error("failed to write symbol file %s", st->disasm->symbolExportFile);
+}
+
+// Prints to buffer if it isn't NULL, or where the options say.
+static void print_module(struct DisasmState *st, struct OutBuffer *buffer)
+{
+    double printTime;
+
+    if (st->disasm->options.symbolIndexFile != NULL)
+        symbols_open(st->disasm, st->disasm->options.symbolIndexFile, st->disasm->options.isArm7, st->disasm->romLoadAddr, st->disasm->inputFileBufferSize);
+    // the output tends to come out at about 8 bytes per byte of the module
+    if (buffer != NULL)
+    {
+        sOut = buffer;
+        st->sinkWaitTime = 0;
+    }
+    else if (st->disasm->options.splitDirectory != NULL)
+        split_open(st);
+    else
+        sink_open(st, st->disasm->options.outputFileName, (size_t)st->disasm->inputFileBufferSize * 8);
+    blobs_init(st);
+    workers_init(st);
+    printTime = wall_time();
+    print_disassembly(st);
+    printTime = wall_time() - printTime;
+    workers_free(st);
+    if (st->disasm->options.printStatistics)
+        fprintf(stderr, "print: %.3f s formatting, %d chunks formatted ahead, %d printed again\n",
+                printTime - st->sinkWaitTime, st->printChunksFormatted, st->printChunksReprinted);
+    if (buffer != NULL)
+        sOut = NULL;
+    else if (st->disasm->options.splitDirectory != NULL)
+        split_close(st);
+    else
+        sink_close(st);
+    blobs_free(st);
+    if (st->disasm->options.elfFileName != NULL)
+        write_elf(st);
+    if (st->disasm->options.symbolIndexFile != NULL)
+        symbols_close(st->disasm);
+}
+
+// Opens capstone and the instruction store.
+static bool disasm_open(struct DisasmState *st)
+{
+    if (!decoder_open(&st->decoder))
+        return false;
+    st->opened = true;
+    sResyncs = sResyncSkipped = sResyncKnown = 0;
+    insn_store_init(st);
+    st->fastDecode = !st->disasm->options.capstoneOnly && fast_decoder_gate(st);
+    if (st->disasm->options.verifyDecoder)
+    {
+        verify_fast_decoder(st);
+        verify_hex_dump(st);
+    }
+    return true;
+}
+
+// -V: analyzes the module again in a context of its own, with every label
+// traced over its whole window as if nothing were spliced, and reports the
+// labels only one of the two analyses found, which is an error.
+
+struct SpliceCheck
+{
+    const struct NdsDisasm *parent;
+    struct AnalysisConfig *labels; // the config labels, then what the check found
+    int count;
+};
+
+static int check_label_compare(const void *a, const void *b)
+{
+    const struct AnalysisConfig *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static void splice_check_step(struct NdsDisasm *disasm, void *arg)
+{
+    struct DisasmState *st = disasm->disasm;
+    struct SpliceCheck *check = arg;
+    struct AnalysisConfig *found;
+
+    disasm->inputFileBuffer = check->parent->inputFileBuffer;
+    disasm->inputFileBufferSize = check->parent->inputFileBufferSize;
+    disasm->romLoadAddr = check->parent->romLoadAddr;
+    for (int i = 0; i < check->count; i++)
+        disasm_add_label(disasm, check->labels[i].addr, check->labels[i].type, NULL, true);
+    st->noSplice = true;
+    disasm_analyze_module(disasm);
+    if ((found = malloc(max(st->labelsCount, 1) * sizeof(*found))) == NULL)
+        fatal_error("failed to alloc space for labels. ");
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        found[i].addr = st->labels[i].addr;
+        found[i].type = st->labels[i].type;
+    }
+    free(check->labels);
+    check->labels = found;
+    check->count = st->labelsCount;
+}
+
+// Returns the labels added so far, which are the config's, for verify_splicing.
+static struct AnalysisConfig *verify_splicing_start(struct DisasmState *st, int *count)
+{
+    struct AnalysisConfig *labels = malloc(max(st->labelsCount, 1) * sizeof(*labels));
+
+    if (labels == NULL)
+        fatal_error("failed to alloc space for labels. ");
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        labels[i].addr = st->labels[i].addr;
+        labels[i].type = st->labels[i].type;
+    }
+    *count = st->labelsCount;
+    return labels;
+}
+
+static void verify_splicing(struct DisasmState *st, struct AnalysisConfig *config, int configCount)
+{
+    struct NdsDisasmOptions options = st->disasm->options;
+    struct SpliceCheck check = {st->disasm, config, configCount};
+    struct NdsDisasm *disasm;
+    int onlySpliced = 0, onlyUnspliced = 0, retyped = 0;
+
+    options.verifyDecoder = false;
+    options.printStatistics = false;
+    options.printThreads = 1;
+    options.outputFileName = options.splitDirectory = options.elfFileName = NULL;
+    options.symbolIndexFile = options.analysisDirectory = options.uncompressedFileName = NULL;
+    if ((disasm = ndsdisasm_create(&options)) == NULL)
+    {
+        free(config);
+        fatal_error("failed to alloc a context for the splicing check");
+    }
+    if (!context_run(disasm, splice_check_step, &check))
+    {
+        char error[CONTEXT_ERROR_SIZE];
+
+        snprintf(error, sizeof(error), "%s", ndsdisasm_error(disasm));
+        ndsdisasm_destroy(disasm);
+        free(check.labels);
+        fatal_error("the splicing check failed: %s", error);
+    }
+    ndsdisasm_destroy(disasm);
+
+    qsort(check.labels, check.count, sizeof(*check.labels), check_label_compare);
+    for (int i = 0; i < check.count; i++)
+    {
+        int l = label_hash_find(st, check.labels[i].addr);
+
+        if (l == -1)
+        {
+            if (onlyUnspliced++ < 20)
+                fprintf(stderr, "verify: splicing: label at 0x%08X is only found without splicing\n", check.labels[i].addr);
         }
+        else if (st->labels[l].type != check.labels[i].type && retyped++ < 20)
+        {
+            fprintf(stderr, "verify: splicing: label at 0x%08X is %s, and %s without splicing\n",
+                    check.labels[i].addr, gLabelTypeNames[st->labels[l].type], gLabelTypeNames[check.labels[i].type]);
+        }
+    }
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        struct AnalysisConfig key = {st->labels[i].addr, 0};
+
+        if (bsearch(&key, check.labels, check.count, sizeof(*check.labels), check_label_compare) == NULL
+         && onlySpliced++ < 20)
+            fprintf(stderr, "verify: splicing: label at 0x%08X is only found with splicing\n", key.addr);
+    }
+    fprintf(stderr, "verify: splicing: %d labels, %d only found with splicing, %d only without, %d typed differently\n",
+            st->labelsCount, onlySpliced, onlyUnspliced, retyped);
+    free(check.labels);
+    if (onlySpliced != 0 || onlyUnspliced != 0 || retyped != 0)
+        fatal_error("splicing changed the labels found");
+}
+
+static void disasm_analyze(struct DisasmState *st)
+{
+    // the check has nothing to compare a restored analysis with
+    bool verify = st->disasm->options.verifyDecoder && st->disasm->options.analysisDirectory == NULL;
+    struct AnalysisConfig *config = NULL;
+    int configCount = 0;
+
+    if (verify)
+        config = verify_splicing_start(st, &configCount);
+    coverage_init(st);
+    if (!analysis_restore(st))
+    {
+        analyze(st);
+        analysis_save(st);
+    }
+    coverage_free(st);
+    if (verify)
+        verify_splicing(st, config, configCount);
+}
+
+static void disasm_close(struct DisasmState *st)
+{
+    if (st->opened)
+    {
+        workers_free(st);
+        insn_store_free(st);
+        decoder_close(&st->decoder);
+        st->opened = false;
+    }
+    FreeLabels(st);
+}
+
+// Analyzes the module from the labels added so far.
+void disasm_analyze_module(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = disasm->disasm;
+
+    if (!disasm_open(st))
+        fatal_error("cs_open failed");
+    disasm_analyze(st);
+}
+
+// Prints the analyzed module, into *text if it isn't NULL.
+void disasm_emit(struct NdsDisasm *disasm, char **text, size_t *size)
+{
+    struct DisasmState *st = disasm->disasm;
+
+    if (disasm->symbolExportFile != NULL)
+    {
+        // the first pass of a batch with -x only needs the labels
+        labels_finish(st);
+        write_symbols(st);
+        return;
+    }
+    if (text == NULL)
+    {
+        print_module(st, NULL);
+        return;
+    }
+    if (disasm->options.splitDirectory != NULL)
+        fatal_error("split output can't be emitted to memory");
+    st->emitText.size = 0;
+    print_module(st, &st->emitText);
+    *text = st->emitText.data;
+    *size = st->emitText.size;
+    st->emitText = (struct OutBuffer){0};
+}
+
+// Resident Module
+
+// With -L the module stays loaded once it is analyzed, along with every
+// instruction decoded on the way, and the server answers queries about it.
+// Labels added over the socket join the config labels, and analysis starts
+// over from those without decoding anything it already has. With -R, only
+// what they affect is traced again.
+
+struct ResidentLabel
+{
+    uint32_t addr;
+    enum LabelType type;
+    char *name;
+};
+
+static uint32_t name_hash(const char *name)
+{
+    return (uint32_t)content_hash((const uint8_t *)name, strlen(name));
+}
+
+// Indexes the labels by the names they have, for disasm_lookup. Must be called
+// whenever labels or their names change. Where two have the same name, the
+// first one is found, as it is printed first.
+static void name_hash_rebuild(struct DisasmState *st)
+{
+    uint32_t size = 16;
+
+    while (size < 2u * st->labelsCount)
+        size *= 2;
+    if (size - 1 != st->nameHashMask || st->nameHash == NULL)
+    {
+        free(st->nameHash);
+        st->nameHash = malloc(size * sizeof(*st->nameHash));
+        if (st->nameHash == NULL)
+            fatal_error("failed to alloc space for label index. ");
+        st->nameHashMask = size - 1;
+    }
+    memset(st->nameHash, -1, size * sizeof(*st->nameHash));
+    for (int i = 0; i < st->labelsCount; i++)
+    {
+        const char *name = st->labels[i].name;
+        uint32_t slot;
+
+        if (name == NULL)
+            continue;
+        slot = name_hash(name) & st->nameHashMask;
+        while (st->nameHash[slot] != -1 && strcmp(st->labels[st->nameHash[slot]].name, name) != 0)
+            slot = (slot + 1) & st->nameHashMask;
+        if (st->nameHash[slot] == -1)
+            st->nameHash[slot] = i;
     }
 }
 
-static int qsort_label_compare(const void *a, const void *b)
+static int name_hash_find(struct DisasmState *st, const char *name)
 {
-    return ((struct Label *)a)->addr - ((struct Label *)b)->addr;
+    uint32_t slot;
+
+    if (st->nameHash == NULL)
+        return -1;
+    slot = name_hash(name) & st->nameHashMask;
+    while (st->nameHash[slot] != -1)
+    {
+        if (strcmp(st->labels[st->nameHash[slot]].name, name) == 0)
+            return st->nameHash[slot];
+        slot = (slot + 1) & st->nameHashMask;
+    }
+    return -1;
 }
 
-static void print_disassembly(void)
+static void resident_analyze(struct DisasmState *st)
 {
-    //uint32_t addr = ROM_LOAD_ADDR;
-    int i = 0;
-    int li;
-    char last_name[256] = "";
-    enum LabelType last_label = LABEL_DATA;
-    uint32_t endaddr = -1u;
+    disasm_analyze(st);
+    labels_finish(st);
+    for (int r = 0; r < st->renamesCount; r++)
+    {
+        int i = label_hash_find(st, st->renames[r].addr);
+
+        if (i == -1)
+            continue;
+        free(st->labels[i].name);
+        st->labels[i].name = strdup(st->renames[r].name);
+        if (st->labels[i].name == NULL)
+            fatal_error("failed to alloc space for labels. ");
+    }
+    name_hash_rebuild(st);
+}
 
-    qsort(gLabels, gLabelsCount, sizeof(*gLabels), qsort_label_compare);
-    uint32_t addr = gLabels[0].addr, lastAddr = addr;
+// Analyzes the module, whose labels so far all come from the config, and
+// keeps it loaded for the queries below.
+void disasm_resident_open(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = disasm->disasm;
 
-    for (i = 0; i < gLabelsCount - 1; i++)
-        assert(gLabels[i].addr < gLabels[i + 1].addr);
-    for (i = 0; i < gLabelsCount; i++)
+    if (!disasm_open(st))
+        fatal_error("cs_open failed");
+    st->resident = true;
+    st->residentConfig = malloc(max(st->labelsCount, 1) * sizeof(*st->residentConfig));
+    if (st->residentConfig == NULL)
+        fatal_error("failed to alloc space for labels. ");
+    for (int i = 0; i < st->labelsCount; i++)
     {
-        if (gLabels[i].type == LABEL_ARM_CODE || gLabels[i].type == LABEL_THUMB_CODE)
-            assert(gLabels[i].processed);
+        st->residentConfig[i].addr = st->labels[i].addr;
+        st->residentConfig[i].type = st->labels[i].type;
+        st->residentConfig[i].name = (st->labels[i].name != NULL) ? strdup(st->labels[i].name) : NULL;
     }
-    // check mode exchange right after func return
-    for (i = 1; i < gLabelsCount; i++)
-        if ((gLabels[i - 1].type == LABEL_ARM_CODE && gLabels[i].type == LABEL_THUMB_CODE)
-         || (gLabels[i - 1].type == LABEL_THUMB_CODE && gLabels[i].type == LABEL_ARM_CODE))
-            gLabels[i].branchType = BRANCH_TYPE_BL;
+    st->residentConfigCount = st->labelsCount;
+    if (disasm->options.symbolIndexFile != NULL)
+        symbols_open(disasm, disasm->options.symbolIndexFile, disasm->options.isArm7, disasm->romLoadAddr, disasm->inputFileBufferSize);
+    resident_analyze(st);
+}
+
+static void resident_free(struct DisasmState *st)
+{
+    for (int i = 0; i < st->residentConfigCount; i++)
+        free(st->residentConfig[i].name);
+    for (int i = 0; i < st->renamesCount; i++)
+        free(st->renames[i].name);
+    free(st->residentConfig);
+    free(st->renames);
+    free(st->reply.data);
+    free(st->nameHash);
+    st->nameHash = NULL;
+    st->residentConfig = st->renames = NULL;
+    st->residentConfigCount = st->renamesCount = 0;
+    st->reply.data = NULL;
+    st->resident = false;
+}
+
+void disasm_resident_close(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = disasm->disasm;
+
+    if (disasm->options.symbolIndexFile != NULL)
+        symbols_close(disasm);
+    disasm_close(st);
+    resident_free(st);
+}
+
+// Queries print their reply, or what went wrong, between these two. Warnings
+// go to the server's stderr, as they would without it.
+void disasm_reply_begin(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = disasm->disasm;
+
+    st->reply.size = 0;
+    sOut = &st->reply;
+}
+
+const char *disasm_reply_end(struct NdsDisasm *disasm, size_t *size)
+{
+    struct DisasmState *st = disasm->disasm;
+
+    sOut = NULL;
+    *size = st->reply.size;
+    return st->reply.data;
+}
+
+// Named the way it's printed.
+static const char *resident_label_name(struct DisasmState *st, const struct Label *label, char *buffer, size_t size)
+{
+    if (label->name != NULL)
+        return label->name;
+    snprintf(buffer, size, "%s%08X", (label->branchType == BRANCH_TYPE_BL) ? st->disasm->functionPrefix : "_", label->addr);
+    return buffer;
+}
 
-    i = 0;
-    if (addr > ROM_LOAD_ADDR && dumpUnDisassembled)
+// What the label is, in the words of the config where there are some.
+static const char *resident_label_kind(const struct Label *label)
+{
+    switch (label->type)
     {
-        printf("_%08X:\n", ROM_LOAD_ADDR);
-        print_gap(ROM_LOAD_ADDR, min(addr, ROM_LOAD_ADDR + gInputFileBufferSize));
+    case LABEL_ARM_CODE:
+        return (label->branchType == BRANCH_TYPE_BL) ? "arm_func" : "arm_label";
+    case LABEL_THUMB_CODE:
+        return (label->branchType == BRANCH_TYPE_BL) ? "thumb_func" : "thumb_label";
+    case LABEL_DATA:
+        return "data";
+    case LABEL_ASCII:
+        return "ascii";
+    case LABEL_POOL:
+        return "pool";
+    default:
+        return "jump_table";
     }
+}
+
+static void resident_print_label(struct DisasmState *st, const struct Label *label)
+{
+    char buffer[256];
+
+    out_printf(st, "0x%08X %s %s", label->addr, resident_label_kind(label), resident_label_name(st, label, buffer, sizeof(buffer)));
+}
+
+// Returns the index of the label without a name that is printed as symbol,
+// prefix and its address, or -1 if there is none.
+static int resident_generated_name(struct DisasmState *st, const char *symbol, const char *prefix, bool function)
+{
+    size_t length = strlen(prefix);
+    const char *hex = symbol + length;
+    int i;
+
+    if (strncmp(symbol, prefix, length) != 0 || strlen(hex) != 8 || strspn(hex, "0123456789ABCDEF") != 8)
+        return -1;
+    i = label_hash_find(st, strtoul(hex, NULL, 16));
+    if (i == -1 || st->labels[i].name != NULL || (st->labels[i].branchType == BRANCH_TYPE_BL) != function)
+        return -1;
+    return i;
+}
+
+// Returns the index of the last label at or before addr, or -1 if there is
+// none. The labels are in address order once analysis is done.
+static int resident_label_containing(struct DisasmState *st, uint32_t addr)
+{
+    int lo = 0, hi = st->labelsCount;
 
-    while (addr < ROM_LOAD_ADDR + gInputFileBufferSize)
+    while (lo < hi)
     {
-        li = i;
-        uint32_t nextAddr;
-        if (gLabels[i].addr < ROM_LOAD_ADDR)
-        {
-            goto next;
-        }
-        if (gLabels[i].addr >= ROM_LOAD_ADDR + gInputFileBufferSize)
-            break;
+        int mid = lo + (hi - lo) / 2;
 
-        // TODO: compute actual size during analysis phase
-        if (gLabels[i].type == LABEL_POOL)
-            gLabels[i].size = 4;
-        if (i + 1 < gLabelsCount)
-        {
-            if (gLabels[i].size == UNKNOWN_SIZE
-             || gLabels[i].addr + gLabels[i].size > gLabels[i + 1].addr)
-                gLabels[i].size = gLabels[i + 1].addr - gLabels[i].addr;
-            if (gLabels[i].addr + gLabels[i].size >= ROM_LOAD_ADDR + gInputFileBufferSize)
-            {
-                if (gLabels[i].type != LABEL_DATA)
-                    break;
-                gLabels[i].size = ROM_LOAD_ADDR + gInputFileBufferSize - gLabels[i].addr;
-            }
-        }
+        if (st->labels[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
 
-        switch (gLabels[i].type)
-        {
-        case LABEL_ARM_CODE:
-        case LABEL_THUMB_CODE:
-            {
-                struct cs_insn *insn;
-                int count;
-                int j;
-                int mode = (gLabels[i].type == LABEL_ARM_CODE) ? CS_MODE_ARM : CS_MODE_THUMB;
+static bool resident_in_module(struct DisasmState *st, uint32_t addr)
+{
+    if (addr - st->disasm->romLoadAddr < st->disasm->inputFileBufferSize)
+        return true;
+    out_printf(st, "0x%08X is outside the module\n", addr);
+    return false;
+}
 
-                // This is a function. Use the 'sub_XXXXXXXX' label
-                if (gLabels[i].branchType == BRANCH_TYPE_BL)
-                {
-                    unsigned int unalignedMask = (mode == CS_MODE_ARM) ? 3 : 1;
+// Gets the address of symbol, a number or the name of a label.
+bool disasm_lookup(struct NdsDisasm *disasm, const char *symbol, uint32_t *addr)
+{
+    struct DisasmState *st = disasm->disasm;
+    char *end;
+    unsigned long value = strtoul(symbol, &end, 0);
+    int i;
 
-                    if (addr & unalignedMask)
-                    {
-                        fprintf(stderr, "error: function at 0x%08X is not aligned\n", addr);
-                        return;
-                    }
-                    last_label = gLabels[i].type;
-                    if (gLabels[i].name != NULL)
-                        strcpy(last_name, gLabels[i].name);
-                    else
-                        sprintf(last_name, "%s%08X", functionPrefix, addr);
-                    printf("\n\t%s %s\n",
-                           (last_label == LABEL_ARM_CODE) ? "arm_func_start" : (addr & 2 ? "non_word_aligned_thumb_func_start" : "thumb_func_start"),
-                           last_name);
-                    printf("%s: @ 0x%08X\n", last_name, addr);
-                }
-                // Just a normal code label. Use the '_XXXXXXXX' label
-                else
-                {
-                    if (gLabels[i].name != NULL)
-                        printf("%s:\n", gLabels[i].name);
-                    else
-                        printf("_%08X:\n", addr);
-                }
+    if (end != symbol && *end == '\0')
+    {
+        *addr = value;
+        return true;
+    }
+    if ((i = name_hash_find(st, symbol)) == -1
+     && (i = resident_generated_name(st, symbol, disasm->functionPrefix, true)) == -1)
+        i = resident_generated_name(st, symbol, "_", false);
+    if (i == -1)
+        return false;
+    *addr = st->labels[i].addr;
+    return true;
+}
 
-                assert(gLabels[i].size != UNKNOWN_SIZE);
-                cs_option(sCapstone, CS_OPT_MODE, mode);
-                count = cs_disasm(sCapstone, gInputFileBuffer + addr - ROM_LOAD_ADDR, gLabels[i].size, addr, 0, &insn);
-                for (j = 0; j < count; j++)
-                {
-                  no_inc:
-                    if (!IsValidInstruction(&insn[j], gLabels[i].type)) {
-                        if (gLabels[i].type == LABEL_THUMB_CODE)
-                        {
-                            int tmp_cnt;
-                            cs_insn * tmp;
-                            printf("\t.hword 0x%04X\n", hword_at(addr));
-                            addr += 2;
-                            if (insn[j].size == 2) continue;
-                            tmp_cnt = cs_disasm(sCapstone, gInputFileBuffer + addr - ROM_LOAD_ADDR, 2, addr, 0, &tmp);
-                            if (tmp_cnt != 0)
-                            {
-                                free(insn[j].detail);
-                                insn[j] = *tmp;
-                                free(tmp);
-                            }
-                            goto no_inc;
-                        }
-                        else
-                        {
-                            printf("\t.word 0x%08X\n", word_at(addr));
-                            addr += 4;
-                            continue;
-                        }
-                    }
-                    print_insn(&insn[j], addr, gLabels[i].type, -1);
-                    addr += insn[j].size;
-                }
-                cs_free(insn, count);
+// Prints the functions from the one start is in up to end. Printing can only
+// start at a function, the same as a chunk of print_chunks.
+bool disasm_query_range(struct NdsDisasm *disasm, uint32_t start, uint32_t end)
+{
+    struct DisasmState *st = disasm->disasm;
+    struct PrintState ps;
+    int i = resident_label_containing(st, start), stop;
 
-                // align pool if it comes next
-                if (i + 1 < gLabelsCount && gLabels[i + 1].type == LABEL_POOL)
-                {
-                    const uint8_t zeros[3] = {0};
-                    int diff = gLabels[i + 1].addr - addr;
-                    if (diff == 0
-                     || (diff > 0 && diff < 4 && memcmp(gInputFileBuffer + addr - ROM_LOAD_ADDR, zeros, diff) == 0))
-                    {
-                        puts("\t.align 2, 0");
-                        addr += diff;
-                    }
-                }
-            }
+    if (!resident_in_module(st, start))
+        return false;
+    while (i > 0 && !print_chunk_start(st, i))
+        i--;
+    i = max(i, 0);
+    for (stop = i + 1; stop < st->labelsCount; stop++)
+        if (st->labels[stop].addr >= end && print_chunk_start(st, stop))
             break;
-        case LABEL_POOL:
-            {
-                uint32_t value = word_at(addr);
-                const struct Label *label_p;
+    print_state_init(st, &ps, i);
+    print_labels(st, &ps, stop);
+    return true;
+}
 
-                if (value & 3 && (value & ROM_LOAD_ADDR & 0x0F000000) == (ROM_LOAD_ADDR & 0x0F000000)) // possibly thumb function
-                {
-                    if (label_p = lookup_label(value & ~1), label_p != NULL)
-                    {
-                        if (label_p->branchType == BRANCH_TYPE_BL && label_p->type == LABEL_THUMB_CODE)
-                        {
-                            if (label_p->name != NULL)
-                                printf("_%08X: .4byte %s\n", addr, label_p->name);
-                            else
-                                printf("_%08X: .4byte %s%08X\n", addr, functionPrefix, value & ~1);
-                            addr += 4;
-                            break;
-                        }
-                    }
-                }
-                label_p = lookup_label(value);
-                if (label_p != NULL)
-                {
-                    if (label_p->type != LABEL_THUMB_CODE)
-                    {
-                        if (label_p->name != NULL)
-                            printf("_%08X: .4byte %s\n", addr, label_p->name);
-                        else if (label_p->branchType == BRANCH_TYPE_BL)
-                            printf("_%08X: .4byte %s%08X\n", addr, functionPrefix, value);
-                        else // normal label
-                            printf("_%08X: .4byte _%08X\n", addr, value);
-                        addr += 4;
-                        break;
-                    }
-                }
-                printf("_%08X: .4byte 0x%08X\n", addr, value);
-                addr += 4;
-            }
-            break;
-        case LABEL_JUMP_TABLE_THUMB:
-        case LABEL_JUMP_TABLE_THUMB_BX:
-        {
-            uint32_t start = addr;
-            uint32_t end = addr + gLabels[i].size;
-            int caseNum = 0;
+// Prints the label at or before addr, and how far into it addr is, or the
+// name another module gives addr with -x.
+bool disasm_query_symbol(struct NdsDisasm *disasm, uint32_t addr)
+{
+    struct DisasmState *st = disasm->disasm;
+    int i = resident_label_containing(st, addr);
+    const char *ambiguous;
+    const char *name = extern_name(st, addr, &ambiguous);
 
-            printf("_%08X: @ jump table\n", addr);
-            while (addr < end)
-            {
-                uint16_t offset = hword_at(addr);
-                uint32_t word = start + offset + (gLabels[i].type == LABEL_JUMP_TABLE_THUMB_BX ? 0 : 2);
+    if (name != NULL || ambiguous != NULL)
+    {
+        if (name != NULL)
+            out_printf(st, "0x%08X extern %s\n", addr, name);
+        else
+            out_printf(st, "0x%08X extern @ %s\n", addr, ambiguous);
+        return true;
+    }
+    if (!resident_in_module(st, addr))
+        return false;
+    if (i == -1)
+    {
+        out_printf(st, "no label at or before 0x%08X\n", addr);
+        return false;
+    }
+    resident_print_label(st, &st->labels[i]);
+    if (st->labels[i].size != UNKNOWN_SIZE)
+        out_printf(st, " size 0x%X", st->labels[i].size);
+    if (addr != st->labels[i].addr)
+        out_printf(st, " +0x%X", addr - st->labels[i].addr);
+    out_printf(st, "\n");
+    return true;
+}
 
-                if (gLabels[i].type == LABEL_JUMP_TABLE_THUMB_BX)
-                    printf("\t.2byte _%08X - _%08X + %d @ case %i\n", word & ~1, start, word & 1 ? 1 : 0, caseNum);
-                else
-                    printf("\t.2byte _%08X - _%08X - 2 @ case %i\n", word & ~1, start, caseNum);
-                caseNum++;
-                addr += 2;
-            }
-        }
-            break;
-        case LABEL_JUMP_TABLE:
-            {
-                struct cs_insn * insn;
-                cs_option(sCapstone, CS_OPT_MODE, CS_MODE_ARM);
-                int count = cs_disasm(sCapstone, gInputFileBuffer + addr - ROM_LOAD_ADDR, gLabels[i].size, addr, 0, &insn);
-                int caseNum = 0;
+static int resident_addr_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
 
-                printf("_%08X: @ jump table\n", addr);
-                for (caseNum = 0; caseNum < count; caseNum++)
-                {
-                    print_insn(&insn[caseNum], addr, LABEL_ARM_CODE, caseNum);
-                    addr += 4;
-                }
-                cs_free(insn, count);
-            }
-            break;
-        case LABEL_DATA:
-            if (gLabels[i].size == UNKNOWN_SIZE || i + 1 >= gLabelsCount)
-                nextAddr = ROM_LOAD_ADDR + gInputFileBufferSize;
-            else
-                nextAddr = min(gLabels[i + 1].addr, ROM_LOAD_ADDR + gInputFileBufferSize);
-            if (gLabels[i].name)
-                printf("%s: @ 0x%08X\n", gLabels[i].name, addr);
-            else
-                printf("_%08X:\n", addr);
-            print_gap(addr, nextAddr);
-            addr = nextAddr;
-            break;
-        case LABEL_ASCII:
-            if (gLabels[i].name)
-                printf("%s: @ 0x%08X\n", gLabels[i].name, addr);
-            else
-                printf("_%08X:\n", addr);
-            const char * s = (const char *)&gInputFileBuffer[addr - ROM_LOAD_ADDR];
-            size_t slen = strlen(s);
-            if (addr + slen + 1 >= ROM_LOAD_ADDR + gInputFileBufferSize)
-                fatal_error("Improperly terminated string at 0x%08X\n", addr);
-            printf("\t.asciz \"%s\"\n", s);
-            addr += slen + 1;
-            break;
-        default:
-            fatal_error("unrecognized label type: %d\n", gLabels[i].type);
-        }
-        endaddr = addr = print_align(addr, gLabels[i].type);
-    next:
-        i++;
-        if (i >= gLabelsCount)
-        {
-            // This is a function end
-            if (last_name[0])
-            {
-                printf("\t%s %s\n", (last_label == LABEL_THUMB_CODE) ? "thumb_func_end" : "arm_func_end", last_name);
-                last_name[0] = 0;
-            }
-            break;
-        }
+    return (x > y) - (x < y);
+}
 
-        nextAddr = gLabels[i].addr;
-        // assert(addr <= nextAddr);
-        while (addr > nextAddr) {
-            fprintf(stderr, "Warning: label at 0x%08X is inside function at 0x%08X\n"
-                            "(trying to insert %s into %s)\n", nextAddr, lastAddr, gLabelTypeNames[gLabels[i].type], gLabelTypeNames[gLabels[li].type]);
-            ++i;
-            if (i == gLabelsCount)
-                break;
-            nextAddr = gLabels[i].addr;
-        }
-        assert(i != gLabelsCount);
-        lastAddr = nextAddr;
+// Prints the labels whose traces added or looked up the label at addr, each
+// with the function it's in. That's as close as analysis keeps track of.
+bool disasm_query_xrefs(struct NdsDisasm *disasm, uint32_t addr)
+{
+    struct DisasmState *st = disasm->disasm;
+    uint32_t *from;
+    int count = 0;
 
-        if (((last_label != LABEL_DATA
-         && (gLabels[i].type == LABEL_THUMB_CODE || gLabels[i].type == LABEL_ARM_CODE)
-         && gLabels[i].branchType == BRANCH_TYPE_BL) || (gLabels[i].isFromConfig))
-         && last_name[0])
-        {
-            // This is a function end
-            printf("\t%s %s\n", (last_label == LABEL_THUMB_CODE) ? "thumb_func_end" : "arm_func_end", last_name);
-            last_name[0] = 0;
-        }
+    if (label_hash_find(st, addr) == -1)
+    {
+        out_printf(st, "no label at 0x%08X\n", addr);
+        return false;
+    }
+    from = malloc(max(st->edgesCount, 1) * sizeof(*from));
+    if (from == NULL)
+        fatal_error("failed to alloc space for xrefs. ");
+    for (int e = 0; e < st->edgesCount; e++)
+    {
+        int i = label_hash_find(st, st->edges[e].from);
 
-        if (addr >= ROM_LOAD_ADDR && (nextAddr <= ROM_LOAD_ADDR + gInputFileBufferSize || dumpUnDisassembled) && addr != nextAddr) // prevent out-of-bound read
+        // a restored label traced again has new edges instead
+        if (st->edges[e].to == addr && i != -1 && !(st->edges[e].restored && st->labels[i].analyzeCount != 0))
+            from[count++] = st->edges[e].from;
+    }
+    if (count != 0)
+        qsort(from, count, sizeof(*from), resident_addr_compare);
+    for (int e = 0; e < count; e++)
+    {
+        int i = label_hash_find(st, from[e]);
+        int func = i;
+
+        if (e > 0 && from[e] == from[e - 1])
+            continue;
+        while (func > 0 && !((st->labels[func].type == LABEL_ARM_CODE || st->labels[func].type == LABEL_THUMB_CODE)
+                          && st->labels[func].branchType == BRANCH_TYPE_BL))
+            func--;
+        resident_print_label(st, &st->labels[i]);
+        if (func != i)
         {
-            printf("_%08X:\n", addr);
-            print_gap(addr, min(nextAddr, ROM_LOAD_ADDR + gInputFileBufferSize));
+            char buffer[256];
+
+            out_printf(st, " in %s", resident_label_name(st, &st->labels[func], buffer, sizeof(buffer)));
         }
-        addr = nextAddr;
+        out_printf(st, "\n");
+    }
+    free(from);
+    return true;
+}
+
+// Adds a label the way a line of the config does, or changes the one the
+// config has there, and analyzes the module again.
+bool disasm_query_label(struct NdsDisasm *disasm, uint32_t addr, enum LabelType type, const char *name)
+{
+    struct DisasmState *st = disasm->disasm;
+    struct ResidentLabel *label = NULL;
+    double startTime = wall_time();
+
+    if (!resident_in_module(st, addr))
+        return false;
+    if ((type == LABEL_ARM_CODE && (addr & 3)) || (type == LABEL_THUMB_CODE && (addr & 1)))
+    {
+        out_printf(st, "0x%08X is misaligned\n", addr);
+        return false;
+    }
+    for (int i = 0; i < st->residentConfigCount; i++)
+        if (st->residentConfig[i].addr == addr)
+            label = &st->residentConfig[i];
+    if (label == NULL)
+    {
+        st->residentConfig = realloc(st->residentConfig, (st->residentConfigCount + 1) * sizeof(*st->residentConfig));
+        if (st->residentConfig == NULL)
+            fatal_error("failed to alloc space for labels. ");
+        label = &st->residentConfig[st->residentConfigCount++];
+        label->addr = addr;
+        label->name = NULL;
     }
-    if (dumpUnDisassembled && addr >= ROM_LOAD_ADDR && addr < ROM_LOAD_ADDR + gInputFileBufferSize)
+    label->type = type;
+    if (name != NULL)
     {
-        printf("_%08X:\n", addr);
-        print_gap(addr, ROM_LOAD_ADDR + gInputFileBufferSize);
+        free(label->name);
+        if ((label->name = strdup(name)) == NULL)
+            fatal_error("failed to alloc space for labels. ");
     }
-    else
-        printf("\t@ 0x%08X\n", endaddr);
+
+    FreeLabels(st);
+    for (int i = 0; i < st->residentConfigCount; i++)
+    {
+        char *configName = NULL;
+
+        if (st->residentConfig[i].name != NULL && (configName = strdup(st->residentConfig[i].name)) == NULL)
+            fatal_error("failed to alloc space for labels. ");
+        disasm_add_label(disasm, st->residentConfig[i].addr, st->residentConfig[i].type, configName, true);
+    }
+    resident_analyze(st);
+    out_printf(st, "analyzed again: %d labels in %.3f s\n", st->labelsCount, wall_time() - startTime);
+    return true;
 }
 
-void disasm_disassemble(void)
+// Names the label at addr, now and after analyzing again.
+bool disasm_query_rename(struct NdsDisasm *disasm, uint32_t addr, const char *name)
 {
-    // initialize capstone
-    if (cs_open(CS_ARCH_ARM, CS_MODE_ARM, &sCapstone) != CS_ERR_OK)
+    struct DisasmState *st = disasm->disasm;
+    struct ResidentLabel *rename = NULL;
+    int i = label_hash_find(st, addr);
+
+    if (i == -1)
     {
-        puts("cs_open failed");
-        return;
+        out_printf(st, "no label at 0x%08X\n", addr);
+        return false;
     }
-    cs_option(sCapstone, CS_OPT_DETAIL, CS_OPT_ON);
+    for (int r = 0; r < st->renamesCount; r++)
+        if (st->renames[r].addr == addr)
+            rename = &st->renames[r];
+    if (rename == NULL)
+    {
+        st->renames = realloc(st->renames, (st->renamesCount + 1) * sizeof(*st->renames));
+        if (st->renames == NULL)
+            fatal_error("failed to alloc space for labels. ");
+        rename = &st->renames[st->renamesCount++];
+        rename->addr = addr;
+        rename->name = NULL;
+    }
+    free(rename->name);
+    free(st->labels[i].name);
+    rename->name = strdup(name);
+    st->labels[i].name = strdup(name);
+    if (rename->name == NULL || st->labels[i].name == NULL)
+        fatal_error("failed to alloc space for labels. ");
+    name_hash_rebuild(st);
+    resident_print_label(st, &st->labels[i]);
+    out_printf(st, "\n");
+    return true;
+}
+
+// State
+
+// Sets up the state of disasm. Returns false if there isn't the memory for it.
+bool disasm_init(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = calloc(1, sizeof(*st));
+
+    if (st == NULL)
+        return false;
+    disasm->disasm = st;
+    st->disasm = disasm;
+    st->tracing = -1;
+    st->sinkFd = -1;
+    pthread_mutex_init(&st->sinkLock, NULL);
+    pthread_cond_init(&st->sinkCond, NULL);
+    pthread_mutex_init(&st->workersLock, NULL);
+    pthread_cond_init(&st->batchStart, NULL);
+    pthread_cond_init(&st->batchDone, NULL);
+    pthread_mutex_init(&st->blobsLock, NULL);
+    return true;
+}
+
+// Frees the state of disasm, wherever it got to. Statistics are only
+// printed if it didn't fail on the way.
+void disasm_free(struct NdsDisasm *disasm)
+{
+    struct DisasmState *st = disasm->disasm;
 
-    analyze();
-    print_disassembly();
-    FreeLabels();
+    if (st == NULL)
+        return;
+    if (disasm->failed)
+        disasm->options.printStatistics = false;
+    sink_stop(st);
+    split_free(st);
+    print_chunks_free(st);
+    blobs_free(st);
+    window_free(st);
+    coverage_free(st);
+    free(st->config);
+    free(st->restored);
+    free(st->restoredCoverage);
+    analysis_restore_free(st);
+    resident_free(st);
+    free(st->emitText.data);
+    disasm_close(st);
+    pthread_mutex_destroy(&st->sinkLock);
+    pthread_cond_destroy(&st->sinkCond);
+    pthread_mutex_destroy(&st->workersLock);
+    pthread_cond_destroy(&st->batchStart);
+    pthread_cond_destroy(&st->batchDone);
+    pthread_mutex_destroy(&st->blobsLock);
+    free(st);
+    disasm->disasm = NULL;
+}
+
+// Forgets what the current thread was printing for a disassembly, when a call
+// into the library starts or ends.
+void disasm_thread_reset(void)
+{
+    sOut = NULL;
+    sErr = NULL;
+    sLineLength = 0;
+    sLineDiscard = false;
 }
@@ -0,0 +1,240 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ndsdisasm.h"
+
+// ELF32 relocatable object writer. The module goes into .text as it is, to be
+// linked at romLoadAddr, and symbols are relative to its start. There are no
+// relocations: every address in the module is already resolved.
+
+#define ET_REL          1
+#define EM_ARM          40
+#define EF_ARM_EABI_VER5 0x05000000
+
+#define SHT_PROGBITS    1
+#define SHT_SYMTAB      2
+#define SHT_STRTAB      3
+#define SHF_ALLOC       0x2
+#define SHF_EXECINSTR   0x4
+
+#define STB_LOCAL       0
+#define STB_GLOBAL      1
+#define STT_NOTYPE      0
+#define STT_OBJECT      1
+#define STT_FUNC        2
+#define STT_SECTION     3
+
+#define ELF_HEADER_SIZE     52
+#define SECTION_HEADER_SIZE 40
+#define SYMBOL_SIZE         16
+
+enum
+{
+    SECTION_NULL,
+    SECTION_TEXT,
+    SECTION_SYMTAB,
+    SECTION_STRTAB,
+    SECTION_SHSTRTAB,
+    SECTION_COUNT,
+};
+
+// Running out of memory only marks the buffer failed, for elf_write to fail
+// once it has freed everything.
+struct ElfBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t bufferSize;
+    bool failed;
+};
+
+static bool elf_reserve(struct ElfBuffer *buffer, size_t size)
+{
+    while (!buffer->failed && buffer->size + size > buffer->bufferSize)
+    {
+        size_t bufferSize = buffer->bufferSize ? 2 * buffer->bufferSize : 0x1000;
+        uint8_t *grown = realloc(buffer->data, bufferSize);
+
+        if (grown == NULL)
+            buffer->failed = true;
+        else
+        {
+            buffer->data = grown;
+            buffer->bufferSize = bufferSize;
+        }
+    }
+    return !buffer->failed;
+}
+
+static void elf_put(struct ElfBuffer *buffer, const void *data, size_t size)
+{
+    if (!elf_reserve(buffer, size))
+        return;
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void elf_put8(struct ElfBuffer *buffer, uint8_t value)
+{
+    elf_put(buffer, &value, 1);
+}
+
+static void elf_put16(struct ElfBuffer *buffer, uint16_t value)
+{
+    uint8_t bytes[2] = {value, value >> 8};
+
+    elf_put(buffer, bytes, 2);
+}
+
+static void elf_put32(struct ElfBuffer *buffer, uint32_t value)
+{
+    uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+
+    elf_put(buffer, bytes, 4);
+}
+
+static uint32_t elf_string(struct ElfBuffer *strtab, const char *s)
+{
+    uint32_t offset = strtab->size;
+
+    elf_put(strtab, s, strlen(s) + 1);
+    return offset;
+}
+
+static void elf_symbol(struct ElfBuffer *symtab, uint32_t name, uint32_t value, uint32_t size, int bind, int type, uint16_t section)
+{
+    elf_put32(symtab, name);
+    elf_put32(symtab, value);
+    elf_put32(symtab, size);
+    elf_put8(symtab, (bind << 4) | type);
+    elf_put8(symtab, 0);
+    elf_put16(symtab, section);
+}
+
+static void elf_section_header(struct ElfBuffer *out, uint32_t name, uint32_t type, uint32_t flags,
+                               uint32_t offset, uint32_t size, uint32_t link, uint32_t info, uint32_t align, uint32_t entsize)
+{
+    elf_put32(out, name);
+    elf_put32(out, type);
+    elf_put32(out, flags);
+    elf_put32(out, 0); // addr
+    elf_put32(out, offset);
+    elf_put32(out, size);
+    elf_put32(out, link);
+    elf_put32(out, info);
+    elf_put32(out, align);
+    elf_put32(out, entsize);
+}
+
+// Symbols come in address order. Local symbols go first, as ELF requires,
+// along with a $a, $t or $d mapping symbol wherever the kind of bytes changes.
+// Returns false if it ran out of memory or couldn't write the file, having
+// freed what it allocated either way.
+bool elf_write(struct NdsDisasm *disasm, const char *fileName, const struct ElfSymbol *symbols, int count)
+{
+    struct ElfBuffer out = {0}, symtab = {0}, strtab = {0}, shstrtab = {0};
+    uint32_t shName[SECTION_COUNT] = {0};
+    uint32_t firstGlobal, symtabOffset, strtabOffset, shstrtabOffset, sectionsOffset;
+    char mapping = 0;
+    FILE *file;
+    bool written;
+
+    elf_string(&strtab, "");
+    elf_symbol(&symtab, 0, 0, 0, STB_LOCAL, STT_NOTYPE, 0);
+    elf_symbol(&symtab, 0, 0, 0, STB_LOCAL, STT_SECTION, SECTION_TEXT);
+    for (int i = 0; i < count; i++)
+    {
+        const struct ElfSymbol *symbol = &symbols[i];
+        uint32_t value = symbol->addr - disasm->romLoadAddr;
+
+        if (symbol->mapping != mapping)
+        {
+            char name[3] = {'$', symbol->mapping, 0};
+
+            elf_symbol(&symtab, elf_string(&strtab, name), value, 0, STB_LOCAL, STT_NOTYPE, SECTION_TEXT);
+            mapping = symbol->mapping;
+        }
+        if (symbol->name != NULL && !symbol->global)
+            elf_symbol(&symtab, elf_string(&strtab, symbol->name), value, symbol->size, STB_LOCAL, STT_NOTYPE, SECTION_TEXT);
+    }
+    firstGlobal = symtab.size / SYMBOL_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        const struct ElfSymbol *symbol = &symbols[i];
+        uint32_t value = symbol->addr - disasm->romLoadAddr;
+
+        if (symbol->name == NULL || !symbol->global)
+            continue;
+        // Thumb functions have the low bit set
+        if (symbol->function && symbol->mapping == 't')
+            value |= 1;
+        elf_symbol(&symtab, elf_string(&strtab, symbol->name), value, symbol->size,
+                   STB_GLOBAL, symbol->function ? STT_FUNC : STT_OBJECT, SECTION_TEXT);
+    }
+
+    elf_string(&shstrtab, "");
+    shName[SECTION_TEXT] = elf_string(&shstrtab, ".text");
+    shName[SECTION_SYMTAB] = elf_string(&shstrtab, ".symtab");
+    shName[SECTION_STRTAB] = elf_string(&shstrtab, ".strtab");
+    shName[SECTION_SHSTRTAB] = elf_string(&shstrtab, ".shstrtab");
+
+    // header, then .text, the tables and the section headers, each 4 byte aligned
+    symtabOffset = ELF_HEADER_SIZE + ((disasm->inputFileBufferSize + 3) & ~3);
+    strtabOffset = symtabOffset + symtab.size;
+    shstrtabOffset = strtabOffset + strtab.size;
+    sectionsOffset = (shstrtabOffset + shstrtab.size + 3) & ~3;
+
+    elf_put(&out, "\x7F" "ELF", 4);
+    elf_put8(&out, 1); // 32 bit
+    elf_put8(&out, 1); // little endian
+    elf_put8(&out, 1); // version
+    elf_put(&out, "\0\0\0\0\0\0\0\0\0", 9);
+    elf_put16(&out, ET_REL);
+    elf_put16(&out, EM_ARM);
+    elf_put32(&out, 1); // version
+    elf_put32(&out, 0); // entry
+    elf_put32(&out, 0); // program headers
+    elf_put32(&out, sectionsOffset);
+    elf_put32(&out, EF_ARM_EABI_VER5);
+    elf_put16(&out, ELF_HEADER_SIZE);
+    elf_put16(&out, 0);
+    elf_put16(&out, 0);
+    elf_put16(&out, SECTION_HEADER_SIZE);
+    elf_put16(&out, SECTION_COUNT);
+    elf_put16(&out, SECTION_SHSTRTAB);
+
+    elf_put(&out, disasm->inputFileBuffer, disasm->inputFileBufferSize);
+    elf_put(&out, "\0\0\0", symtabOffset - out.size);
+    elf_put(&out, symtab.data, symtab.size);
+    elf_put(&out, strtab.data, strtab.size);
+    elf_put(&out, shstrtab.data, shstrtab.size);
+    elf_put(&out, "\0\0\0", sectionsOffset - out.size);
+
+    elf_section_header(&out, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    elf_section_header(&out, shName[SECTION_TEXT], SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                       ELF_HEADER_SIZE, disasm->inputFileBufferSize, 0, 0, 4, 0);
+    elf_section_header(&out, shName[SECTION_SYMTAB], SHT_SYMTAB, 0,
+                       symtabOffset, symtab.size, SECTION_STRTAB, firstGlobal, 4, SYMBOL_SIZE);
+    elf_section_header(&out, shName[SECTION_STRTAB], SHT_STRTAB, 0,
+                       strtabOffset, strtab.size, 0, 0, 1, 0);
+    elf_section_header(&out, shName[SECTION_SHSTRTAB], SHT_STRTAB, 0,
+                       shstrtabOffset, shstrtab.size, 0, 0, 1, 0);
+
+    written = !out.failed && !symtab.failed && !strtab.failed && !shstrtab.failed
+           && (file = fopen(fileName, "wb")) != NULL;
+    if (written)
+    {
+        written = fwrite(out.data, 1, out.size, file) == out.size;
+        if (fclose(file) != 0)
+            written = false;
+    }
+    free(out.data);
+    free(symtab.data);
+    free(strtab.data);
+    free(shstrtab.data);
+    return written;
+}
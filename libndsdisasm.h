@@ -0,0 +1,88 @@
+#ifndef LIBNDSDISASM_H
+#define LIBNDSDISASM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NDSDISASM_VERMAJ    1
+#define NDSDISASM_VERMIN    0
+#define NDSDISASM_VERSTP    5
+
+// libndsdisasm: the disassembler as a library. Everything a disassembly keeps
+// is in its context, so any number of them can run in one process, each on
+// one thread at a time. Functions that can fail return false and leave a
+// message for ndsdisasm_error instead of exiting. A context that failed can
+// only be destroyed.
+//
+// A module is disassembled by creating a context with the options for it,
+// loading it from the ROM, adding the labels from the config, analyzing it
+// and emitting the disassembly, to the files the options name or to memory.
+
+// What ndsdisasm's command line options set. Strings aren't copied, and have
+// to stay around as long as the context does.
+struct NdsDisasmOptions
+{
+    bool isArm7;                    // -7
+    int overlay;                    // -m, or -1
+    int autoload;                   // -a, or -1
+    bool raw;                       // -O: the whole file is the module, at address 0
+    bool dumpUnDisassembled;        // -d
+    bool analyzeInAddressOrder;     // -A
+    bool printStatistics;           // -s, to stderr
+    bool verifyDecoder;             // -V
+    bool capstoneOnly;              // -F: no fast path decoder, as a baseline
+    int printThreads;               // -j: threads formatting the output
+    const char *outputFileName;     // -o, or NULL for stdout
+    uint32_t blobThreshold;         // -B, or 0
+    const char *splitDirectory;     // -S
+    uint32_t splitRange;            // -Sr
+    const char *elfFileName;        // -e
+    const char *cacheDirectory;     // -C
+    const char *symbolIndexFile;    // -x
+    const char *analysisDirectory;  // -R
+    const char *uncompressedFileName; // -Du
+};
+
+struct NdsDisasm;
+
+// Sets the options to the defaults: the ARM9 static module, on one thread,
+// printed to stdout.
+void ndsdisasm_options_init(struct NdsDisasmOptions *options);
+
+// Returns NULL if there isn't the memory for it.
+struct NdsDisasm *ndsdisasm_create(const struct NdsDisasmOptions *options);
+void ndsdisasm_destroy(struct NdsDisasm *disasm);
+const char *ndsdisasm_error(const struct NdsDisasm *disasm);
+
+// Loads the module the options pick out of the ROM, decompressing it if it
+// has to be, and writes it out with uncompressedFileName.
+bool ndsdisasm_load(struct NdsDisasm *disasm, const char *romFileName);
+// Adds the labels and prefixes of a config file, those of the module's
+// section and of none.
+bool ndsdisasm_load_config(struct NdsDisasm *disasm, const char *configFileName);
+bool ndsdisasm_analyze(struct NdsDisasm *disasm);
+// Writes the disassembly where the options say, along with the blobs and the
+// ELF object they ask for.
+bool ndsdisasm_emit(struct NdsDisasm *disasm);
+// Returns the disassembly in *text, which the caller frees. Blobs and the ELF
+// object are written as with ndsdisasm_emit, and split output isn't supported.
+bool ndsdisasm_emit_buffer(struct NdsDisasm *disasm, char **text, size_t *size);
+
+// Disassembles every module of the ROM into directory, jobs at a time, or one
+// per CPU if jobs is 0, each in a context of its own with the config section
+// named after it. The options' module, output, split output, ELF object,
+// uncompressed module and print threads are ignored. With symbolIndexFile, a
+// first pass builds the symbol index the second one names references to other
+// modules with. Failures are reported on stderr.
+bool ndsdisasm_batch(const struct NdsDisasmOptions *options, const char *romFileName,
+                     const char *configFileName, const char *directory, int jobs);
+
+// Analyzes the loaded module and answers queries about it on a Unix socket
+// until a client sends quit, instead of ndsdisasm_analyze and ndsdisasm_emit.
+bool ndsdisasm_serve(struct NdsDisasm *disasm, const char *socketPath);
+// Sends a request to the server on socketPath and prints the reply, to stdout
+// if it went through and to stderr if it didn't. Returns the exit code.
+int ndsdisasm_query(const char *socketPath, const char *request);
+
+#endif
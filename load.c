@@ -0,0 +1,1107 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <capstone.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ndsdisasm.h"
+
+struct ConfigLabel
+{
+    uint32_t addr;
+    uint8_t type;
+    const char *label;
+};
+
+#define READ32(p) ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((p)[3] << 24))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+// Static modules stay loaded, since autoloads are cut out of them.
+struct StaticModule
+{
+    bool loaded;
+    uint8_t *buffer;
+    size_t size;
+    uint32_t romStart;
+    uint32_t ramStart;
+    uint32_t compressedStaticEnd;
+    uint32_t moduleParams;  // _start_ModuleParams, 0 if it wasn't found
+    uint8_t *copy;          // what buffer was allocated or mapped as, see input_free
+    uint8_t *cacheFile;
+    size_t cacheFileSize;
+};
+
+struct LoadState
+{
+    // The ROM is mapped once and every header field is read from the mapping.
+    // Modules that aren't compressed are used in place, so inputFileBuffer is
+    // only allocated when there is something to decompress. Windows reads the
+    // whole file instead.
+    const char *romName;
+    uint8_t *rom;
+    size_t romSize;
+    uint8_t *inputCopy;        // inputFileBuffer's allocation, NULL if it's mapped
+    uint8_t *cacheFile;        // the mapped cache file inputFileBuffer points into
+    size_t cacheFileSize;
+    uint64_t cacheKey;
+    char cachePath[1024];
+    uint32_t romStart;
+    uint32_t ramStart;
+    uint32_t compressedStaticEnd;
+    struct StaticModule statics[2];
+    bool shared;               // the ROM and the static modules belong to another disassembly
+    char moduleName[32];       // of the module being disassembled, for config sections
+    bool functionPrefixOverridden;
+    bool dataPrefixOverridden;
+    char *configText;          // the config read_config is parsing
+};
+
+
+#ifdef _WIN32
+#define ROM_WILLNEED    0
+#define ROM_SEQUENTIAL  0
+#else
+#define ROM_WILLNEED    MADV_WILLNEED
+#define ROM_SEQUENTIAL  MADV_SEQUENTIAL
+#endif
+
+// Backward LZ, as decompressed by MIi_UncompressBackwards. The compressed
+// image ends at compressedEnd with an 8 byte footer: the compressed length
+// (low 24 bits) and header length (high 8 bits), then how much longer the
+// decompressed image is. Decoding runs backwards, in place, from the end of
+// the header down to the start of the compressed data.
+struct CompressedFooter
+{
+    uint32_t start;     // where the compressed data starts
+    uint32_t end;       // where the compressed data ends, below the header
+    uint32_t destEnd;   // where the decompressed image ends
+};
+
+// Checks the footer of the module in buffer and returns how big the buffer has
+// to be to decompress it.
+static uint32_t compressed_footer(struct NdsDisasm *disasm, const uint8_t *buffer, uint32_t size, uint32_t compressedEnd, struct CompressedFooter *footer)
+{
+    uint32_t lengths, extra, length, headerLength;
+
+    if (compressedEnd < 8 || compressedEnd > size)
+        fatal_error("compressed module end 0x%08X is outside the module", compressedEnd + disasm->load->ramStart);
+    lengths = READ32(buffer + compressedEnd - 8);
+    extra = READ32(buffer + compressedEnd - 4);
+    length = lengths & 0xFFFFFF;
+    headerLength = lengths >> 24;
+    if (headerLength < 8 || headerLength > length || length > compressedEnd)
+        fatal_error("compressed module has a bad footer (length 0x%X, header 0x%X)", length, headerLength);
+    if (extra > UINT32_MAX - compressedEnd)
+        fatal_error("compressed module has a bad footer (grows by 0x%X)", extra);
+    footer->start = compressedEnd - length;
+    footer->end = compressedEnd - headerLength;
+    footer->destEnd = compressedEnd + extra;
+    return max(footer->destEnd, size);
+}
+
+// Decompresses in place. buffer must be as big as compressed_footer said. The
+// stream is checked as it goes, so a corrupt one fails instead of writing
+// over the input it hasn't read yet or reading outside the buffer.
+static void uncompress_backwards(struct NdsDisasm *disasm, uint8_t *buffer, const struct CompressedFooter *footer)
+{
+    uint8_t *start = buffer + footer->start;
+    uint8_t *end = buffer + footer->end;
+    uint8_t *dest = buffer + footer->destEnd;
+    uint8_t *destEnd = dest;
+
+    while (end > start)
+    {
+        unsigned int flags = *--end << 24;
+        unsigned int bits = 8;
+
+        while (bits > 0 && end > start)
+        {
+            if ((flags & 0x80000000) == 0)
+            {
+                // a run of literals is one backwards copy, and since dest
+                // never drops below end it can't overwrite unread input
+                unsigned int run = flags == 0 ? bits : min((unsigned int)__builtin_clz(flags), bits);
+
+                run = min(run, (unsigned int)(end - start));
+                end -= run;
+                dest -= run;
+                memmove(dest, end, run);
+                flags <<= run;
+                bits -= run;
+                continue;
+            }
+            if (end - start < 2)
+                fatal_error("compressed module ends in the middle of a reference");
+            end -= 2;
+            unsigned int length = (end[1] >> 4) + 3;
+            unsigned int distance = (((end[1] & 0xF) << 8) | end[0]) + 3;
+            if (distance > (unsigned int)(destEnd - dest))
+                fatal_error("compressed module refers past the end of its output at 0x%08X",
+                            (uint32_t)(dest - buffer) + disasm->load->ramStart);
+            if ((size_t)(dest - end) < length)
+                fatal_error("compressed module output overruns its input at 0x%08X",
+                            (uint32_t)(dest - buffer) + disasm->load->ramStart);
+            dest -= length;
+            if (distance >= length)
+            {
+                memcpy(dest, dest + distance, length);
+            }
+            else
+            {
+                // the copy overlaps itself and repeats the last distance bytes
+                for (unsigned int i = length; i-- > 0; )
+                    dest[i] = dest[i + distance];
+            }
+            flags <<= 1;
+            bits--;
+        }
+    }
+}
+
+// Transliteration of the ARM routine, which uncompress_backwards has to match.
+// It's only run by -V, to check and time the other.
+static void MIi_UncompressBackwards(uint8_t *buffer, uint32_t compressedEnd)
+{
+                                                                               //     stmfd sp!, {r4-r7}
+    // Read the pointer to the end of the compressed image
+    uint8_t * endptr = buffer + compressedEnd - 8;                             //     ldmdb r0, {r1, r2}
+    uint32_t size = READ32(endptr);
+    uint32_t offset = READ32(endptr + 4);
+    endptr += 8;
+    uint8_t * dest_p = endptr + offset;                                        //     add r2, r0, r2
+    uint8_t * end = endptr - ((uint8_t)(size >> 24));                          //     sub r3, r0, r1, lsr #24
+                                                                               //     bic r1, r1, #0xff000000
+    uint8_t * start = endptr - (size & ~0xFF000000);                           //     sub r1, r0, r1
+    // uint8_t * dest_end = dest_p;
+                                                                               //     mov r4, r2 ; not crucial
+                                                                               // @.loop:
+    while (end > start)                                                        //     cmp r3, r1
+    {                                                                          //     ble @.dc_flush
+        uint8_t r5 = *--end;                                                   //     ldrb r5, [r3, #-1]!
+                                                                               //     mov r6, #8
+                                                                               // @.byte_loop:
+        for (int i = 0; i < 8; i++)                                            //     subs r6, r6, #1
+        {                                                                      //     blt @.loop
+            if ((r5 & 0x80) == 0)                                              //     tst r5, #0x80
+            {                                                                  //     bne @.readback
+                                                                               //     ldrb r0, [r3, #-1]!
+                *--dest_p = *--end;                                            //     strb r0, [r2, #-1]!
+            }                                                                  //     b @.byte_after
+            else                                                               // @.readback:
+            {
+                int ip = *--end;                                               //     ldrb r12, [r3, #-1]!
+                int r7 = *--end;                                               //     ldrb r7, [r3, #-1]!
+                                                                               //     orr r7, r7, r12, lsl #8
+                                                                               //     bic r7, r7, #0xf000
+                r7 = ((r7 | (ip << 8)) & ~0xF000) + 2;                         //     add r7, r7, #0x0002
+                ip += 0x20;                                                    //     add r12, r12, #0x0020
+                while (ip >= 0)                                                // @.readback_loop:
+                {
+                    dest_p[-1] = dest_p[r7];                                   //     ldrb r0, [r2, r7]
+                    dest_p--;                                                  //     strb r0, [r2, -1]!
+                    ip -= 0x10;                                                //     subs r12, r12, #0x0010
+                }                                                              //     bge @.readback_loop
+            }                                                                  // @.byte_after:
+            if (end <= start)                                                  //     cmp r3, r1
+                break;                                                         //     mov r5, r5, lsl #1
+            r5 <<= 1;                                                          //     bgt @.byte_loop
+        }                                                                      // @.dc_flush:
+    }
+}
+
+// -V: checks uncompress_backwards against the ARM routine on this module and
+// times both.
+static void verify_uncompress(struct NdsDisasm *disasm, const uint8_t *module, uint32_t size, uint32_t bufferSize, const struct CompressedFooter *footer)
+{
+    uint8_t *fast = calloc(bufferSize, 1);
+    uint8_t *reference = calloc(bufferSize, 1);
+    double time, fastTime, referenceTime;
+    int fastRounds = 0, referenceRounds = 0, mismatches = 0;
+
+    if (fast == NULL || reference == NULL)
+    {
+        free(fast);
+        free(reference);
+        fatal_error("failed to alloc decompression buffers");
+    }
+    time = wall_time();
+    do
+    {
+        memcpy(fast, module, size);
+        uncompress_backwards(disasm, fast, footer);
+        fastRounds++;
+    } while ((fastTime = wall_time() - time) < 0.2);
+    time = wall_time();
+    do
+    {
+        memcpy(reference, module, size);
+        MIi_UncompressBackwards(reference, disasm->load->compressedStaticEnd - disasm->load->ramStart);
+        referenceRounds++;
+    } while ((referenceTime = wall_time() - time) < 0.2);
+    for (uint32_t i = 0; i < bufferSize; i++)
+        mismatches += fast[i] != reference[i];
+    fprintf(stderr, "verify: decompression: %d mismatched bytes, %.1f MB/s (reference %.1f MB/s)\n", mismatches,
+            fastRounds * (double)bufferSize / fastTime / 1e6, referenceRounds * (double)bufferSize / referenceTime / 1e6);
+    free(fast);
+    free(reference);
+}
+
+// Maps the whole of fileName read only, or on Windows reads it in.
+bool map_file(const char *fileName, uint8_t **data, size_t *size)
+{
+#ifdef _WIN32
+    FILE *file = fopen(fileName, "rb");
+
+    if (file == NULL)
+        return false;
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *data = malloc(max(*size, 1));
+    if (*data == NULL || fread(*data, 1, *size, file) != *size)
+    {
+        free(*data);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+#else
+    int fd = open(fileName, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    *size = st.st_size;
+    *data = NULL;
+    if (*size != 0)
+    {
+        *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+#endif
+    return true;
+}
+
+void unmap_file(uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    free(data);
+#else
+    if (data != NULL)
+        munmap(data, size);
+#endif
+}
+
+static void rom_open(struct NdsDisasm *disasm, const char *fname)
+{
+    disasm->load->romName = fname;
+    if (!map_file(fname, &disasm->load->rom, &disasm->load->romSize))
+        fatal_error("could not open input file '%s'", fname);
+}
+
+static void rom_close(struct NdsDisasm *disasm)
+{
+    if (!disasm->load->shared)
+        unmap_file(disasm->load->rom, disasm->load->romSize);
+    disasm->load->rom = NULL;
+    disasm->load->romSize = 0;
+}
+
+static void rom_advise(const uint8_t *data, size_t size, int advice)
+{
+#ifndef _WIN32
+    uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t start = (uintptr_t)data & ~pageMask;
+
+    if (size != 0)
+        madvise((void *)start, (uintptr_t)data + size - start, advice);
+#else
+    (void)data;
+    (void)size;
+    (void)advice;
+#endif
+}
+
+// Returns the size bytes at offset into the ROM, failing with message if the
+// file is too short.
+static const uint8_t *rom_view(struct NdsDisasm *disasm, uint32_t offset, uint32_t size, const char *message)
+{
+    if (offset > disasm->load->romSize || size > disasm->load->romSize - offset)
+        fatal_error("%s", message);
+    rom_advise(disasm->load->rom + offset, size, ROM_WILLNEED);
+    return disasm->load->rom + offset;
+}
+
+static uint32_t rom_read32(struct NdsDisasm *disasm, uint32_t offset, const char *message)
+{
+    return READ32(rom_view(disasm, offset, 4, message));
+}
+
+// Points inputFileBuffer at the inputFileBufferSize bytes at offset into the
+// ROM, copying them out only if they have to be decompressed.
+static void input_load(struct NdsDisasm *disasm, uint32_t offset)
+{
+    const uint8_t *module;
+
+    if (offset > disasm->load->romSize || disasm->inputFileBufferSize > disasm->load->romSize - offset)
+        fatal_error("failed to read from file '%s'", disasm->load->romName);
+    module = rom_view(disasm, offset, disasm->inputFileBufferSize, "");
+    // analysis jumps around, but everything gets printed front to back
+    rom_advise(module, disasm->inputFileBufferSize, ROM_SEQUENTIAL);
+    if (disasm->load->compressedStaticEnd == 0)
+    {
+        disasm->inputFileBuffer = (uint8_t *)module;
+        disasm->load->inputCopy = NULL;
+        return;
+    }
+    // the footer says how big the output is, so it's decompressed where it lands
+    struct CompressedFooter footer;
+    uint32_t size = compressed_footer(disasm, module, disasm->inputFileBufferSize, disasm->load->compressedStaticEnd - disasm->load->ramStart, &footer);
+    disasm->inputFileBuffer = malloc(size);
+    if (disasm->inputFileBuffer == NULL)
+        fatal_error("failed to alloc file buffer for '%s'", disasm->load->romName);
+    memcpy(disasm->inputFileBuffer, module, disasm->inputFileBufferSize);
+    memset(disasm->inputFileBuffer + disasm->inputFileBufferSize, 0, size - disasm->inputFileBufferSize);
+    disasm->load->inputCopy = disasm->inputFileBuffer;
+    if (disasm->options.verifyDecoder)
+        verify_uncompress(disasm, module, disasm->inputFileBufferSize, size, &footer);
+    uncompress_backwards(disasm, disasm->inputFileBuffer, &footer);
+    disasm->inputFileBufferSize = size;
+}
+
+// With -C, decompressed modules are kept in a cache directory, one file per
+// module named after a hash of its bytes in the ROM and of where they go. A
+// hit is mapped in place of the ROM, so there's nothing to find or decompress.
+#define CACHE_MAGIC         0x4353444E // "NDSC"
+#define CACHE_VERSION       1
+#define CACHE_HEADER_SIZE   0x40
+
+struct CacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t ramStart;
+    uint32_t compressedStaticEnd;
+    uint32_t moduleParams;  // _start_ModuleParams of a static module
+    uint32_t size;
+};
+
+// Looks up the module romStart, ramStart, inputFileBufferSize and
+// compressedStaticEnd describe. kind and id say which module it is and how
+// it was found.
+static bool cache_load(struct NdsDisasm *disasm, char kind, uint32_t id, uint32_t *moduleParams)
+{
+    const struct CacheHeader *header;
+    uint32_t key[8];
+
+    if (disasm->options.cacheDirectory == NULL)
+        return false;
+    if (disasm->load->romStart > disasm->load->romSize || disasm->inputFileBufferSize > disasm->load->romSize - disasm->load->romStart)
+        fatal_error("failed to read from file '%s'", disasm->load->romName);
+    key[0] = kind;
+    key[1] = id;
+    key[2] = disasm->options.isArm7;
+    key[3] = disasm->load->romStart;
+    key[4] = disasm->load->ramStart;
+    key[5] = disasm->inputFileBufferSize;
+    key[6] = disasm->load->compressedStaticEnd;
+    key[7] = CACHE_VERSION;
+    disasm->load->cacheKey = content_hash((const uint8_t *)key, sizeof(key)) ^ content_hash(disasm->load->rom + disasm->load->romStart, disasm->inputFileBufferSize);
+    snprintf(disasm->load->cachePath, sizeof(disasm->load->cachePath), "%s/%016llX.bin", disasm->options.cacheDirectory, (unsigned long long)disasm->load->cacheKey);
+
+    if (!map_file(disasm->load->cachePath, &disasm->load->cacheFile, &disasm->load->cacheFileSize))
+        return false;
+    header = (const struct CacheHeader *)disasm->load->cacheFile;
+    if (disasm->load->cacheFileSize < CACHE_HEADER_SIZE || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION
+     || header->key != disasm->load->cacheKey || header->size > disasm->load->cacheFileSize - CACHE_HEADER_SIZE)
+    {
+        // left behind by something else, it'll be replaced
+        unmap_file(disasm->load->cacheFile, disasm->load->cacheFileSize);
+        disasm->load->cacheFile = NULL;
+        return false;
+    }
+    disasm->load->ramStart = header->ramStart;
+    disasm->load->compressedStaticEnd = header->compressedStaticEnd;
+    if (moduleParams != NULL)
+        *moduleParams = header->moduleParams;
+    disasm->inputFileBuffer = disasm->load->cacheFile + CACHE_HEADER_SIZE;
+    disasm->inputFileBufferSize = header->size;
+    disasm->load->inputCopy = NULL;
+    rom_advise(disasm->inputFileBuffer, disasm->inputFileBufferSize, ROM_SEQUENTIAL);
+    return true;
+}
+
+// Writes header and data to path, creating directory first if needed. Runs
+// may share the directory, so the file is written under a temporary name and
+// renamed into place. Failing only warns: the file just saves work.
+bool file_replace(const char *directory, const char *path, const void *header, size_t headerSize, const void *data, size_t size)
+{
+    char tempPath[1040];
+    FILE *file;
+    bool written;
+
+#ifdef _WIN32
+    if (_mkdir(directory) != 0 && errno != EEXIST)
+#else
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST)
+#endif
+    {
+        fprintf(stderr, "warning: failed to create directory %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+#ifdef _WIN32
+    snprintf(tempPath, sizeof(tempPath), "%s.%d", path, _getpid());
+#else
+    snprintf(tempPath, sizeof(tempPath), "%s.%d", path, (int)getpid());
+#endif
+    file = fopen(tempPath, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "warning: failed to write %s\n", tempPath);
+        return false;
+    }
+    written = fwrite(header, 1, headerSize, file) == headerSize
+           && fwrite(data, 1, size, file) == size;
+    if (fclose(file) != 0 || !written)
+    {
+        fprintf(stderr, "warning: failed to write %s\n", tempPath);
+        remove(tempPath);
+        return false;
+    }
+#ifdef _WIN32
+    // rename doesn't replace files here, and an existing one is as good
+    if (rename(tempPath, path) != 0)
+        remove(tempPath);
+#else
+    if (rename(tempPath, path) != 0)
+    {
+        fprintf(stderr, "warning: failed to write %s: %s\n", path, strerror(errno));
+        remove(tempPath);
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Saves the module cache_load just missed.
+static void cache_store(struct NdsDisasm *disasm, uint32_t moduleParams)
+{
+    struct CacheHeader header = {0};
+    uint8_t block[CACHE_HEADER_SIZE] = {0};
+
+    if (disasm->options.cacheDirectory == NULL)
+        return;
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.key = disasm->load->cacheKey;
+    header.ramStart = disasm->load->ramStart;
+    header.compressedStaticEnd = disasm->load->compressedStaticEnd;
+    header.moduleParams = moduleParams;
+    header.size = disasm->inputFileBufferSize;
+    memcpy(block, &header, sizeof(header));
+    file_replace(disasm->options.cacheDirectory, disasm->load->cachePath, block, sizeof(block), disasm->inputFileBuffer, disasm->inputFileBufferSize);
+}
+
+static void input_free(struct NdsDisasm *disasm)
+{
+    if (disasm->load->cacheFile != NULL)
+        unmap_file(disasm->load->cacheFile, disasm->load->cacheFileSize);
+    else
+        free(disasm->load->inputCopy);
+    disasm->load->cacheFile = NULL;
+    disasm->load->inputCopy = NULL;
+    for (int arm7 = 0; arm7 < 2 && !disasm->load->shared; arm7++)
+    {
+        struct StaticModule *st = &disasm->load->statics[arm7];
+
+        if (st->cacheFile != NULL)
+            unmap_file(st->cacheFile, st->cacheFileSize);
+        else
+            free(st->copy);
+    }
+    memset(disasm->load->statics, 0, sizeof(disasm->load->statics));
+    disasm->inputFileBuffer = NULL;
+    rom_close(disasm);
+}
+
+static uint32_t FindUncompressCall(struct NdsDisasm *disasm, uint32_t entry)
+{
+    const uint8_t *code = rom_view(disasm, entry - disasm->load->ramStart + disasm->load->romStart, 0x1000, "read code");
+    uint32_t moduleParams = 0;
+
+    csh cap;
+    cs_insn * insn;
+    if (cs_open(CS_ARCH_ARM, CS_MODE_ARM, &cap) != CS_ERR_OK)
+        fatal_error("cs_open failed");
+    cs_option(cap, CS_OPT_DETAIL, CS_OPT_ON);
+    int count;
+    int offset = 0;
+    do {
+        count = cs_disasm(cap, code + offset, 0x1000 - offset, entry + offset, 0x1000, &insn);
+        if (count < 4)
+        {
+            if (count > 0)
+                cs_free(insn, count);
+            offset += 4 * (count + 1);
+            continue;
+        }
+        for (int i = 0; i < count - 4; i++)
+        {
+            cs_insn *cur_insn = &insn[i];
+            if (
+                // ldr rX, [pc, #YYY]
+                cur_insn[0].id == ARM_INS_LDR
+                && cur_insn[0].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[0].detail->arm.operands[1].mem.base == ARM_REG_PC
+                // ldr r0, [rX, #20]
+                && cur_insn[1].id == ARM_INS_LDR
+                && cur_insn[1].detail->arm.operands[0].reg == ARM_REG_R0
+                && cur_insn[1].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[1].detail->arm.operands[1].mem.base == (arm_reg) cur_insn[0].detail->arm.operands[0].reg
+                && cur_insn[1].detail->arm.operands[1].mem.disp == 20
+                // bl MIi_UncompressBackwards
+                && cur_insn[2].id == ARM_INS_BL
+                )
+            {
+                uint32_t pool_addr = cur_insn[0].address + cur_insn[0].detail->arm.operands[1].mem.disp + 8;
+                uint32_t _start_ModuleParams_off = READ32(&code[pool_addr - entry]);
+                disasm->load->compressedStaticEnd = READ32(&code[_start_ModuleParams_off - entry + 20]);
+                moduleParams = _start_ModuleParams_off;
+                break;
+            }
+            else if (
+                // ldr r0, =_start_ModuleParams
+                cur_insn[0].id == ARM_INS_LDR
+                && cur_insn[0].detail->arm.operands[0].reg == ARM_REG_R0
+                && cur_insn[0].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[0].detail->arm.operands[1].mem.base == ARM_REG_PC
+                // ldr r1, [r0]
+                && cur_insn[1].id == ARM_INS_LDR
+                && cur_insn[1].detail->arm.operands[0].reg == ARM_REG_R1
+                && cur_insn[1].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[1].detail->arm.operands[1].mem.base == ARM_REG_R0
+                && cur_insn[1].detail->arm.operands[1].mem.disp == 0
+                // ldr r2, [r0, #4]
+                && cur_insn[2].id == ARM_INS_LDR
+                && cur_insn[2].detail->arm.operands[0].reg == ARM_REG_R2
+                && cur_insn[2].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[2].detail->arm.operands[1].mem.base == ARM_REG_R0
+                && cur_insn[2].detail->arm.operands[1].mem.disp == 4
+                // ldr r3, [r0, #8]
+                && cur_insn[3].id == ARM_INS_LDR
+                && cur_insn[3].detail->arm.operands[0].reg == ARM_REG_R3
+                && cur_insn[3].detail->arm.operands[1].type == ARM_OP_MEM
+                && cur_insn[3].detail->arm.operands[1].mem.base == ARM_REG_R0
+                && cur_insn[3].detail->arm.operands[1].mem.disp == 8
+                )
+            {
+                uint32_t pool_addr = cur_insn[0].address + cur_insn[0].detail->arm.operands[1].mem.disp + 8;
+                moduleParams = READ32(&code[pool_addr - entry]);
+                break;
+            }
+        }
+        offset = insn[count - 1].address + insn[count - 1].size - entry;
+        cs_free(insn, count);
+    } while (offset < 0x800 && moduleParams == 0);
+    cs_close(&cap);
+    return moduleParams;
+}
+
+static void module_static(struct NdsDisasm *disasm, struct Module *module, bool arm7)
+{
+    memset(module, 0, sizeof(*module));
+    snprintf(module->name, sizeof(module->name), "arm%d", arm7 ? 7 : 9);
+    module->isArm7 = arm7;
+    module->overlay = -1;
+    module->autoload = -1;
+    module->romStart = rom_read32(disasm, 0x20 + 0x10 * arm7, "read gRomStart");
+    module->entry = rom_read32(disasm, 0x24 + 0x10 * arm7, "read entry");
+    module->ramStart = rom_read32(disasm, 0x28 + 0x10 * arm7, "read gRamStart");
+    module->size = rom_read32(disasm, 0x2C + 0x10 * arm7, "read gInputFileBufferSize");
+}
+
+static int overlay_count(struct NdsDisasm *disasm, bool arm7)
+{
+    return rom_read32(disasm, 0x54 + 8 * arm7, "read ovy_size") / 32;
+}
+
+static void module_overlay(struct NdsDisasm *disasm, struct Module *module, bool arm7, int index)
+{
+    uint32_t fat_offset, ovy_offset, ovy_size, ovy_entry, ovyfile, reserved;
+
+    memset(module, 0, sizeof(*module));
+    snprintf(module->name, sizeof(module->name), "overlay%d_%d", arm7 ? 7 : 9, index);
+    module->isArm7 = arm7;
+    module->overlay = index;
+    module->autoload = -1;
+    fat_offset = rom_read32(disasm, 0x48, "read fat_offset");
+    rom_read32(disasm, 0x4C, "read fat_size");
+    ovy_offset = rom_read32(disasm, 0x50 + 8 * arm7, "read ovy_offset");
+    ovy_size = rom_read32(disasm, 0x54 + 8 * arm7, "read ovy_size");
+    if (index * 32u > ovy_size)
+        fatal_error("Argument to -m is out of range for ARM%d target", arm7 ? 7 : 9);
+    ovy_entry = ovy_offset + index * 32;
+    module->ramStart = rom_read32(disasm, ovy_entry + 4, "read gRamStart");
+    module->size = rom_read32(disasm, ovy_entry + 8, "read gInputFileBufferSize");
+    // bss_size, sinit_start, sinit_end
+    ovyfile = rom_read32(disasm, ovy_entry + 24, "read ovyfile");
+    reserved = rom_read32(disasm, ovy_entry + 28, "read reserved");
+    module->romStart = rom_read32(disasm, fat_offset + ovyfile * 8, "read gRomStart");
+    if ((reserved >> 24) & 1) {
+        module->compressedStaticEnd = module->ramStart + (reserved & 0xFFFFFF);
+    }
+}
+
+// Loads the ARM9 or ARM7 static module, once.
+static const struct StaticModule *static_load(struct NdsDisasm *disasm, bool arm7)
+{
+    struct StaticModule *st = &disasm->load->statics[arm7];
+    struct Module module;
+
+    if (st->loaded)
+        return st;
+    module_static(disasm, &module, arm7);
+    disasm->load->romStart = module.romStart;
+    disasm->load->ramStart = module.ramStart;
+    disasm->inputFileBufferSize = module.size;
+    disasm->load->compressedStaticEnd = 0;
+    // the entry point is where FindUncompressCall starts looking
+    if (!cache_load(disasm, 's', module.entry, &st->moduleParams))
+    {
+        st->moduleParams = FindUncompressCall(disasm, module.entry);
+        input_load(disasm, disasm->load->romStart);
+        cache_store(disasm, st->moduleParams);
+    }
+    st->loaded = true;
+    st->buffer = disasm->inputFileBuffer;
+    st->size = disasm->inputFileBufferSize;
+    st->romStart = module.romStart;
+    st->ramStart = module.ramStart;
+    st->compressedStaticEnd = disasm->load->compressedStaticEnd;
+    // it's the static module's to free now
+    st->copy = disasm->load->inputCopy;
+    st->cacheFile = disasm->load->cacheFile;
+    st->cacheFileSize = disasm->load->cacheFileSize;
+    disasm->load->inputCopy = NULL;
+    disasm->load->cacheFile = NULL;
+    return st;
+}
+
+static uint32_t static_read32(const struct StaticModule *st, uint32_t addr)
+{
+    if (addr - st->ramStart > st->size || st->size - (addr - st->ramStart) < 4)
+        fatal_error("autoload table at 0x%08X is outside the static module", addr);
+    return READ32(st->buffer + addr - st->ramStart);
+}
+
+static int autoload_count(struct NdsDisasm *disasm, bool arm7)
+{
+    const struct StaticModule *st = static_load(disasm, arm7);
+    uint32_t autoload_start, autoload_end;
+
+    if (st->moduleParams == 0)
+        return 0;
+    autoload_start = static_read32(st, st->moduleParams);
+    autoload_end = static_read32(st, st->moduleParams + 4);
+    return (autoload_end - autoload_start) / 12;
+}
+
+static void module_autoload(struct NdsDisasm *disasm, struct Module *module, bool arm7, int index)
+{
+    const struct StaticModule *st = static_load(disasm, arm7);
+    uint32_t autoload_start, first_autoload;
+
+    memset(module, 0, sizeof(*module));
+    snprintf(module->name, sizeof(module->name), "autoload%d_%d", arm7 ? 7 : 9, index);
+    module->isArm7 = arm7;
+    module->overlay = -1;
+    module->autoload = index;
+    if (index >= autoload_count(disasm, arm7))
+        fatal_error("Argument to -a is out of range for ARM%d target", arm7 ? 7 : 9);
+    autoload_start = static_read32(st, st->moduleParams);
+    first_autoload = static_read32(st, st->moduleParams + 8);
+
+    module->romStart = first_autoload - st->ramStart + st->romStart;
+    for (int i = 0; i < index; i++) {
+        module->romStart += static_read32(st, autoload_start + 12 * i + 4);
+    }
+    module->ramStart = static_read32(st, autoload_start + 12 * index);
+    module->size = static_read32(st, autoload_start + 12 * index + 4);
+    if (module->romStart - st->romStart > st->size || module->size > st->size - (module->romStart - st->romStart))
+        fatal_error("autoload %d is outside the static module", index);
+}
+
+// Points inputFileBuffer and the fields that go with it at the module.
+static void module_load(struct NdsDisasm *disasm, const struct Module *module)
+{
+    const struct StaticModule *st;
+
+    snprintf(disasm->load->moduleName, sizeof(disasm->load->moduleName), "%s", module->name);
+    disasm->options.isArm7 = module->isArm7;
+    disasm->options.overlay = module->overlay;
+    disasm->options.autoload = module->autoload;
+    if (module->overlay != -1)
+    {
+        disasm->load->romStart = module->romStart;
+        disasm->load->ramStart = module->ramStart;
+        disasm->inputFileBufferSize = module->size;
+        disasm->load->compressedStaticEnd = module->compressedStaticEnd;
+        if (!cache_load(disasm, 'o', module->overlay, NULL))
+        {
+            input_load(disasm, disasm->load->romStart);
+            cache_store(disasm, 0);
+        }
+        return;
+    }
+    st = static_load(disasm, module->isArm7);
+    disasm->load->romStart = module->romStart;
+    disasm->load->ramStart = module->ramStart;
+    disasm->load->compressedStaticEnd = st->compressedStaticEnd;
+    if (module->autoload != -1)
+    {
+        // the autoload is part of the static module, decompressed or not
+        disasm->inputFileBuffer = st->buffer + module->romStart - st->romStart;
+        disasm->inputFileBufferSize = module->size;
+    }
+    else
+    {
+        // decompressing may have made it bigger than the header says
+        disasm->inputFileBuffer = st->buffer;
+        disasm->inputFileBufferSize = st->size;
+    }
+}
+
+void read_input_file(struct NdsDisasm *disasm, const char *fname)
+{
+    struct Module module;
+
+    rom_open(disasm, fname);
+    if (disasm->options.overlay != -1) {
+        module_overlay(disasm, &module, disasm->options.isArm7, disasm->options.overlay);
+        module_load(disasm, &module);
+    } else if (disasm->options.autoload != -1) {
+        module_autoload(disasm, &module, disasm->options.isArm7, disasm->options.autoload);
+        module_load(disasm, &module);
+    } else if (!disasm->options.raw) {
+        module_static(disasm, &module, disasm->options.isArm7);
+        module_load(disasm, &module);
+    } else {
+        disasm->inputFileBufferSize = disasm->load->romSize;
+        disasm->load->ramStart = 0;
+        disasm->load->romStart = 0;
+        input_load(disasm, disasm->load->romStart);
+    }
+    disasm->romLoadAddr = disasm->load->ramStart;
+    if (disasm->options.uncompressedFileName != NULL)
+    {
+        FILE *sbinfile = fopen(disasm->options.uncompressedFileName, "wb");
+        if (sbinfile == NULL)
+        {
+            fatal_error("failed to open uncompress dump destination for writing\n");
+        }
+        bool written = fwrite(disasm->inputFileBuffer, 1, disasm->inputFileBufferSize, sbinfile) == disasm->inputFileBufferSize;
+        if (fclose(sbinfile) != 0 || !written)
+        {
+            fatal_error("error writing uncompress dump");
+        }
+    }
+}
+
+static char *split_word(char *s)
+{
+    while (!isspace(*s))
+    {
+        if (*s == '\0')
+            return s;
+        s++;
+    }
+    *s++ = '\0';
+    while (isspace(*s))
+        s++;
+    return s;
+}
+
+static char *split_line(char *s)
+{
+    while (*s != '\n' && *s != '\r')
+    {
+        if (*s == '\0')
+            return s;
+        s++;
+    }
+    *s++ = '\0';
+    while (*s == '\n' || *s == '\r')
+        s++;
+    return s;
+}
+
+static char *skip_whitespace(char *s)
+{
+    while (isspace(*s))
+        s++;
+    return s;
+}
+
+void read_config(struct NdsDisasm *disasm, const char *fname)
+{
+    FILE *file = fopen(fname, "rb");
+    size_t size;
+    char *line;
+    char *next;
+    int lineNum = 1;
+    bool inSection = true;
+
+    if (file == NULL)
+        fatal_error("could not open config file '%s'", fname);
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    // kept in the context while it's parsed, for an error on the way to free
+    disasm->load->configText = malloc(size + 1);
+    if (disasm->load->configText == NULL)
+    {
+        fclose(file);
+        fatal_error("could not alloc buffer for '%s'", fname);
+    }
+    if (fread(disasm->load->configText, 1, size, file) != size)
+    {
+        fclose(file);
+        fatal_error("failed to read from file '%s'", fname);
+    }
+    disasm->load->configText[size] = '\0';
+    fclose(file);
+
+    for (line = next = disasm->load->configText; *line != '\0'; line = next, lineNum++)
+    {
+        char *tokens[3];
+        char *name = NULL;
+        int i;
+
+        next = split_line(line);
+
+        tokens[0] = line = skip_whitespace(line);
+        for (i = 1; i < 3; i++)
+            tokens[i] = line = split_word(line);
+
+        if (tokens[0][0] == '#')
+            continue;
+        if (strcmp(tokens[0], "section") == 0)
+        {
+            if (strlen(tokens[1]) == 0)
+                fatal_error("%s: missing argument to section command on line %i", fname, lineNum);
+            // what follows, up to the next section, is only for the module it names
+            inSection = strcmp(tokens[1], disasm->load->moduleName) == 0;
+            continue;
+        }
+        if (!inSection)
+            continue;
+        if (strcmp(tokens[0], "arm_func") == 0)
+        {
+            int addr;
+
+            if (sscanf(tokens[1], "%i", &addr) == 1)
+            {
+                if (strlen(tokens[2]) != 0)
+                    name = strdup(tokens[2]);
+                disasm_add_label(disasm, addr, LABEL_ARM_CODE, name, true);
+            }
+            else
+            {
+                fatal_error("%s: syntax error on line %i", fname, lineNum);
+            }
+        }
+        else if (strcmp(tokens[0], "thumb_func") == 0)
+        {
+            int addr;
+
+            if (sscanf(tokens[1], "%i", &addr) == 1)
+            {
+                if (strlen(tokens[2]) != 0)
+                    name = strdup(tokens[2]);
+                disasm_add_label(disasm, addr, LABEL_THUMB_CODE, name, true);
+            }
+            else
+            {
+                fatal_error("%s: syntax error on line %i", fname, lineNum);
+            }
+        }
+        else if (strcmp(tokens[0], "data") == 0)
+        {
+            int addr;
+
+            if (sscanf(tokens[1], "%i", &addr) == 1)
+            {
+                if (strlen(tokens[2]) != 0)
+                    name = strdup(tokens[2]);
+                disasm_add_label(disasm, addr, LABEL_DATA, name, true);
+            }
+            else
+            {
+                fatal_error("%s: syntax error on line %i", fname, lineNum);
+            }
+        }
+        else if (strcmp(tokens[0], "ascii") == 0)
+        {
+            int addr;
+
+            if (sscanf(tokens[1], "%i", &addr) == 1)
+            {
+                if (strlen(tokens[2]) != 0)
+                    name = strdup(tokens[2]);
+                disasm_add_label(disasm, addr, LABEL_ASCII, name, true);
+            }
+            else
+            {
+                fatal_error("%s: syntax error on line %i", fname, lineNum);
+            }
+        }
+        else if (strcmp(tokens[0], "prefix") == 0)
+        {
+            bool isValidSecondToken = strlen(tokens[2]) != 0;
+            if (strcmp(tokens[1], "function") == 0)
+            {
+                if (!isValidSecondToken)
+                    fatal_error("%s: missing second argument to prefix command on line %i", fname, lineNum);
+                if (disasm->load->functionPrefixOverridden)
+                {
+                    fprintf(stderr, "%s: warning: duplicate \"prefix function\" command supercedes earlier ones on line %i\n", fname, lineNum);
+                    free((char*)disasm->functionPrefix);
+                }
+                disasm->functionPrefix = strdup(tokens[2]);
+                disasm->load->functionPrefixOverridden = true;
+            }
+            else if (strcmp(tokens[1], "data") == 0)
+            {
+                if (!isValidSecondToken)
+                    fatal_error("%s: missing second argument to prefix command on line %i", fname, lineNum);
+                if (disasm->load->dataPrefixOverridden)
+                {
+                    fprintf(stderr, "%s: warning: duplicate \"prefix data\" command supercedes earlier ones on line %i\n", fname, lineNum);
+                    free((char*)disasm->dataPrefix);
+                }
+                disasm->dataPrefix = strdup(tokens[2]);
+                disasm->load->dataPrefixOverridden = true;
+            }
+            else
+            {
+                fatal_error("%s: missing first argument to prefix command on line %i", fname, lineNum);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "%s: warning: unrecognized command '%s' on line %i\n", fname, tokens[0], lineNum);
+        }
+    }
+
+    free(disasm->load->configText);
+    disasm->load->configText = NULL;
+}
+
+
+// Batch Mode
+
+// Opens the ROM and reads what the header says about every module in it, the
+// static modules first, decompressing those on the way. Returns how many
+// there are.
+int load_modules(struct NdsDisasm *disasm, const char *fname, struct Module **modules)
+{
+    int count = 0;
+
+    rom_open(disasm, fname);
+    *modules = NULL;
+    for (int arm7 = 0; arm7 < 2; arm7++)
+    {
+        int overlays, autoloads;
+
+        *modules = realloc(*modules, (count + 1) * sizeof(**modules));
+        if (*modules == NULL)
+            fatal_error("failed to alloc module list");
+        module_static(disasm, &(*modules)[count], arm7);
+        if ((*modules)[count].size == 0)
+            continue;
+        count++;
+        overlays = overlay_count(disasm, arm7);
+        autoloads = autoload_count(disasm, arm7);
+        *modules = realloc(*modules, (count + overlays + autoloads) * sizeof(**modules));
+        if (*modules == NULL)
+            fatal_error("failed to alloc module list");
+        for (int i = 0; i < overlays; i++)
+            module_overlay(disasm, &(*modules)[count++], arm7, i);
+        for (int i = 0; i < autoloads; i++)
+            module_autoload(disasm, &(*modules)[count++], arm7, i);
+    }
+    return count;
+}
+
+// Has disasm use the ROM and static modules parent loaded, read only. parent
+// has to stay around as long as it does.
+void load_share(struct NdsDisasm *disasm, const struct NdsDisasm *parent)
+{
+    *disasm->load = *parent->load;
+    disasm->load->shared = true;
+    disasm->load->inputCopy = NULL;
+    disasm->load->cacheFile = NULL;
+    disasm->load->functionPrefixOverridden = disasm->load->dataPrefixOverridden = false;
+}
+
+// Loads one of the modules load_modules found.
+void load_module(struct NdsDisasm *disasm, const struct Module *module)
+{
+    module_load(disasm, module);
+    disasm->romLoadAddr = disasm->load->ramStart;
+}
+
+// State
+
+// Sets up the state of disasm. Returns false if there isn't the memory for it.
+bool load_init(struct NdsDisasm *disasm)
+{
+    disasm->load = calloc(1, sizeof(*disasm->load));
+    if (disasm->load == NULL)
+        return false;
+    disasm->functionPrefix = "FUN_";
+    disasm->dataPrefix = "UNK_";
+    return true;
+}
+
+void load_free(struct NdsDisasm *disasm)
+{
+    if (disasm->load == NULL)
+        return;
+    input_free(disasm);
+    free(disasm->load->configText);
+    if (disasm->load->functionPrefixOverridden)
+        free((char *)disasm->functionPrefix);
+    if (disasm->load->dataPrefixOverridden)
+        free((char *)disasm->dataPrefix);
+    free(disasm->load);
+    disasm->load = NULL;
+}
@@ -1,20 +1,41 @@
 #include <stdnoreturn.h>
 
-#define NDSDISASM_VERMAJ    1
-#define NDSDISASM_VERMIN    0
-#define NDSDISASM_VERSTP    5
+#include "libndsdisasm.h"
 
-static inline noreturn __attribute__((format(printf, 1, 2))) void fatal_error(const char *fmt, ...)
+// How far a disassembly got, so calls out of order fail
+enum ContextStage
 {
-    va_list args;
+    CONTEXT_CREATED,
+    CONTEXT_LOADED,
+    CONTEXT_ANALYZED,
+    CONTEXT_SERVED,
+};
+
+#define CONTEXT_ERROR_SIZE 1024
+
+// Everything a disassembly keeps is in its context, see libndsdisasm.h, and
+// every function working on one is passed it. Each file keeps the rest of its
+// state in a struct of its own.
+struct NdsDisasm
+{
+    struct NdsDisasmOptions options;
+    uint8_t *inputFileBuffer;       // the module
+    size_t inputFileBufferSize;
+    uint32_t romLoadAddr;           // where it's loaded
+    const char *functionPrefix;
+    const char *dataPrefix;
+    const char *symbolExportFile;   // for the first pass of a batch with -x
+    struct LoadState *load;
+    struct DisasmState *disasm;
+    struct SymbolsState *symbols;
+    enum ContextStage stage;
+    bool failed;
+    char error[CONTEXT_ERROR_SIZE];
+};
 
-    fputs("error: ", stderr);
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fputs("\n", stderr);
-    exit(1);
-}
+// Inside a library call, fails the call with the message, and inside a job,
+// the job (see context_run_job). Anywhere else, prints it and exits.
+noreturn __attribute__((format(printf, 1, 2))) void fatal_error(const char *fmt, ...);
 
 enum LabelType
 {
@@ -28,19 +49,87 @@ enum LabelType
     LABEL_ASCII,
 };
 
-extern uint8_t *gInputFileBuffer;
-extern size_t gInputFileBufferSize;
-extern uint32_t ROM_LOAD_ADDR;
-extern uint32_t gRomStart;
-extern uint32_t gRamStart;
-extern bool isFullRom;
-extern bool isArm7;
-extern bool dumpUnDisassembled;
-extern const char *functionPrefix;
-extern const char *dataPrefix;
-extern bool functionPrefixOverridden;
-extern bool dataPrefixOverridden;
+// context.c
+bool context_run(struct NdsDisasm *disasm, void (*step)(struct NdsDisasm *disasm, void *arg), void *arg);
+bool context_run_job(void (*job)(void *arg), void *arg, char *error);
+
+// load.c
+// What the header says about one module, before it's loaded. Batch mode reads
+// every module's up front.
+struct Module
+{
+    char name[32];          // also its config section and output file
+    bool isArm7;
+    int overlay;            // -1 unless an overlay
+    int autoload;           // -1 unless an autoload
+    uint32_t romStart;      // for an autoload, where it starts in the static module's ROM image
+    uint32_t ramStart;
+    uint32_t size;
+    uint32_t compressedStaticEnd;
+    uint32_t entry;         // for a static module, where FindUncompressCall looks
+};
+
+bool load_init(struct NdsDisasm *disasm);
+void load_free(struct NdsDisasm *disasm);
+void read_input_file(struct NdsDisasm *disasm, const char *fname);
+void read_config(struct NdsDisasm *disasm, const char *fname);
+int load_modules(struct NdsDisasm *disasm, const char *fname, struct Module **modules);
+void load_share(struct NdsDisasm *disasm, const struct NdsDisasm *parent);
+void load_module(struct NdsDisasm *disasm, const struct Module *module);
+bool map_file(const char *fileName, uint8_t **data, size_t *size);
+void unmap_file(uint8_t *data, size_t size);
+bool file_replace(const char *directory, const char *path, const void *header, size_t headerSize, const void *data, size_t size);
 
 // disasm.c
-int disasm_add_label(uint32_t addr, enum LabelType type, char *name, bool is_config);
-void disasm_disassemble(void);
+bool disasm_init(struct NdsDisasm *disasm);
+void disasm_free(struct NdsDisasm *disasm);
+void disasm_thread_reset(void);
+int disasm_add_label(struct NdsDisasm *disasm, uint32_t addr, enum LabelType type, char *name, bool is_config);
+void disasm_analyze_module(struct NdsDisasm *disasm);
+void disasm_emit(struct NdsDisasm *disasm, char **text, size_t *size);
+double wall_time(void);
+uint64_t content_hash(const uint8_t *data, size_t size);
+void disasm_resident_open(struct NdsDisasm *disasm);
+void disasm_resident_close(struct NdsDisasm *disasm);
+void disasm_reply_begin(struct NdsDisasm *disasm);
+const char *disasm_reply_end(struct NdsDisasm *disasm, size_t *size);
+bool disasm_lookup(struct NdsDisasm *disasm, const char *symbol, uint32_t *addr);
+bool disasm_query_range(struct NdsDisasm *disasm, uint32_t start, uint32_t end);
+bool disasm_query_symbol(struct NdsDisasm *disasm, uint32_t addr);
+bool disasm_query_xrefs(struct NdsDisasm *disasm, uint32_t addr);
+bool disasm_query_label(struct NdsDisasm *disasm, uint32_t addr, enum LabelType type, const char *name);
+bool disasm_query_rename(struct NdsDisasm *disasm, uint32_t addr, const char *name);
+
+// elf.c
+struct ElfSymbol
+{
+    const char *name;   // NULL if it only marks where the kind of bytes changes
+    uint32_t addr;
+    uint32_t size;
+    char mapping;       // 'a' for ARM code, 't' for Thumb code, 'd' for data
+    bool global;
+    bool function;
+};
+
+bool elf_write(struct NdsDisasm *disasm, const char *fileName, const struct ElfSymbol *symbols, int count);
+
+// symbols.c
+struct SymbolModule
+{
+    const char *name;
+    bool isArm7;
+    uint32_t ramStart;
+    uint32_t size;
+    const char *symbolFile;
+};
+
+bool symbols_init(struct NdsDisasm *disasm);
+void symbols_free(struct NdsDisasm *disasm);
+void symbols_build(struct NdsDisasm *disasm, const char *indexFile, const struct SymbolModule *modules, int count);
+void symbols_open(struct NdsDisasm *disasm, const char *indexFile, bool arm7, uint32_t ramStart, uint32_t size);
+void symbols_close(struct NdsDisasm *disasm);
+const char *symbols_find(struct NdsDisasm *disasm, uint32_t addr, char *kind, const char **ambiguous);
+
+// server.c
+void server_run(struct NdsDisasm *disasm, const char *socketPath);
+int server_query(const char *socketPath, const char *request);
@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "ndsdisasm.h"
+
+// Query server for a module kept loaded with -L, and its client, -Q. Clients
+// connect to a Unix socket and send requests, a line each:
+//
+//   disasm START [END]     the functions from the one START is in up to END
+//   symbol ADDR|NAME       the label at or before an address, or by name
+//   xrefs ADDR|NAME        the labels whose traces refer to a label
+//   add TYPE ADDR [NAME]   a label like an arm_func, thumb_func, data or ascii
+//                          line of the config, then analyzes again
+//   rename ADDR|NAME NAME  names a label
+//   quit                   stops the server
+//
+// Every reply is a line with "ok" or "error" and the size of the text that
+// follows it. Requests change the module's analysis, so they are answered
+// one at a time.
+
+#define REQUEST_MAX 1024
+
+#ifndef _WIN32
+static int server_connect(const char *socketPath)
+{
+    struct sockaddr_un address = {0};
+    int fd;
+
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t written = write(fd, data, size);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data = (const char *)data + written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool reply_send(int fd, bool ok, const char *text, size_t size)
+{
+    char header[32];
+
+    snprintf(header, sizeof(header), "%s %zu\n", ok ? "ok" : "error", size);
+    return write_all(fd, header, strlen(header)) && write_all(fd, text, size);
+}
+
+static bool reply_error(int fd, const char *fmt, ...)
+{
+    char text[REQUEST_MAX + 64];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text) - 1, fmt, args);
+    va_end(args);
+    strcat(text, "\n");
+    return reply_send(fd, false, text, strlen(text));
+}
+
+// Fails a query. It has no context to leave the message in, so it's printed.
+static int query_error(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    fputs("error: ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputs("\n", stderr);
+    va_end(args);
+    return 1;
+}
+
+static bool parse_type(const char *word, enum LabelType *type)
+{
+    if (strcmp(word, "arm_func") == 0)
+        *type = LABEL_ARM_CODE;
+    else if (strcmp(word, "thumb_func") == 0)
+        *type = LABEL_THUMB_CODE;
+    else if (strcmp(word, "data") == 0)
+        *type = LABEL_DATA;
+    else if (strcmp(word, "ascii") == 0)
+        *type = LABEL_ASCII;
+    else
+        return false;
+    return true;
+}
+
+static bool lookup(struct NdsDisasm *disasm, const char *symbol, uint32_t *addr, const char **unknown)
+{
+    if (disasm_lookup(disasm, symbol, addr))
+        return true;
+    *unknown = symbol;
+    return false;
+}
+
+// Answers one request. Returns false once the connection is to be closed,
+// and sets *quit if the server is to stop.
+static bool server_request(struct NdsDisasm *disasm, int fd, char *request, bool *quit)
+{
+    char *tokens[4] = {0};
+    int count = 0;
+    uint32_t addr, end;
+    enum LabelType type = LABEL_DATA;
+    const char *unknown = NULL;
+    const char *text;
+    size_t size;
+    bool ok = false;
+
+    for (char *token = strtok(request, " \t\r"); token != NULL; token = strtok(NULL, " \t\r"))
+    {
+        if (count == 4)
+            return reply_error(fd, "too many arguments");
+        tokens[count++] = token;
+    }
+    if (count == 0)
+        return reply_error(fd, "empty request");
+    if (strcmp(tokens[0], "quit") == 0 && count == 1)
+    {
+        *quit = true;
+        reply_send(fd, true, "", 0);
+        return false;
+    }
+    if (!((strcmp(tokens[0], "disasm") == 0 && (count == 2 || count == 3))
+       || (strcmp(tokens[0], "symbol") == 0 && count == 2)
+       || (strcmp(tokens[0], "xrefs") == 0 && count == 2)
+       || (strcmp(tokens[0], "add") == 0 && (count == 3 || count == 4))
+       || (strcmp(tokens[0], "rename") == 0 && count == 3)))
+        return reply_error(fd, "bad request '%s'", tokens[0]);
+    if (strcmp(tokens[0], "add") == 0 && !parse_type(tokens[1], &type))
+        return reply_error(fd, "unknown label type '%s'", tokens[1]);
+
+    disasm_reply_begin(disasm);
+    if (strcmp(tokens[0], "disasm") == 0)
+    {
+        if (lookup(disasm, tokens[1], &addr, &unknown) && (count == 2 || lookup(disasm, tokens[2], &end, &unknown)))
+            ok = disasm_query_range(disasm, addr, (count == 3) ? end : addr + 1);
+    }
+    else if (strcmp(tokens[0], "symbol") == 0)
+    {
+        if (lookup(disasm, tokens[1], &addr, &unknown))
+            ok = disasm_query_symbol(disasm, addr);
+    }
+    else if (strcmp(tokens[0], "xrefs") == 0)
+    {
+        if (lookup(disasm, tokens[1], &addr, &unknown))
+            ok = disasm_query_xrefs(disasm, addr);
+    }
+    else if (strcmp(tokens[0], "add") == 0)
+    {
+        if (lookup(disasm, tokens[2], &addr, &unknown))
+            ok = disasm_query_label(disasm, addr, type, tokens[3]);
+    }
+    else
+    {
+        if (lookup(disasm, tokens[1], &addr, &unknown))
+            ok = disasm_query_rename(disasm, addr, tokens[2]);
+    }
+    text = disasm_reply_end(disasm, &size);
+    if (unknown != NULL)
+        return reply_error(fd, "no label named '%s'", unknown);
+    return reply_send(fd, ok, text, size);
+}
+
+// Answers the requests of one connection until it closes. Returns false if
+// the server is to stop.
+static bool server_serve(struct NdsDisasm *disasm, int fd)
+{
+    char buffer[REQUEST_MAX];
+    size_t size = 0;
+    bool quit = false;
+
+    while (1)
+    {
+        ssize_t got = read(fd, buffer + size, sizeof(buffer) - size);
+        char *line = buffer, *newline;
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return true;
+        size += got;
+        while ((newline = memchr(line, '\n', buffer + size - line)) != NULL)
+        {
+            *newline = '\0';
+            if (!server_request(disasm, fd, line, &quit))
+                return !quit;
+            line = newline + 1;
+        }
+        size -= line - buffer;
+        memmove(buffer, line, size);
+        if (size == sizeof(buffer))
+        {
+            reply_error(fd, "request too long");
+            return true;
+        }
+    }
+}
+
+struct ServerConnection
+{
+    struct NdsDisasm *disasm;
+    int fd;
+    bool more;                  // false once the server is to stop
+};
+
+static void server_connection_job(void *arg)
+{
+    struct ServerConnection *connection = arg;
+
+    connection->more = server_serve(connection->disasm, connection->fd);
+}
+#endif
+
+// Listens on socketPath until a client sends quit. A socket left behind by a
+// server that's gone is replaced, anything else there isn't.
+void server_run(struct NdsDisasm *disasm, const char *socketPath)
+{
+#ifdef _WIN32
+    (void)disasm;
+    (void)socketPath;
+    fatal_error("-L isn't supported on Windows");
+#else
+    struct sockaddr_un address = {0};
+    struct ServerConnection connection = {disasm, -1, true};
+    char error[CONTEXT_ERROR_SIZE];
+    struct stat st;
+    int listenFd, fd;
+
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        fatal_error("socket path %s is too long", socketPath);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    if (lstat(socketPath, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+            fatal_error("%s is in the way of the server socket", socketPath);
+        if ((fd = server_connect(socketPath)) != -1)
+        {
+            close(fd);
+            fatal_error("a server is already listening on %s", socketPath);
+        }
+        unlink(socketPath);
+    }
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        fatal_error("failed to listen on %s: %s", socketPath, strerror(errno));
+    if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        snprintf(error, sizeof(error), "failed to listen on %s: %s", socketPath, strerror(errno));
+        close(listenFd);
+        fatal_error("%s", error);
+    }
+    // From here on the socket is ours, and goes away with the server however
+    // it stops. A request that fails stops it as well.
+    if (listen(listenFd, 8) != 0)
+        snprintf(error, sizeof(error), "failed to listen on %s: %s", socketPath, strerror(errno));
+    else
+    {
+        // a client that goes away early only ends its connection
+        signal(SIGPIPE, SIG_IGN);
+        fprintf(stderr, "listening on %s\n", socketPath);
+        error[0] = '\0';
+    }
+    while (error[0] == '\0' && connection.more)
+    {
+        fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                snprintf(error, sizeof(error), "failed to accept a connection on %s: %s", socketPath, strerror(errno));
+            continue;
+        }
+        connection.fd = fd;
+        context_run_job(server_connection_job, &connection, error);
+        close(fd);
+    }
+    close(listenFd);
+    unlink(socketPath);
+    if (error[0] != '\0')
+        fatal_error("%s", error);
+#endif
+}
+
+// Sends the request to the server on socketPath and prints the reply, to
+// stdout if it went through and to stderr if it didn't. Returns the exit code.
+int server_query(const char *socketPath, const char *request)
+{
+#ifdef _WIN32
+    (void)socketPath;
+    (void)request;
+    return query_error("-Q isn't supported on Windows");
+#else
+    char *reply = NULL, *grown;
+    size_t size = 0, bufferSize = 0, textSize;
+    char *text;
+    int fd;
+    bool ok;
+
+    if (strchr(request, '\n') != NULL || strlen(request) >= REQUEST_MAX)
+        return query_error("bad request");
+    if ((fd = server_connect(socketPath)) == -1)
+        return query_error("could not connect to %s: %s", socketPath, strerror(errno));
+    signal(SIGPIPE, SIG_IGN);
+    if (!write_all(fd, request, strlen(request)) || !write_all(fd, "\n", 1))
+    {
+        close(fd);
+        return query_error("failed to send request to %s: %s", socketPath, strerror(errno));
+    }
+    // the server closes the connection once it has answered
+    shutdown(fd, SHUT_WR);
+    while (1)
+    {
+        ssize_t got;
+
+        if (size == bufferSize)
+        {
+            bufferSize = bufferSize ? 2 * bufferSize : 0x10000;
+            if ((grown = realloc(reply, bufferSize)) == NULL)
+            {
+                close(fd);
+                free(reply);
+                return query_error("failed to alloc space for the reply. ");
+            }
+            reply = grown;
+        }
+        got = read(fd, reply + size, bufferSize - size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            close(fd);
+            free(reply);
+            return query_error("failed to read reply from %s: %s", socketPath, strerror(errno));
+        }
+        if (got == 0)
+            break;
+        size += got;
+    }
+    close(fd);
+    text = (reply != NULL) ? memchr(reply, '\n', size) : NULL;
+    if (text == NULL)
+    {
+        free(reply);
+        return query_error("no reply from %s", socketPath);
+    }
+    *text++ = '\0';
+    ok = strncmp(reply, "ok ", 3) == 0;
+    if ((!ok && strncmp(reply, "error ", 6) != 0)
+     || sscanf(reply + (ok ? 3 : 6), "%zu", &textSize) != 1 || textSize != size - (text - reply))
+    {
+        free(reply);
+        return query_error("bad reply from %s", socketPath);
+    }
+    fwrite(text, 1, textSize, ok ? stdout : stderr);
+    free(reply);
+    return ok ? 0 : 1;
+#endif
+}
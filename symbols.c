@@ -0,0 +1,377 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ndsdisasm.h"
+
+// Symbol index shared by the modules of a ROM, so one module can name what it
+// calls or points to in another. Batch mode writes each module's functions
+// and data labels to a symbol file, then builds one index from all of them.
+// The index is a hash table keyed by address, so an address that overlays
+// sharing a RAM range both have a symbol at shows up as one entry with a
+// symbol per module.
+//
+// Index layout, little endian:
+//   struct IndexHeader
+//   struct IndexModule[moduleCount]
+//   struct IndexSlot[slotCount]     open addressing, count 0 if empty
+//   struct IndexSymbol[symbolCount] sorted by address, then module
+//   strings
+
+#define INDEX_MAGIC     0x58534E44 // "NDSX"
+#define INDEX_VERSION   1
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t moduleCount;
+    uint32_t slotCount;
+    uint32_t symbolCount;
+    uint32_t stringsSize;
+};
+
+struct IndexModule
+{
+    uint32_t name;
+    uint32_t isArm7;
+    uint32_t ramStart;
+    uint32_t size;
+};
+
+struct IndexSlot
+{
+    uint32_t addr;
+    uint32_t first;
+    uint32_t count;
+};
+
+struct IndexSymbol
+{
+    uint32_t addr;
+    uint32_t module;
+    uint32_t kind;      // 'a' ARM function, 't' Thumb function, 'd' data
+    uint32_t name;
+};
+
+struct BuildBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t bufferSize;
+};
+
+// The index a disassembly has open, and what building one has allocated
+struct SymbolsState
+{
+    uint8_t *indexFile;
+    size_t indexFileSize;
+    const struct IndexHeader *index;
+    const struct IndexModule *indexModules;
+    const struct IndexSlot *indexSlots;
+    const struct IndexSymbol *indexSymbols;
+    const char *indexStrings;
+    bool *indexExcluded;   // modules that can't be what this one refers to
+    FILE *buildFile;       // the symbol file being read, or the index being written
+    struct IndexModule *buildModules;
+    struct IndexSlot *buildSlots;
+    struct BuildBuffer buildSymbols;
+    struct BuildBuffer buildStrings;
+};
+
+
+static _Thread_local char sAmbiguous[256];
+
+static uint32_t index_hash(uint32_t addr)
+{
+    return (addr >> 1) * 0x9E3779B1u;
+}
+
+// Building
+//
+// What symbols_build allocates and opens is kept in the state, so that
+// symbols_free can release it if building fails on the way.
+
+static void build_put(struct BuildBuffer *buffer, const void *data, size_t size)
+{
+    while (buffer->size + size > buffer->bufferSize)
+    {
+        size_t bufferSize = buffer->bufferSize ? 2 * buffer->bufferSize : 0x1000;
+        uint8_t *grown = realloc(buffer->data, bufferSize);
+
+        if (grown == NULL)
+            fatal_error("failed to alloc space for the symbol index. ");
+        buffer->data = grown;
+        buffer->bufferSize = bufferSize;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static uint32_t build_string(struct BuildBuffer *strings, const char *s)
+{
+    uint32_t offset = strings->size;
+
+    build_put(strings, s, strlen(s) + 1);
+    return offset;
+}
+
+static void build_free(struct NdsDisasm *disasm)
+{
+    if (disasm->symbols->buildFile != NULL)
+        fclose(disasm->symbols->buildFile);
+    free(disasm->symbols->buildModules);
+    free(disasm->symbols->buildSlots);
+    free(disasm->symbols->buildSymbols.data);
+    free(disasm->symbols->buildStrings.data);
+    disasm->symbols->buildFile = NULL;
+    disasm->symbols->buildModules = NULL;
+    disasm->symbols->buildSlots = NULL;
+    disasm->symbols->buildSymbols = disasm->symbols->buildStrings = (struct BuildBuffer){0};
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+    const struct IndexSymbol *x = a, *y = b;
+
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return (x->module > y->module) - (x->module < y->module);
+}
+
+// Each module's symbol file has a line per symbol: address, kind and name.
+void symbols_build(struct NdsDisasm *disasm, const char *indexFile, const struct SymbolModule *modules, int count)
+{
+    struct IndexHeader header = {0};
+    struct IndexSymbol *symbols;
+    uint32_t symbolCount, distinct = 0;
+    bool written;
+
+    disasm->symbols->buildModules = calloc(count > 0 ? count : 1, sizeof(*disasm->symbols->buildModules));
+    if (disasm->symbols->buildModules == NULL)
+        fatal_error("failed to alloc space for the symbol index. ");
+    build_string(&disasm->symbols->buildStrings, "");
+    for (int i = 0; i < count; i++)
+    {
+        char line[512];
+
+        disasm->symbols->buildModules[i].name = build_string(&disasm->symbols->buildStrings, modules[i].name);
+        disasm->symbols->buildModules[i].isArm7 = modules[i].isArm7;
+        disasm->symbols->buildModules[i].ramStart = modules[i].ramStart;
+        disasm->symbols->buildModules[i].size = modules[i].size;
+        disasm->symbols->buildFile = fopen(modules[i].symbolFile, "rb");
+        if (disasm->symbols->buildFile == NULL)
+            fatal_error("could not open symbol file '%s'", modules[i].symbolFile);
+        while (fgets(line, sizeof(line), disasm->symbols->buildFile) != NULL)
+        {
+            struct IndexSymbol symbol;
+            unsigned int addr;
+            char kind;
+            char name[256];
+
+            if (sscanf(line, "%x %c %255s", &addr, &kind, name) != 3)
+                fatal_error("%s: bad symbol line", modules[i].symbolFile);
+            symbol.addr = addr;
+            symbol.module = i;
+            symbol.kind = kind;
+            symbol.name = build_string(&disasm->symbols->buildStrings, name);
+            build_put(&disasm->symbols->buildSymbols, &symbol, sizeof(symbol));
+        }
+        fclose(disasm->symbols->buildFile);
+        disasm->symbols->buildFile = NULL;
+    }
+
+    symbols = (struct IndexSymbol *)disasm->symbols->buildSymbols.data;
+    symbolCount = disasm->symbols->buildSymbols.size / sizeof(struct IndexSymbol);
+    if (symbolCount != 0)
+        qsort(symbols, symbolCount, sizeof(struct IndexSymbol), symbol_compare);
+    for (uint32_t i = 0; i < symbolCount; i++)
+        if (i == 0 || symbols[i].addr != symbols[i - 1].addr)
+            distinct++;
+
+    // at most half full
+    header.slotCount = 16;
+    while (header.slotCount < 2 * distinct)
+        header.slotCount *= 2;
+    disasm->symbols->buildSlots = calloc(header.slotCount, sizeof(*disasm->symbols->buildSlots));
+    if (disasm->symbols->buildSlots == NULL)
+        fatal_error("failed to alloc space for the symbol index. ");
+    for (uint32_t i = 0; i < symbolCount; )
+    {
+        const struct IndexSymbol *symbol = &symbols[i];
+        uint32_t j = i + 1;
+        uint32_t slot = index_hash(symbol->addr) & (header.slotCount - 1);
+
+        while (j < symbolCount && symbols[j].addr == symbol->addr)
+            j++;
+        while (disasm->symbols->buildSlots[slot].count != 0)
+            slot = (slot + 1) & (header.slotCount - 1);
+        disasm->symbols->buildSlots[slot].addr = symbol->addr;
+        disasm->symbols->buildSlots[slot].first = i;
+        disasm->symbols->buildSlots[slot].count = j - i;
+        i = j;
+    }
+
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.moduleCount = count;
+    header.symbolCount = symbolCount;
+    header.stringsSize = disasm->symbols->buildStrings.size;
+    disasm->symbols->buildFile = fopen(indexFile, "wb");
+    if (disasm->symbols->buildFile == NULL)
+        fatal_error("failed to write symbol index %s", indexFile);
+    written = fwrite(&header, sizeof(header), 1, disasm->symbols->buildFile) == 1
+           && fwrite(disasm->symbols->buildModules, sizeof(*disasm->symbols->buildModules), count, disasm->symbols->buildFile) == (size_t)count
+           && fwrite(disasm->symbols->buildSlots, sizeof(*disasm->symbols->buildSlots), header.slotCount, disasm->symbols->buildFile) == header.slotCount
+           && fwrite(disasm->symbols->buildSymbols.data, 1, disasm->symbols->buildSymbols.size, disasm->symbols->buildFile) == disasm->symbols->buildSymbols.size
+           && fwrite(disasm->symbols->buildStrings.data, 1, disasm->symbols->buildStrings.size, disasm->symbols->buildFile) == disasm->symbols->buildStrings.size;
+    if (fclose(disasm->symbols->buildFile) != 0)
+        written = false;
+    disasm->symbols->buildFile = NULL;
+    if (!written)
+        fatal_error("failed to write symbol index %s", indexFile);
+    build_free(disasm);
+}
+
+// Lookup
+
+// Checks that every offset and count in the index stays inside it, and that
+// the slot table has an empty slot for lookups of a missing address to stop
+// at.
+static bool index_valid(struct NdsDisasm *disasm)
+{
+    bool empty = false;
+
+    if (disasm->symbols->index->stringsSize == 0 || disasm->symbols->indexStrings[disasm->symbols->index->stringsSize - 1] != '\0')
+        return false;
+    for (uint32_t i = 0; i < disasm->symbols->index->moduleCount; i++)
+        if (disasm->symbols->indexModules[i].name >= disasm->symbols->index->stringsSize)
+            return false;
+    for (uint32_t i = 0; i < disasm->symbols->index->slotCount; i++)
+    {
+        if (disasm->symbols->indexSlots[i].count == 0)
+            empty = true;
+        else if (disasm->symbols->indexSlots[i].first > disasm->symbols->index->symbolCount || disasm->symbols->indexSlots[i].count > disasm->symbols->index->symbolCount - disasm->symbols->indexSlots[i].first)
+            return false;
+    }
+    for (uint32_t i = 0; i < disasm->symbols->index->symbolCount; i++)
+        if (disasm->symbols->indexSymbols[i].module >= disasm->symbols->index->moduleCount || disasm->symbols->indexSymbols[i].name >= disasm->symbols->index->stringsSize)
+            return false;
+    return empty;
+}
+
+// Opens the index for the module of the given CPU at ramStart. Modules of the
+// other CPU, and overlays whose RAM overlaps this module's, are left out of
+// lookups: they're never loaded alongside it.
+void symbols_open(struct NdsDisasm *disasm, const char *indexFile, bool arm7, uint32_t ramStart, uint32_t size)
+{
+    size_t expected;
+
+    if (!map_file(indexFile, &disasm->symbols->indexFile, &disasm->symbols->indexFileSize))
+        fatal_error("could not open symbol index '%s'", indexFile);
+    disasm->symbols->index = (const struct IndexHeader *)disasm->symbols->indexFile;
+    if (disasm->symbols->indexFileSize < sizeof(*disasm->symbols->index) || disasm->symbols->index->magic != INDEX_MAGIC || disasm->symbols->index->version != INDEX_VERSION)
+        fatal_error("%s is not a symbol index", indexFile);
+    expected = sizeof(*disasm->symbols->index) + (size_t)disasm->symbols->index->moduleCount * sizeof(struct IndexModule)
+             + (size_t)disasm->symbols->index->slotCount * sizeof(struct IndexSlot)
+             + (size_t)disasm->symbols->index->symbolCount * sizeof(struct IndexSymbol) + disasm->symbols->index->stringsSize;
+    if (disasm->symbols->indexFileSize != expected || disasm->symbols->index->slotCount == 0 || (disasm->symbols->index->slotCount & (disasm->symbols->index->slotCount - 1)) != 0)
+        fatal_error("symbol index %s is corrupt", indexFile);
+    disasm->symbols->indexModules = (const struct IndexModule *)(disasm->symbols->index + 1);
+    disasm->symbols->indexSlots = (const struct IndexSlot *)(disasm->symbols->indexModules + disasm->symbols->index->moduleCount);
+    disasm->symbols->indexSymbols = (const struct IndexSymbol *)(disasm->symbols->indexSlots + disasm->symbols->index->slotCount);
+    disasm->symbols->indexStrings = (const char *)(disasm->symbols->indexSymbols + disasm->symbols->index->symbolCount);
+    if (!index_valid(disasm))
+        fatal_error("symbol index %s is corrupt", indexFile);
+
+    disasm->symbols->indexExcluded = calloc(disasm->symbols->index->moduleCount > 0 ? disasm->symbols->index->moduleCount : 1, sizeof(*disasm->symbols->indexExcluded));
+    if (disasm->symbols->indexExcluded == NULL)
+        fatal_error("failed to alloc space for the symbol index. ");
+    for (uint32_t i = 0; i < disasm->symbols->index->moduleCount; i++)
+    {
+        const struct IndexModule *module = &disasm->symbols->indexModules[i];
+
+        disasm->symbols->indexExcluded[i] = module->isArm7 != arm7
+                         || (module->ramStart < ramStart + size && ramStart < module->ramStart + module->size);
+    }
+}
+
+void symbols_close(struct NdsDisasm *disasm)
+{
+    if (disasm->symbols->indexFile == NULL)
+        return;
+    unmap_file(disasm->symbols->indexFile, disasm->symbols->indexFileSize);
+    free(disasm->symbols->indexExcluded);
+    disasm->symbols->indexFile = NULL;
+    disasm->symbols->index = NULL;
+    disasm->symbols->indexExcluded = NULL;
+}
+
+// Returns the name of the symbol at addr, and its kind, if exactly one module
+// that can be loaded alongside this one has one there. If several do, returns
+// NULL and points *ambiguous at a comment naming them.
+const char *symbols_find(struct NdsDisasm *disasm, uint32_t addr, char *kind, const char **ambiguous)
+{
+    const struct IndexSlot *slot;
+    const struct IndexSymbol *found = NULL;
+    uint32_t mask, i;
+    int matches = 0;
+
+    *ambiguous = NULL;
+    if (disasm->symbols->index == NULL)
+        return NULL;
+    mask = disasm->symbols->index->slotCount - 1;
+    for (i = index_hash(addr) & mask; disasm->symbols->indexSlots[i].count != 0 && disasm->symbols->indexSlots[i].addr != addr; i = (i + 1) & mask)
+        ;
+    slot = &disasm->symbols->indexSlots[i];
+    if (slot->count == 0)
+        return NULL;
+    for (i = slot->first; i < slot->first + slot->count; i++)
+    {
+        if (disasm->symbols->indexExcluded[disasm->symbols->indexSymbols[i].module])
+            continue;
+        if (matches++ == 0)
+        {
+            found = &disasm->symbols->indexSymbols[i];
+            continue;
+        }
+        if (matches == 2)
+            snprintf(sAmbiguous, sizeof(sAmbiguous), "ambiguous: %s", disasm->symbols->indexStrings + disasm->symbols->indexModules[found->module].name);
+        if (strlen(sAmbiguous) + strlen(disasm->symbols->indexStrings + disasm->symbols->indexModules[disasm->symbols->indexSymbols[i].module].name) + 8 < sizeof(sAmbiguous))
+        {
+            strcat(sAmbiguous, ", ");
+            strcat(sAmbiguous, disasm->symbols->indexStrings + disasm->symbols->indexModules[disasm->symbols->indexSymbols[i].module].name);
+        }
+    }
+    if (matches > 1)
+    {
+        *ambiguous = sAmbiguous;
+        return NULL;
+    }
+    if (found == NULL)
+        return NULL;
+    *kind = found->kind;
+    return disasm->symbols->indexStrings + found->name;
+}
+
+// State
+
+// Sets up the state of disasm. Returns false if there isn't the memory for it.
+bool symbols_init(struct NdsDisasm *disasm)
+{
+    disasm->symbols = calloc(1, sizeof(*disasm->symbols));
+    return disasm->symbols != NULL;
+}
+
+void symbols_free(struct NdsDisasm *disasm)
+{
+    if (disasm->symbols == NULL)
+        return;
+    symbols_close(disasm);
+    build_free(disasm);
+    free(disasm->symbols);
+    disasm->symbols = NULL;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks the fast path decoder against capstone with -V, over every Thumb
+# halfword, a sample of ARM words covering every combination of the opcode bits
+# it decodes, and a small module of pseudorandom bytes. -V fails on a mismatch.
+#
+# USAGE: decoder.sh NDSDISASM [DIR]
+
+set -e
+ndsdisasm=$1
+dir=${2:-.}
+
+LC_ALL=C awk 'BEGIN { srand(8); for (i = 0; i < 4096; i++) printf "%c", int(rand() * 256) }' > "$dir/decoder.bin"
+: > "$dir/decoder.cfg"
+
+"$ndsdisasm" -O -V -c "$dir/decoder.cfg" "$dir/decoder.bin" > /dev/null 2> "$dir/decoder.log" || {
+    cat "$dir/decoder.log" >&2
+    exit 1
+}
+grep "fast path" "$dir/decoder.log"
+grep -q "thumb patterns:" "$dir/decoder.log"
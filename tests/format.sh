@@ -0,0 +1,42 @@
+#!/bin/sh
+# Compares the disassembly byte for byte with what -F prints, which decodes and
+# prints every instruction with capstone like before the fast path: on a module
+# of pseudorandom code, and on the ARM9 static module of the ROM named by
+# NDSDISASM_TEST_ROM with config/pokediamond.cfg if that is set.
+#
+# USAGE: format.sh NDSDISASM [DIR]
+
+set -e
+ndsdisasm=$1
+dir=${2:-.}
+config=$(dirname "$0")/../config/pokediamond.cfg
+
+# compare NAME ARGS...
+compare()
+{
+    name=$1
+    shift
+    "$ndsdisasm" -s "$@" > "$dir/$name.s" 2> "$dir/$name.log" || { cat "$dir/$name.log" >&2; exit 1; }
+    # the fast path is off if it doesn't match capstone, which would leave nothing to compare
+    if grep -q " 0 instructions from the fast path" "$dir/$name.log"; then
+        grep "fast path" "$dir/$name.log" >&2
+        exit 1
+    fi
+    "$ndsdisasm" -F "$@" > "$dir/$name-capstone.s" 2> "$dir/$name.log" || { cat "$dir/$name.log" >&2; exit 1; }
+    cmp "$dir/$name.s" "$dir/$name-capstone.s"
+    echo "$name: $(wc -l < "$dir/$name.s") lines match"
+}
+
+LC_ALL=C awk 'BEGIN { srand(7); for (i = 0; i < 65536; i++) printf "%c", int(rand() * 256) }' > "$dir/format.bin"
+awk 'BEGIN {
+    srand(7)
+    for (addr = 32; addr < 49152; addr += 4 * int(1 + rand() * 64))
+        printf "%s 0x%X\n", rand() < 0.5 ? "arm_func" : "thumb_func", addr
+}' > "$dir/format.cfg"
+compare format -O -c "$dir/format.cfg" "$dir/format.bin"
+
+if [ -n "$NDSDISASM_TEST_ROM" ]; then
+    compare format-rom -c "$config" "$NDSDISASM_TEST_ROM"
+else
+    echo "NDSDISASM_TEST_ROM isn't set, so no real module is compared"
+fi
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Analyzes a module of pseudorandom code from pseudorandom labels with -V, which
+# fails if splicing traces onto already traced code changes the labels found
+# compared with tracing every label over its whole window.
+#
+# USAGE: splicing.sh NDSDISASM [DIR]
+
+set -e
+ndsdisasm=$1
+dir=${2:-.}
+
+LC_ALL=C awk 'BEGIN { srand(5); for (i = 0; i < 65536; i++) printf "%c", int(rand() * 256) }' > "$dir/splicing.bin"
+awk 'BEGIN {
+    srand(5)
+    for (addr = 32; addr < 49152; addr += 4 * int(1 + rand() * 64))
+        printf "%s 0x%X\n", rand() < 0.5 ? "arm_func" : "thumb_func", addr
+}' > "$dir/splicing.cfg"
+
+"$ndsdisasm" -O -s -V -c "$dir/splicing.cfg" "$dir/splicing.bin" > /dev/null 2> "$dir/splicing.log" || {
+    cat "$dir/splicing.log" >&2
+    exit 1
+}
+# with nothing spliced, there would be nothing to compare
+grep "verify: splicing:" "$dir/splicing.log"
+grep "traces spliced" "$dir/splicing.log"
+! grep -q " 0 traces spliced" "$dir/splicing.log"